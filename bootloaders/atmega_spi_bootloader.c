@@ -63,9 +63,8 @@
 /* Licence can be viewed at                               */
 /* http://www.fsf.org/licenses/gpl.txt                    */
 /*                                                        */
-/* Target = Atmel AVR m128,m64,m32,m16,m8,m162,m163,m169, */
-/* m8515,m8535. ATmega161 has a very small boot block so  */
-/* isn't supported.                                       */
+/* Target = Atmel AVR m88,m168,m328,m328p, the parts of   */
+/* boot_devices.h                                         */
 /*                                                        */
 /* Tested with m168                                       */
 /**********************************************************/
@@ -80,13 +79,18 @@
 #include <avr/wdt.h>
 #include <avr/eeprom.h>
 #include <util/delay.h>
+#include <util/crc16.h>
+#include <avr/sleep.h>
+
+#include "boot_devices.h"
+#include "boot_api.h"
 
 /* for use with simavr */
 #include <avr/avr_mcu_section.h>
-AVR_MCU(F_CPU, "atmega328p");
-AVR_MCU_LONG(AVR_MMCU_TAG_LFUSE, (0xE2));
-AVR_MCU_LONG(AVR_MMCU_TAG_HFUSE, (0xD8));
-AVR_MCU_LONG(AVR_MMCU_TAG_EFUSE, (0xFD));
+AVR_MCU(F_CPU, BOOT_DEV_NAME);
+AVR_MCU_LONG(AVR_MMCU_TAG_LFUSE, (BOOT_LFUSE));
+AVR_MCU_LONG(AVR_MMCU_TAG_HFUSE, (BOOT_HFUSE));
+AVR_MCU_LONG(AVR_MMCU_TAG_EFUSE, (BOOT_EFUSE));
 
 /* Use the F_CPU defined in Makefile */
 
@@ -94,7 +98,16 @@ AVR_MCU_LONG(AVR_MMCU_TAG_EFUSE, (0xFD));
 /* 20070626: hacked by David A. Mellis to decrease waiting time for auto-reset */
 /* set the waiting time for the bootloader */
 /* get this from the Makefile instead */
-/* #define MAX_TIME_COUNT (F_CPU>>4) */
+
+/* how long to wait for the host to clock a transaction before starting
+   the application. Timer1 runs at clk/256, so at most 65535 ticks */
+#ifndef SPI_TIMEOUT_MS
+#define SPI_TIMEOUT_MS 500
+#endif
+#define SPI_TIMEOUT_TICKS ((uint16_t)((F_CPU / 256UL) * SPI_TIMEOUT_MS / 1000UL))
+#if (F_CPU / 256UL) * SPI_TIMEOUT_MS / 1000UL > 65535UL
+#error "SPI_TIMEOUT_MS is too long for Timer1 at clk/256"
+#endif
 
 /* 20070707: hacked by David A. Mellis - after this many errors give up and launch application */
 #define MAX_ERROR_COUNT 5
@@ -175,92 +188,155 @@ AVR_MCU_EXTERNAL_PORT_PULL('D', (1<<3), 1)
 /* manufacturer byte is always the same */
 #define SIG1	0x1E	// Yep, Atmel is the only manufacturer of AVR micros.  Single source :(
 
-#if defined __AVR_ATmega1280__
-#define SIG2	0x97
-#define SIG3	0x03
-#define PAGE_SIZE	0x80U	//128 words
-
-#elif defined __AVR_ATmega1281__
-#define SIG2	0x97
-#define SIG3	0x04
-#define PAGE_SIZE	0x80U	//128 words
-
-#elif defined __AVR_ATmega128__
-#define SIG2	0x97
-#define SIG3	0x02
-#define PAGE_SIZE	0x80U	//128 words
-
-#elif defined __AVR_ATmega64__
-#define SIG2	0x96
-#define SIG3	0x02
-#define PAGE_SIZE	0x80U	//128 words
-
-#elif defined __AVR_ATmega32__
-#define SIG2	0x95
-#define SIG3	0x02
-#define PAGE_SIZE	0x40U	//64 words
-
-#elif defined __AVR_ATmega16__
-#define SIG2	0x94
-#define SIG3	0x03
-#define PAGE_SIZE	0x40U	//64 words
-
-#elif defined __AVR_ATmega8__
-#define SIG2	0x93
-#define SIG3	0x07
-#define PAGE_SIZE	0x20U	//32 words
-
-#elif defined __AVR_ATmega88__
-#define SIG2	0x93
-#define SIG3	0x0a
-#define PAGE_SIZE	0x20U	//32 words
-
-#elif defined __AVR_ATmega168__
-#define SIG2	0x94
-#define SIG3	0x06
-#define PAGE_SIZE	0x40U	//64 words
-
-#elif defined __AVR_ATmega328P__
-#define SIG2	0x95
-#define SIG3	0x0F
-#define PAGE_SIZE	0x40U	//64 words
-
-#elif defined __AVR_ATmega328__
-#define SIG2	0x95
-#define SIG3	0x14
-#define PAGE_SIZE	0x40U	//64 words
-
-#elif defined __AVR_ATmega162__
-#define SIG2	0x94
-#define SIG3	0x04
-#define PAGE_SIZE	0x40U	//64 words
-
-#elif defined __AVR_ATmega163__
-#define SIG2	0x94
-#define SIG3	0x02
-#define PAGE_SIZE	0x40U	//64 words
-
-#elif defined __AVR_ATmega169__
-#define SIG2	0x94
-#define SIG3	0x05
-#define PAGE_SIZE	0x40U	//64 words
-
-#elif defined __AVR_ATmega8515__
-#define SIG2	0x93
-#define SIG3	0x06
-#define PAGE_SIZE	0x20U	//32 words
-
-#elif defined __AVR_ATmega8535__
-#define SIG2	0x93
-#define SIG3	0x08
-#define PAGE_SIZE	0x20U	//32 words
-#endif
+/* the rest come from the device table, boot_devices.h */
+#define SIG2	BOOT_DEV_SIG2
+#define SIG3	BOOT_DEV_SIG3
+#define PAGE_SIZE	BOOT_DEV_PAGE	// words
 
 
 /* function prototypes */
 void spi_txn(uint8_t b1, uint8_t b2, uint8_t b3, uint8_t b4);
 void byte_response(uint8_t);
 void flash_led(uint8_t);
+uint8_t page_matches(uint16_t addr, uint16_t len);
+uint8_t do_spm(uint8_t op, uint16_t addr, uint16_t data) __attribute__ ((used, noinline));
+void write_page(uint16_t addr, uint16_t len);
+void queue_page(uint16_t addr, uint16_t len);
+void spm_poll(void);
+void spm_drain(void);
+void copy_page(uint16_t dst, uint16_t src);
+void stage_copy(void);
+
+/* the bootloader starts with the vector table, nothing at or above it
+   can be erased or written */
+extern void __vectors(void);
+#define BOOT_START ((uint16_t)__vectors << 1)
+
+/* counters for the 's' command, kept across the watchdog resets of a
+   programming session and cleared at power on. The times are in Timer1
+   ticks of 256 cycles */
+#if defined(BOOT_STATS)
+#define BOOT_STATS_VERSION 1
+#define BOOT_STATS_MAGIC 0xb007
+
+struct boot_stats {
+	uint32_t txns;
+	uint16_t wcol;
+	uint16_t timeouts;
+	uint16_t pages_written;
+	uint16_t pages_skipped;
+	uint16_t sessions;
+	uint16_t reserved;
+	uint32_t erase_ticks;
+	uint32_t write_ticks;
+	uint32_t wait_ticks;
+};
+
+struct boot_stats stats __attribute__ ((section (".noinit")));
+uint16_t stats_magic __attribute__ ((section (".noinit")));
+
+#define STATS_INC(field) (stats.field++)
+#define STATS_TIMER_START(t) uint16_t t = TCNT1
+#define STATS_TIMER_ADD(field, t) (stats.field += (uint16_t)(TCNT1 - (t)))
+/* a queued page is timed until spm_poll sees the SPM done */
+uint16_t spm_start;
+#define STATS_SPM_START() (spm_start = TCNT1)
+#define STATS_SPM_ADD(field) STATS_TIMER_ADD(field, spm_start)
+#else
+#define STATS_INC(field)
+#define STATS_TIMER_START(t)
+#define STATS_TIMER_ADD(field, t)
+#define STATS_SPM_START()
+#define STATS_SPM_ADD(field)
+#endif
+
+/* idle sleep while waiting for the host. The SPI and Timer1 compare
+   interrupts wake the cpu, their vectors are moved to the boot section
+   as the application area is being written. Taking a vector clears
+   SPIF and OCF1A, so the handlers leave a flag in GPIOR0 instead. The
+   timed SPM and EEPROM write sequences can't be interrupted */
+#if defined(IDLE_SLEEP)
+#define WAKE_SPI 0
+#define WAKE_TIMEOUT 1
+
+#define TIMED_START() uint8_t sreg = SREG; cli()
+#define TIMED_END() (SREG = sreg)
+#else
+#define TIMED_START()
+#define TIMED_END()
+#endif
+
+/* fill the free SRAM with a known byte at reset, the 'm' command finds
+   how far down the stack has ever been by looking for it */
+#if defined(SRAM_PAINT)
+#define SRAM_PAINT_BYTE 0xc5
+
+extern uint8_t _end;
+extern uint8_t __stack;
+
+void sram_paint(void) __attribute__ ((naked, used, section (".init1")));
+
+/* runs before the stack and r1 are set up, so plain asm, from the end of
+   the globals to the top of the stack */
+void sram_paint(void)
+{
+    __asm volatile (
+        "    ldi r30, lo8(_end)\n"
+        "    ldi r31, hi8(_end)\n"
+        "    ldi r24, %0\n"
+        "    ldi r25, hi8(__stack)\n"
+        "    rjmp 2f\n"
+        "1:  st Z+, r24\n"
+        "2:  cpi r30, lo8(__stack)\n"
+        "    cpc r31, r25\n"
+        "    brlo 1b\n"
+        "    breq 1b\n"
+        :
+        : "i" (SRAM_PAINT_BYTE)
+        : "memory");
+}
+#endif
+
+/* A/B slots, the state is read at reset and kept here for the 'a', 'c',
+   'k' and 'r' commands. boot_reset tells a reset the bootloader did
+   from one that counts as an attempt of an image on trial */
+#if defined(BOOT_AB)
+#define BOOT_RESET_MAGIC 0xb4e7
+
+#define BOOT_AB_SLOT_PAGES (BOOT_AB_SLOT_SIZE / SPM_PAGESIZE)
+
+#if BOOT_AB_SCRATCH + SPM_PAGESIZE > BOOT_DEV_BOOT
+#error "BOOT_AB_SLOT_SIZE too big, the slots and scratch page overlap the boot section"
+#endif
+
+struct boot_api_ab ab;
+uint16_t boot_reset __attribute__ ((section (".noinit")));
+
+void ab_boot(uint8_t starting);
+void ab_save(void);
+uint16_t flash_crc(uint16_t addr, uint16_t pages);
+#endif
+
+/* fixed entry points for the application, placed at BOOT_API_ADDR by
+   the link, whatever the size of the bootloader. Parts with 8 KB of
+   flash have no jmp, the rjmp is padded to keep the table 8 bytes */
+#if FLASHEND > 0x1fff
+#define BOOT_API_JMP "    jmp do_spm\n"
+#else
+#define BOOT_API_JMP "    rjmp do_spm\n    nop\n"
+#endif
+
+void boot_api_table(void) __attribute__ ((naked, used, section (".bootapi")));
+
+void boot_api_table(void)
+{
+    __asm volatile (
+        BOOT_API_JMP
+        "    .word %0\n"
+        "    .word %1\n"
+        :
+        : "i" (BOOT_API_VERSION), "i" (BOOT_API_MAGIC));
+}
 
 /* some variables */
 union address_union {
@@ -278,7 +354,7 @@ struct flags_struct {
 	unsigned rampz  : 1;
 } flags;
 
-uint8_t buff[256];
+uint8_t buff[BOOT_DEV_BUFFER];
 uint8_t address_high;
 
 uint8_t pagesz=0x80;
@@ -289,8 +365,24 @@ uint8_t error_count = 0;
 
 uint8_t spi_txn_buf[4];
 
+/* the flash page being written in the background, and how many pages
+   were queued and are done, sent back at the start of every command */
+#define SPM_IDLE 0
+#define SPM_ERASE 1
+#define SPM_WRITE 2
+
+uint8_t spm_state = SPM_IDLE;
+uint16_t spm_addr;
+uint8_t spm_queued = 0;
+uint8_t spm_done = 0;
+
 void app_start(void)
 {
+    // don't reset in the middle of a page
+    spm_drain();
+#if defined(BOOT_AB)
+    boot_reset = BOOT_RESET_MAGIC;
+#endif
     // autoreset via watchdog (sneaky!)
     WDTCSR = _BV(WDE);
     while (1); // 16 ms
@@ -301,6 +393,14 @@ int main(void)
 {
 	uint8_t idx;
 	uint16_t w;
+
+    // keep the reset cause and clear it, PORF would stay set across the
+    // watchdog resets of a session and WDRF keeps the watchdog on
+#if defined(BOOT_STATS)
+    uint8_t reset_cause = MCUSR;
+#endif
+    MCUSR = 0;
+    wdt_disable();
     
     // button pin stays low
     BUTTON_DDR |= _BV(BUTTON);
@@ -310,9 +410,38 @@ int main(void)
     // so set to input, no pullup, as it has external pull down
     BOOT_DDR &= ~_BV(BOOT);
 
+    // an update the application staged while it was running
+    stage_copy();
+#if defined(BOOT_AB)
+    ab_boot(!(BOOT_PIN & _BV(BOOT)));
+#endif
+
     // if the application pin is low, jump to app
     if (!(BOOT_PIN & _BV(BOOT)))
         app_start();
+
+#if defined(BOOT_STATS)
+    if (stats_magic != BOOT_STATS_MAGIC || (reset_cause & (_BV(PORF)|_BV(BORF)))) {
+        for (idx=0; idx<sizeof(stats); idx++)
+            ((uint8_t *)&stats)[idx] = 0;
+        stats_magic = BOOT_STATS_MAGIC;
+    }
+    stats.sessions++;
+#endif
+
+    // Timer1 free running at clk/256, for the transaction timeout and
+    // the SPM and wait times
+    TCCR1A = 0;
+    TCCR1B = _BV(CS12);
+
+#if defined(IDLE_SLEEP)
+    // vectors to the boot section, the application's may be half written
+    MCUCR = _BV(IVCE);
+    MCUCR = _BV(IVSEL);
+    GPIOR0 = 0;
+    TIMSK1 = _BV(OCIE1A);
+    set_sleep_mode(SLEEP_MODE_IDLE);
+#endif
     
 #if defined(POWER_MONITOR_BOOTLOADER)
     // enable pin (4) is high
@@ -337,7 +466,12 @@ int main(void)
     DDRB |= _BV(4);
 
     // enable SPI
+#if defined(IDLE_SLEEP)
+    SPCR = _BV(SPE) | _BV(SPIE);
+    sei();
+#else
     SPCR = _BV(SPE);
+#endif
     
 	/* set LED pin as output */
 	LED_DDR |= _BV(LED);
@@ -354,9 +488,14 @@ int main(void)
 	/* forever loop */
 	for (;;) {
 
-        // get some bytes
-        spi_txn(0,0,0,0);
+        // get some bytes, the reply is the state of the page writes
+        spi_txn(spm_state, spm_queued, spm_done, 0);
 
+        // only the next flash write can come in while a page is being
+        // written, everything else waits for it
+        if (spi_txn_buf[0] != 'd' && spi_txn_buf[0] != 'U' &&
+            spi_txn_buf[0] != '0' && spi_txn_buf[0] != 'u')
+            spm_drain();
 
         /* A bunch of if...else if... gives smaller code than switch...case ! */
 
@@ -387,6 +526,9 @@ int main(void)
             flags.eeprom = 0;
             if (spi_txn_buf[3] == 'E')
                 flags.eeprom = 1;
+            // flash or eeprom, the data has to fit in the buffer
+            if (length.word > sizeof(buff))
+                app_start();
             spi_txn(0,0,0,0);
             // Store data in buffer, can't keep up with data stream whilst programming pages
             for (w=0,idx=0; w<length.word; w++,idx++) {
@@ -401,11 +543,14 @@ int main(void)
                 if (spi_txn_buf[idx] != 0)
                     app_start();
             if (flags.eeprom) {		                //Write to EEPROM one byte at a time
+                spm_drain();
                 address.word <<= 1;
+                TIMED_START();
                 for(w=0; w<length.word; w++) {
                     eeprom_write_byte((void *)address.word,buff[w]);
                     address.word++;
                 }			
+                TIMED_END();
             }
             else {					        //Write to FLASH one page at a time
 
@@ -417,24 +562,23 @@ int main(void)
                     address_high = 0x01;	//Only possible with m128, m256 will need 3rd address byte. FIXME
                 else
                     address_high = 0x00;
-#if defined(__AVR_ATmega128__) || defined(__AVR_ATmega1280__) || defined(__AVR_ATmega1281__)
+#if BOOT_DEV_RAMPZ
                 RAMPZ = address_high;
 #endif
                 address.word = address.word << 1;	        //address * 2 -> byte location
                 /* if ((length.byte[0] & 0x01) == 0x01) length.word++;	//Even up an odd number of bytes */
                 if ((length.byte[0] & 0x01))
                     length.word++;	//Even up an odd number of bytes
-                cli();					//Disable interrupts, just to be sure
-
-                boot_page_erase_safe(address.word);
-                uint8_t* addr = buff;
-                for (uint16_t i=0; i<length.word; i+=2) {
-                    uint16_t w = *addr++;
-                    w += (*addr++) << 8;
-                    boot_page_fill_safe(address.word + i, w);
+                // the last page has to be done before the flash can be
+                // read, the data for this one came in while it was written
+                spm_drain();
+                // nothing to do if the page already holds what the
+                // write would leave in it
+                if (page_matches(address.word, length.word)) {
+                    STATS_INC(pages_skipped);
+                    continue;
                 }
-                boot_page_write_safe(address.word);
-                boot_rww_enable_safe();
+                queue_page(address.word, length.word);
             }
         }
 
@@ -442,7 +586,7 @@ int main(void)
         else if(spi_txn_buf[0]=='t') {
             length.byte[1] = spi_txn_buf[1];
             length.byte[0] = spi_txn_buf[2];
-#if defined(__AVR_ATmega128__) || defined(__AVR_ATmega1280__)
+#if BOOT_DEV_RAMPZ
             if (address.word>0x7FFF)
                 flags.rampz = 1;		// No go with m256, FIXME
             else
@@ -467,7 +611,7 @@ int main(void)
                 
                     if (!flags.rampz)
                         read_buf[idx] = pgm_read_byte_near(address.word);
-#if defined(__AVR_ATmega128__) || defined(__AVR_ATmega1280__)
+#if BOOT_DEV_RAMPZ
                     else
                         read_buf[idx] = pgm_read_byte_far(address.word + 0x10000);
                     // Hmmmm, yuck  FIXME when m256 arrvies
@@ -475,8 +619,9 @@ int main(void)
                 }
                 address.word++;
             }
-            // send remaining bytes via spi, if any..
-            if (idx < 4) {
+            // send the last bytes via spi, padded with zeros, the loop
+            // only sends a full read_buf when it starts the next one
+            if (idx > 0) {
                 for(;idx<4;idx++)
                     read_buf[idx] = 0;
                 spi_txn(read_buf[0], read_buf[1], read_buf[2], read_buf[3]);
@@ -489,38 +634,423 @@ int main(void)
             spi_txn('u',SIG1,SIG2,SIG3);
         }
 
+#if defined(SRAM_PAINT)
+        /* Get the SRAM use, bytes never touched above the globals,
+           deepest the stack has been and the end of the globals  */
+        else if(spi_txn_buf[0]=='m') {
+            uint8_t* p = &_end;
+            while (p <= &__stack && *p == SRAM_PAINT_BYTE)
+                p++;
+            w = p - &_end;
+            uint16_t depth = &__stack - p + 1;
+            spi_txn('m', w & 0xff, w >> 8, 0);
+            spi_txn(depth & 0xff, depth >> 8,
+                    (uint16_t)&_end & 0xff, (uint16_t)&_end >> 8);
+        }
+#endif
+
+#if defined(BOOT_AB)
+        /* Get the A/B state and where slot B starts  */
+        else if(spi_txn_buf[0]=='a') {
+            spi_txn('a', ab.state, ab.attempts, 0);
+            spi_txn(BOOT_AB_SLOT_B & 0xff, BOOT_AB_SLOT_B >> 8,
+                    ab.pages & 0xff, ab.pages >> 8);
+        }
+
+        /* CRC of pages of slot A or B, little endian, 'N' for more
+           pages than the slot has  */
+        else if(spi_txn_buf[0]=='c') {
+            uint16_t pages = spi_txn_buf[1] | (spi_txn_buf[2] << 8);
+            if (pages > BOOT_AB_SLOT_PAGES)
+                spi_txn('c', 0, 0, 'N');
+            else {
+                w = flash_crc(spi_txn_buf[3] == 'B' ? BOOT_AB_SLOT_B : 0, pages);
+                spi_txn('c', w & 0xff, w >> 8, 0);
+            }
+        }
+
+        /* Commit slot B, swapped in at the next reset if the CRC matches  */
+        else if(spi_txn_buf[0]=='k') {
+            uint16_t pages = spi_txn_buf[1] | (spi_txn_buf[2] << 8);
+            uint8_t attempts = spi_txn_buf[3];
+            spi_txn(0,0,0,0);
+            uint16_t crc = spi_txn_buf[0] | (spi_txn_buf[1] << 8);
+            // the page count from the host bounds the crc, the size in
+            // bytes would wrap
+            w = 0;
+            if (pages > 0 && pages <= BOOT_AB_SLOT_PAGES)
+                w = flash_crc(BOOT_AB_SLOT_B, pages);
+            idx = 'N';
+            if (w == crc && pages > 0 && pages <= BOOT_AB_SLOT_PAGES) {
+                ab.state = BOOT_AB_PENDING;
+                ab.attempts = attempts;
+                ab.pages = pages;
+                ab.crc = crc;
+                ab.journal = 0;
+                ab_save();
+                idx = 'Y';
+            }
+            spi_txn('k', idx, w & 0xff, w >> 8);
+        }
+
+        /* Roll back to the image in slot B at the next reset  */
+        else if(spi_txn_buf[0]=='r') {
+            idx = 'N';
+            if (ab.state == BOOT_AB_TRIAL || ab.state == BOOT_AB_CONFIRMED) {
+                ab.state = BOOT_AB_ROLLBACK;
+                ab_save();
+                idx = 'Y';
+            }
+            spi_txn('r', idx, 0, 0);
+        }
+#endif
+
+#if defined(BOOT_STATS)
+        /* Get the counters, 'C' in the 2nd byte clears them after  */
+        else if(spi_txn_buf[0]=='s') {
+            uint8_t clear = spi_txn_buf[1] == 'C';
+            // a copy, the counters move while they are sent
+            uint8_t* p = (uint8_t*)&stats;
+            for (idx=0; idx<sizeof(stats); idx++)
+                buff[idx] = p[idx];
+            spi_txn('s', BOOT_STATS_VERSION, sizeof(stats), 0);
+            for (idx=0; idx<sizeof(stats); idx+=4)
+                spi_txn(buff[idx], buff[idx+1], buff[idx+2], buff[idx+3]);
+            if (clear)
+                for (idx=0; idx<sizeof(stats); idx++)
+                    p[idx] = 0;
+        }
+#endif
+
 	} /* end of forever loop */
 
 }
 
+/* wait for the host to clock a byte, start the application if it takes
+   longer than the timeout set at the start of the transaction */
+#if defined(IDLE_SLEEP)
+ISR(SPI_STC_vect, ISR_NAKED)
+{
+    GPIOR0 |= _BV(WAKE_SPI);
+    reti();
+}
+
+ISR(TIMER1_COMPA_vect, ISR_NAKED)
+{
+    GPIOR0 |= _BV(WAKE_TIMEOUT);
+    reti();
+}
+#endif
+
+static inline uint8_t spi_wait(void)
+{
+#if defined(IDLE_SLEEP)
+    // the SPI STC and TIMER1 COMPA interrupts wake the cpu and leave
+    // their flag in GPIOR0. Check the flags with interrupts off, sei
+    // lets the sleep in before any interrupt so a wake can't be missed.
+    // The end of an SPM doesn't wake it, so while a page is being
+    // written it spins and moves the page on, and sleeps once it's done
+    for (;;) {
+        cli();
+        if (GPIOR0 & (_BV(WAKE_SPI) | _BV(WAKE_TIMEOUT)))
+            break;
+        if (spm_state == SPM_IDLE) {
+            sleep_enable();
+            sei();
+            sleep_cpu();
+            sleep_disable();
+        }
+        else {
+            sei();
+            spm_poll();
+        }
+    }
+    sei();
+    if (!(GPIOR0 & _BV(WAKE_SPI))) {
+        STATS_INC(timeouts);
+        app_start();
+    }
+    GPIOR0 &= ~_BV(WAKE_SPI);
+#else
+    // the write follows the erase as soon as it's done, not only at the
+    // next transaction, a host that takes its time doesn't hold it up
+    while (!(SPSR & _BV(SPIF))) {
+        if (spm_state != SPM_IDLE)
+            spm_poll();
+        if (TIFR1 & _BV(OCF1A)) {
+            STATS_INC(timeouts);
+            app_start();
+        }
+    }
+#endif
+    if (SPSR & _BV(WCOL)) {
+        STATS_INC(wcol);
+        if (error_count++ == MAX_ERROR_COUNT)
+            app_start();
+    }
+    return SPDR;
+}
+
 void spi_txn(uint8_t b1, uint8_t b2, uint8_t b3, uint8_t b4)
 {
-    // button pin low to signal ready for more
+    spm_poll();
+    // load the first byte before signalling ready, otherwise a quick
+    // controller clocks out whatever was left in SPDR
+    SPDR = b1;
+    OCR1A = TCNT1 + SPI_TIMEOUT_TICKS;
+    TIFR1 = _BV(OCF1A);
+#if defined(IDLE_SLEEP)
+    GPIOR0 &= ~_BV(WAKE_TIMEOUT);
+#endif
+    STATS_TIMER_START(wait_start);
+    // button pin low to signal ready for more, it stays low until the
+    // host clocks the first byte
     BUTTON_PORT &= ~_BV(BUTTON);
-    uint32_t count = 0;
-    for (int i=0; i<4; i++) {
-        if (i == 0)
-            SPDR = b1;
-        else if (i == 1)
-            SPDR = b2;
-        else if (i == 2)
-            SPDR = b3;
+    spi_txn_buf[0] = spi_wait();
+    SPDR = b2;
+    BUTTON_PORT |= _BV(BUTTON);
+    spi_txn_buf[1] = spi_wait();
+    SPDR = b3;
+    spi_txn_buf[2] = spi_wait();
+    SPDR = b4;
+    spi_txn_buf[3] = spi_wait();
+    STATS_TIMER_ADD(wait_ticks, wait_start);
+    STATS_INC(txns);
+}
+
+/* does the flash page holding addr have len bytes of buff at addr and
+   is erased everywhere else, as a page write would leave it */
+uint8_t page_matches(uint16_t addr, uint16_t len)
+{
+    uint16_t page = addr & ~((PAGE_SIZE<<1) - 1);
+    for (uint16_t i=page; i<page + (PAGE_SIZE<<1); i++) {
+        uint8_t b = 0xff;
+        if (i >= addr && i - addr < len)
+            b = buff[i - addr];
+        if (pgm_read_byte_near(i) != b)
+            return 0;
+    }
+    return 1;
+}
+
+/* erase or write the page holding addr, or fill the word at addr in the
+   page buffer, for the bootloader and the application. The SPM is done
+   with interrupts off, the application's vectors aren't readable until
+   the RWW section is enabled again */
+uint8_t do_spm(uint8_t op, uint16_t addr, uint16_t data)
+{
+    if (addr >= BOOT_START)
+        return BOOT_API_REFUSED;
+    uint8_t sreg = SREG;
+    cli();
+    eeprom_busy_wait();
+    boot_spm_busy_wait();
+    if (op == BOOT_API_FILL)
+        boot_page_fill(addr, data);
+    else {
+        if (op == BOOT_API_ERASE)
+            boot_page_erase(addr);
         else
-            SPDR = b4;
-        while (!(SPSR & _BV(SPIF))) {
-            count++;
-            if (count > MAX_TIME_COUNT)
-                app_start();
-            // take button pin back high
-            BUTTON_PORT |= _BV(BUTTON);
+            boot_page_write(addr);
+        boot_spm_busy_wait();
+        boot_rww_enable();
+    }
+    SREG = sreg;
+    return BOOT_API_OK;
+}
+
+/* erase the page holding addr and write len bytes of buff from addr,
+   only at reset before interrupts are on */
+void write_page(uint16_t addr, uint16_t len)
+{
+    STATS_TIMER_START(erase_start);
+    do_spm(BOOT_API_ERASE, addr, 0);
+    STATS_TIMER_ADD(erase_ticks, erase_start);
+    STATS_TIMER_START(write_start);
+    uint8_t* p = buff;
+    for (uint16_t i=0; i<len; i+=2) {
+        uint16_t w = *p++;
+        w += (*p++) << 8;
+        boot_page_fill_safe(addr + i, w);
+    }
+    do_spm(BOOT_API_WRITE, addr, 0);
+    STATS_TIMER_ADD(write_ticks, write_start);
+    STATS_INC(pages_written);
+}
+
+/* start writing len bytes of buff at addr and return. The page buffer
+   is filled before the erase, so buff is free again straight away, and
+   spm_poll starts the write once the erase is done */
+void queue_page(uint16_t addr, uint16_t len)
+{
+    if (addr >= BOOT_START)
+        return;
+    uint8_t* p = buff;
+    // no SPM at all while an eeprom write is going, the fills would be
+    // dropped and the page written as 0xff
+    eeprom_busy_wait();
+    boot_spm_busy_wait();
+    TIMED_START();
+    for (uint16_t i=0; i<len; i+=2) {
+        uint16_t w = *p++;
+        w += (*p++) << 8;
+        boot_page_fill(addr + i, w);
+    }
+    boot_page_erase(addr);
+    TIMED_END();
+    STATS_SPM_START();
+    spm_addr = addr;
+    spm_state = SPM_ERASE;
+    spm_queued++;
+    STATS_INC(pages_written);
+}
+
+/* move a queued page on when the SPM is done, nothing in the RWW
+   section can be read until it is idle again */
+void spm_poll(void)
+{
+    if (spm_state == SPM_IDLE || (SPMCSR & _BV(SPMEN)))
+        return;
+    TIMED_START();
+    if (spm_state == SPM_ERASE) {
+        STATS_SPM_ADD(erase_ticks);
+        boot_page_write(spm_addr);
+        STATS_SPM_START();
+        spm_state = SPM_WRITE;
+    }
+    else {
+        STATS_SPM_ADD(write_ticks);
+        boot_rww_enable();
+        boot_spm_busy_wait();
+        spm_state = SPM_IDLE;
+        spm_done++;
+    }
+    TIMED_END();
+}
+
+void spm_drain(void)
+{
+    while (spm_state != SPM_IDLE)
+        spm_poll();
+}
+
+/* copy the page at src over the page at dst, through buff */
+void copy_page(uint16_t dst, uint16_t src)
+{
+    for (uint16_t i=0; i<(PAGE_SIZE<<1); i++)
+        buff[i] = pgm_read_byte_near(src + i);
+    write_page(dst, PAGE_SIZE<<1);
+}
+
+/* copy a staged update down over the application. The staged pages are
+   left alone, so a reset part way through copies them again */
+void stage_copy(void)
+{
+    struct boot_api_stage stage;
+    eeprom_read_block(&stage, (void *)BOOT_API_STAGE_EE, sizeof(stage));
+    if (stage.magic != BOOT_API_STAGE_MAGIC)
+        return;
+    uint16_t len = stage.pages * (PAGE_SIZE<<1);
+    // page aligned, below the bootloader and not overlapping the copy
+    if (stage.pages <= BOOT_START / (PAGE_SIZE<<1) &&
+        !(stage.src & ((PAGE_SIZE<<1) - 1)) &&
+        stage.src >= len && stage.src <= BOOT_START - len) {
+        for (uint16_t addr=0; addr<len; addr+=PAGE_SIZE<<1)
+            copy_page(addr, stage.src + addr);
+    }
+    eeprom_write_word((uint16_t *)BOOT_API_STAGE_EE, 0xffff);
+}
+
+#if defined(BOOT_AB)
+void ab_save(void)
+{
+    TIMED_START();
+    eeprom_update_block(&ab, (void *)BOOT_API_AB_EE, sizeof(ab));
+    TIMED_END();
+}
+
+uint16_t flash_crc(uint16_t addr, uint16_t pages)
+{
+    uint16_t crc = 0xffff;
+    for (uint16_t i=0; i<pages * (PAGE_SIZE<<1); i++)
+        crc = _crc16_update(crc, pgm_read_byte_near(addr + i));
+    return crc;
+}
+
+/* swap slots A and B a page at a time through the scratch page. The
+   journal is moved on after every page write, a reset part way through
+   picks up at the same step, and each step can be done twice */
+static void ab_swap(void)
+{
+    while ((ab.journal >> 2) < ab.pages) {
+        uint16_t a = (ab.journal >> 2) * (PAGE_SIZE<<1);
+        uint8_t step = ab.journal & 3;
+        if (step == 0) {
+            uint16_t i;
+            for (i=0; i<(PAGE_SIZE<<1); i++)
+                if (pgm_read_byte_near(a + i) != pgm_read_byte_near(BOOT_AB_SLOT_B + a + i))
+                    break;
+            // the same in both slots, nothing to swap
+            if (i == (PAGE_SIZE<<1)) {
+                ab.journal += 4;
+                ab_save();
+                continue;
+            }
+            copy_page(BOOT_AB_SCRATCH, a);
         }
-        if (SPSR & _BV(WCOL)) {
-            if (error_count++ == MAX_ERROR_COUNT)
-                app_start();
+        else if (step == 1)
+            copy_page(a, BOOT_AB_SLOT_B + a);
+        else
+            copy_page(BOOT_AB_SLOT_B + a, BOOT_AB_SCRATCH);
+        ab.journal += step == 2 ? 2 : 1;
+        ab_save();
+    }
+}
+
+/* carry on with whatever the A/B state says at reset, starting is set
+   when the application is about to be started */
+void ab_boot(uint8_t starting)
+{
+    uint8_t counted = boot_reset != BOOT_RESET_MAGIC;
+    boot_reset = 0;
+    eeprom_read_block(&ab, (void *)BOOT_API_AB_EE, sizeof(ab));
+    // the layout has to fit below the bootloader
+    if (BOOT_AB_SCRATCH + (PAGE_SIZE<<1) > BOOT_START ||
+        ab.pages > BOOT_AB_SLOT_SIZE / (PAGE_SIZE<<1))
+        return;
+    if (ab.state == BOOT_AB_PENDING) {
+        if (flash_crc(BOOT_AB_SLOT_B, ab.pages) != ab.crc) {
+            ab.state = BOOT_AB_IDLE;
+            ab_save();
+            return;
         }
-        spi_txn_buf[i] = SPDR;
+        ab.state = BOOT_AB_SWAPPING;
+        ab.journal = 0;
+        ab_save();
+    }
+    if (ab.state == BOOT_AB_SWAPPING) {
+        ab_swap();
+        ab.state = BOOT_AB_TRIAL;
+        ab_save();
+        // the first start of the new image is an attempt
+        counted = 1;
+    }
+    if (ab.state == BOOT_AB_TRIAL && starting && counted) {
+        if (ab.attempts == 0)
+            ab.state = BOOT_AB_ROLLBACK;
+        else
+            ab.attempts--;
+        ab_save();
+    }
+    // slot B still has the old image, copying it back needs no journal
+    if (ab.state == BOOT_AB_ROLLBACK) {
+        for (uint16_t a=0; a<ab.pages * (PAGE_SIZE<<1); a+=PAGE_SIZE<<1)
+            copy_page(a, BOOT_AB_SLOT_B + a);
+        ab.state = BOOT_AB_ROLLED_BACK;
+        ab_save();
     }
 }
+#endif
 
 void byte_response(uint8_t val)
 {
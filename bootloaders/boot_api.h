@@ -0,0 +1,140 @@
+/*
+	boot_api.h
+    Copyright 2021 Greg Green <ggreen@bit-builder.com>
+
+ 	This file is part of avr_bootloaders.
+    Entry points the bootloader exports to the application, to write
+    flash pages while running and stage an update for the bootloader
+    to copy over the application at the next reset.
+ */
+
+#ifndef BOOT_API_H_
+#define BOOT_API_H_
+
+#include <stdint.h>
+#include <avr/io.h>
+#include <avr/pgmspace.h>
+#include <avr/eeprom.h>
+
+#include "boot_devices.h"
+
+#define BOOT_API_VERSION 1
+#define BOOT_API_MAGIC 0xb0a1
+
+/* byte address of the table in the last 8 bytes of the flash,
+   jmp spm, version, magic */
+#define BOOT_API_ADDR (FLASHEND - 7)
+
+/* operations for boot_api_spm */
+#define BOOT_API_ERASE 0
+#define BOOT_API_FILL 1
+#define BOOT_API_WRITE 2
+
+#define BOOT_API_OK 0
+#define BOOT_API_REFUSED 1
+
+/* the staged update marker at the end of the eeprom. At reset the
+   bootloader copies pages from src (a byte address, page aligned) down
+   to address 0, clears the magic and starts the application */
+#define BOOT_API_STAGE_EE (E2END - 5)
+#define BOOT_API_STAGE_MAGIC 0x57a6
+
+struct boot_api_stage {
+	uint16_t magic;
+	uint16_t src;
+	uint16_t pages;
+};
+
+/* A/B slots of a BOOT_AB build. Slot A is the application at 0, slot B
+   the same size right above it, and the page after slot B is scratch
+   for the swap. The state lives below the stage marker in the eeprom.
+   The slots fill the flash below the boot section unless the build
+   says otherwise */
+#ifndef BOOT_AB_SLOT_SIZE
+#define BOOT_AB_SLOT_SIZE BOOT_DEV_AB_SLOT
+#endif
+#define BOOT_AB_SLOT_B BOOT_AB_SLOT_SIZE
+#define BOOT_AB_SCRATCH (2 * BOOT_AB_SLOT_SIZE)
+#define BOOT_API_AB_EE (E2END - 13)
+
+/* nothing to do */
+#define BOOT_AB_IDLE 0xff
+/* slot B has a new image, swap it in at the next reset */
+#define BOOT_AB_PENDING 1
+#define BOOT_AB_SWAPPING 2
+/* slot A is on trial, slot B holds the old image */
+#define BOOT_AB_TRIAL 3
+/* the application said the new image works */
+#define BOOT_AB_CONFIRMED 4
+/* copy slot B back over slot A at the next reset */
+#define BOOT_AB_ROLLBACK 5
+#define BOOT_AB_ROLLED_BACK 6
+
+struct boot_api_ab {
+	uint8_t state;
+	uint8_t attempts;       // resets left before rolling back
+	uint16_t pages;         // image size in pages
+	uint16_t crc;           // crc16 of the image in slot B, _crc16_update from 0xffff
+	uint16_t journal;       // swap progress, page << 2 | step
+};
+
+typedef uint8_t (*boot_api_spm_t)(uint8_t op, uint16_t addr, uint16_t data);
+
+/* a bootloader without the table leaves erased flash there */
+static inline uint8_t boot_api_present(void)
+{
+    return pgm_read_word_near(BOOT_API_ADDR + 6) == BOOT_API_MAGIC &&
+        pgm_read_word_near(BOOT_API_ADDR + 4) >= BOOT_API_VERSION;
+}
+
+/* erase or write the page holding addr, or fill the word at addr in the
+   page buffer. Waits for the SPM to finish with interrupts off, and
+   refuses addresses in the bootloader */
+static inline uint8_t boot_api_spm(uint8_t op, uint16_t addr, uint16_t data)
+{
+    return ((boot_api_spm_t)(BOOT_API_ADDR >> 1))(op, addr, data);
+}
+
+/* write a whole page from SRAM, addr is page aligned */
+static inline uint8_t boot_api_write_page(uint16_t addr, const uint8_t * data)
+{
+    if (boot_api_spm(BOOT_API_ERASE, addr, 0) != BOOT_API_OK)
+        return BOOT_API_REFUSED;
+    for (uint16_t i=0; i<SPM_PAGESIZE; i+=2)
+        boot_api_spm(BOOT_API_FILL, addr + i, data[i] | (data[i+1] << 8));
+    return boot_api_spm(BOOT_API_WRITE, addr, 0);
+}
+
+/* ask for the pages at src to replace the application at the next reset */
+static inline void boot_api_stage(uint16_t src, uint16_t pages)
+{
+    struct boot_api_stage stage = {
+        .magic = BOOT_API_STAGE_MAGIC,
+        .src = src,
+        .pages = pages,
+    };
+    eeprom_update_block(&stage, (void *)BOOT_API_STAGE_EE, sizeof(stage));
+}
+
+/* the new image works, stop counting down to a rollback */
+static inline void boot_api_ab_confirm(void)
+{
+    if (eeprom_read_byte((uint8_t *)BOOT_API_AB_EE) == BOOT_AB_TRIAL)
+        eeprom_update_byte((uint8_t *)BOOT_API_AB_EE, BOOT_AB_CONFIRMED);
+}
+
+/* swap in the image the application wrote to slot B at the next reset,
+   the bootloader checks the crc first */
+static inline void boot_api_ab_commit(uint16_t pages, uint16_t crc, uint8_t attempts)
+{
+    struct boot_api_ab ab = {
+        .state = BOOT_AB_PENDING,
+        .attempts = attempts,
+        .pages = pages,
+        .crc = crc,
+        .journal = 0,
+    };
+    eeprom_update_block(&ab, (void *)BOOT_API_AB_EE, sizeof(ab));
+}
+
+#endif
@@ -0,0 +1,115 @@
+/*
+	boot_devices.h
+    Copyright 2021 Greg Green <ggreen@bit-builder.com>
+
+ 	This file is part of avr_bootloaders.
+    Parameters of each part the bootloader knows, picked by the -mmcu
+    of the build. Only the atmega88/168/328 family, the firmware needs
+    their TIMSK1, TIFR1, MCUSR, GPIOR0 and WDTCSR. bootloaders/devices.cmake has the parts the build
+    matrix covers and has to agree with this table.
+ */
+
+#ifndef BOOT_DEVICES_H_
+#define BOOT_DEVICES_H_
+
+#include <avr/io.h>
+
+/* BOOT_DEV_NAME      the -mmcu name, for simavr
+   BOOT_DEV_SIG2/3    signature bytes after 0x1e
+   BOOT_DEV_PAGE      flash page in words
+   BOOT_DEV_FLASH     flash in bytes
+   BOOT_DEV_RAM       sram in bytes
+   BOOT_DEV_BOOT      byte address of the largest boot section, BOOTSZ=00
+   BOOT_DEV_RAMPZ     1 if flash above 64k needs RAMPZ
+   BOOT_DEV_BUFFER    bytes of a 'd' write, at least a page, 256 where
+                      the sram allows for eeprom writes of the uploader
+   BOOT_DEV_HFUSE/EFUSE  high and extended fuse, the boot section above
+                      with BOOTRST programmed and brown-out at 2.7V */
+
+/*           name          sig2  sig3  page   flash    ram  boot     rampz buffer hfuse efuse */
+#if defined __AVR_ATmega88__
+#define BOOT_DEV(x) x("atmega88",   0x93, 0x0a, 0x20,   8192UL, 1024,  0x1800UL, 0, 256, 0xdd, 0xf8)
+#elif defined __AVR_ATmega168__
+#define BOOT_DEV(x) x("atmega168",  0x94, 0x06, 0x40,  16384UL, 1024,  0x3800UL, 0, 256, 0xdd, 0xf8)
+#elif defined __AVR_ATmega328P__
+#define BOOT_DEV(x) x("atmega328p", 0x95, 0x0f, 0x40,  32768UL, 2048,  0x7000UL, 0, 256, 0xd8, 0xfd)
+#elif defined __AVR_ATmega328__
+#define BOOT_DEV(x) x("atmega328",  0x95, 0x14, 0x40,  32768UL, 2048,  0x7000UL, 0, 256, 0xd8, 0xfd)
+#else
+#error "no entry in boot_devices.h for this part"
+#endif
+
+#define BOOT_DEV_NAME_(n, s2, s3, pg, fl, ram, boot, rampz, buf, hf, ef) n
+#define BOOT_DEV_SIG2_(n, s2, s3, pg, fl, ram, boot, rampz, buf, hf, ef) s2
+#define BOOT_DEV_SIG3_(n, s2, s3, pg, fl, ram, boot, rampz, buf, hf, ef) s3
+#define BOOT_DEV_PAGE_(n, s2, s3, pg, fl, ram, boot, rampz, buf, hf, ef) pg
+#define BOOT_DEV_FLASH_(n, s2, s3, pg, fl, ram, boot, rampz, buf, hf, ef) fl
+#define BOOT_DEV_RAM_(n, s2, s3, pg, fl, ram, boot, rampz, buf, hf, ef) ram
+#define BOOT_DEV_BOOT_(n, s2, s3, pg, fl, ram, boot, rampz, buf, hf, ef) boot
+#define BOOT_DEV_RAMPZ_(n, s2, s3, pg, fl, ram, boot, rampz, buf, hf, ef) rampz
+#define BOOT_DEV_BUFFER_(n, s2, s3, pg, fl, ram, boot, rampz, buf, hf, ef) buf
+#define BOOT_DEV_HFUSE_(n, s2, s3, pg, fl, ram, boot, rampz, buf, hf, ef) hf
+#define BOOT_DEV_EFUSE_(n, s2, s3, pg, fl, ram, boot, rampz, buf, hf, ef) ef
+
+#define BOOT_DEV_NAME BOOT_DEV(BOOT_DEV_NAME_)
+#define BOOT_DEV_SIG2 BOOT_DEV(BOOT_DEV_SIG2_)
+#define BOOT_DEV_SIG3 BOOT_DEV(BOOT_DEV_SIG3_)
+#define BOOT_DEV_PAGE BOOT_DEV(BOOT_DEV_PAGE_)
+#define BOOT_DEV_FLASH BOOT_DEV(BOOT_DEV_FLASH_)
+#define BOOT_DEV_RAM BOOT_DEV(BOOT_DEV_RAM_)
+#define BOOT_DEV_BOOT BOOT_DEV(BOOT_DEV_BOOT_)
+#define BOOT_DEV_RAMPZ BOOT_DEV(BOOT_DEV_RAMPZ_)
+#define BOOT_DEV_BUFFER BOOT_DEV(BOOT_DEV_BUFFER_)
+#define BOOT_DEV_HFUSE BOOT_DEV(BOOT_DEV_HFUSE_)
+#define BOOT_DEV_EFUSE BOOT_DEV(BOOT_DEV_EFUSE_)
+
+/* low fuse of the clock, the internal RC at 8 MHz and a crystal at 16,
+   as AVR_CLOCKS of devices.cmake */
+#if F_CPU == 8000000UL
+#define BOOT_DEV_LFUSE 0xe2
+#elif F_CPU == 16000000UL
+#define BOOT_DEV_LFUSE 0xff
+#endif
+
+/* the fuses for simavr, the build passes the ones it programs, which
+   are the table's unless the board has its own */
+#if !defined(BOOT_LFUSE) && defined(BOOT_DEV_LFUSE)
+#define BOOT_LFUSE BOOT_DEV_LFUSE
+#endif
+#if !defined(BOOT_HFUSE)
+#define BOOT_HFUSE BOOT_DEV_HFUSE
+#endif
+#if !defined(BOOT_EFUSE)
+#define BOOT_EFUSE BOOT_DEV_EFUSE
+#endif
+#if !defined(BOOT_LFUSE)
+#error "no low fuse in boot_devices.h for this F_CPU, pass BOOT_LFUSE"
+#endif
+
+/* the table against what avr-libc knows about the part */
+#if BOOT_DEV_PAGE * 2 != SPM_PAGESIZE
+#error "boot_devices.h page size doesn't match SPM_PAGESIZE"
+#endif
+#if BOOT_DEV_FLASH != FLASHEND + 1UL
+#error "boot_devices.h flash size doesn't match FLASHEND"
+#endif
+#if defined(RAMSTART) && BOOT_DEV_RAM != RAMEND - RAMSTART + 1
+#error "boot_devices.h sram size doesn't match RAMEND"
+#endif
+#if defined(SIGNATURE_2) && (BOOT_DEV_SIG2 != SIGNATURE_1 || BOOT_DEV_SIG3 != SIGNATURE_2)
+#error "boot_devices.h signature doesn't match avr-libc"
+#endif
+#if BOOT_DEV_BUFFER < SPM_PAGESIZE || BOOT_DEV_BUFFER > 256
+#error "boot_devices.h buffer has to hold a page and fit a 'd' length"
+#endif
+
+/* the build links .text at the start of the boot section */
+#if defined(BOOT_LINK_START) && BOOT_LINK_START != BOOT_DEV_BOOT
+#error "devices.cmake boot start doesn't match boot_devices.h"
+#endif
+
+/* default A/B slot size, two slots and the scratch page below the boot
+   section, whole pages */
+#define BOOT_DEV_AB_SLOT (((BOOT_DEV_BOOT - SPM_PAGESIZE) / 2) & ~(SPM_PAGESIZE - 1UL))
+
+#endif
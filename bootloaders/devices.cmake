@@ -0,0 +1,88 @@
+##################################################################################
+# parts the spi bootloader builds for, one row each. The sizes and boot
+# start have to agree with boot_devices.h, the build passes the boot
+# start down and the compile fails if they don't.
+#
+#   mcu         avrdude  page  flash  ram   boot start  rampz  hfuse  efuse
+#
+# page is in bytes, boot start is the byte address of the largest boot
+# section (BOOTSZ=00), where .text is linked. The high and extended
+# fuses select that boot section with BOOTRST programmed and the
+# brown-out at 2.7V. BOOTSZ and BOOTRST are in the extended fuse of the
+# atmega88/168 and BODLEVEL in the high fuse, the other way around on
+# the atmega328p.
+##################################################################################
+
+set(AVR_DEVICES
+  "atmega88    m88      64    8192   1024  0x1800      0      0xdd   0xf8"
+  "atmega168   m168     128   16384  1024  0x3800      0      0xdd   0xf8"
+  "atmega328p  m328p    128   32768  2048  0x7000      0      0xd8   0xfd"
+  )
+
+# clock sources, the low fuse of each F_CPU, CKDIV8 unprogrammed. The
+# same bits on all the parts above
+#
+#   F_CPU      lfuse  source
+set(AVR_CLOCKS
+  "8000000    0xe2   internal-rc"
+  "16000000   0xff   crystal"
+  )
+
+# clocks the matrix builds each part at, from AVR_CLOCKS
+set(AVR_DEVICE_CLOCKS 8000000 16000000 CACHE STRING "F_CPU of the matrix builds")
+
+# set ${prefix}_AVRDUDE, _PAGE, _FLASH, _RAM, _BOOT_START, _RAMPZ,
+# _HFUSE, _EFUSE and _API_START (the application's jump table in the
+# last 8 bytes of the flash) for a part of the table
+function(avr_device mcu prefix)
+  foreach(row ${AVR_DEVICES})
+    separate_arguments(fields UNIX_COMMAND "${row}")
+    list(GET fields 0 name)
+    if(name STREQUAL mcu)
+      list(GET fields 1 avrdude)
+      list(GET fields 2 page)
+      list(GET fields 3 flash)
+      list(GET fields 4 ram)
+      list(GET fields 5 boot_start)
+      list(GET fields 6 rampz)
+      list(GET fields 7 hfuse)
+      list(GET fields 8 efuse)
+      math(EXPR api_start "${flash} - 8")
+      set(${prefix}_AVRDUDE ${avrdude} PARENT_SCOPE)
+      set(${prefix}_PAGE ${page} PARENT_SCOPE)
+      set(${prefix}_FLASH ${flash} PARENT_SCOPE)
+      set(${prefix}_RAM ${ram} PARENT_SCOPE)
+      set(${prefix}_BOOT_START ${boot_start} PARENT_SCOPE)
+      set(${prefix}_RAMPZ ${rampz} PARENT_SCOPE)
+      set(${prefix}_HFUSE ${hfuse} PARENT_SCOPE)
+      set(${prefix}_EFUSE ${efuse} PARENT_SCOPE)
+      set(${prefix}_API_START ${api_start} PARENT_SCOPE)
+      return()
+    endif()
+  endforeach()
+  message(FATAL_ERROR "${mcu} is not in bootloaders/devices.cmake")
+endfunction()
+
+# set ${prefix}_LFUSE and _CLOCK_SOURCE for an F_CPU of AVR_CLOCKS
+function(avr_clock speed prefix)
+  foreach(row ${AVR_CLOCKS})
+    separate_arguments(fields UNIX_COMMAND "${row}")
+    list(GET fields 0 clock)
+    if(clock STREQUAL speed)
+      list(GET fields 1 lfuse)
+      list(GET fields 2 source)
+      set(${prefix}_LFUSE ${lfuse} PARENT_SCOPE)
+      set(${prefix}_CLOCK_SOURCE ${source} PARENT_SCOPE)
+      return()
+    endif()
+  endforeach()
+  message(FATAL_ERROR "F_CPU ${speed} is not in AVR_CLOCKS of bootloaders/devices.cmake")
+endfunction()
+
+# the mcu names of the table
+set(AVR_DEVICE_NAMES)
+foreach(row ${AVR_DEVICES})
+  separate_arguments(fields UNIX_COMMAND "${row}")
+  list(GET fields 0 name)
+  list(APPEND AVR_DEVICE_NAMES ${name})
+endforeach()
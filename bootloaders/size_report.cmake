@@ -0,0 +1,69 @@
+##################################################################################
+# size report of a bootloader elf against the boot section budget
+#
+# cmake -DELF=... -DAVR_SIZE=avr-size -DAVR_NM=avr-nm -DBUDGET=2048
+#       [-DTOP=20] -P size_report.cmake
+#
+# fails when .text, .data and .bootapi, which all go to flash, don't fit
+##################################################################################
+
+if(NOT TOP)
+  set(TOP 20)
+endif()
+
+execute_process(
+  COMMAND ${AVR_SIZE} -A ${ELF}
+  OUTPUT_VARIABLE sections
+  RESULT_VARIABLE result
+  )
+if(NOT result EQUAL 0)
+  message(FATAL_ERROR "${AVR_SIZE} failed on ${ELF}")
+endif()
+
+foreach(section text data bootapi bss noinit)
+  set(${section} 0)
+  if(sections MATCHES "\n\\.${section}[ \t]+([0-9]+)")
+    set(${section} ${CMAKE_MATCH_1})
+  endif()
+endforeach()
+math(EXPR flash "${text} + ${data} + ${bootapi}")
+math(EXPR ram "${data} + ${bss} + ${noinit}")
+math(EXPR left "${BUDGET} - ${flash}")
+
+message("${ELF}")
+message("  .text   ${text}")
+message("  .data   ${data}")
+message("  .bootapi ${bootapi}")
+message("  .bss    ${bss}")
+message("  .noinit ${noinit}")
+message("  flash   ${flash} of ${BUDGET} bytes, ${left} left")
+message("  sram    ${ram} bytes of globals")
+
+# biggest functions and variables first
+execute_process(
+  COMMAND ${AVR_NM} --size-sort --reverse-sort --print-size --radix=d ${ELF}
+  OUTPUT_VARIABLE symbols
+  )
+string(REPLACE "\n" ";" symbols "${symbols}")
+message("  largest symbols:")
+set(count 0)
+foreach(line ${symbols})
+  if(count LESS TOP AND line MATCHES "^[0-9]+ +0*([0-9]+) +([tTdDbB]) +(.+)$")
+    set(size ${CMAKE_MATCH_1})
+    set(type ${CMAKE_MATCH_2})
+    set(name ${CMAKE_MATCH_3})
+    if(type MATCHES "[tT]")
+      set(type "text")
+    elseif(type MATCHES "[dD]")
+      set(type "data")
+    else()
+      set(type "bss ")
+    endif()
+    message("    ${type} ${size}\t${name}")
+    math(EXPR count "${count} + 1")
+  endif()
+endforeach()
+
+if(left LESS 0)
+  message(FATAL_ERROR "${ELF} is ${flash} bytes, over the ${BUDGET} byte boot section")
+endif()
@@ -0,0 +1,496 @@
+/*
+    bench_atmega_spi_bootloader.c
+
+    Copyright 2021 Greg Green <ggreen@bit-builder.com>
+
+     This file is part of avr_bootloaders.
+    Runs standard workloads through the bootloader under simavr and
+    reports the cycle cost of each protocol command as CSV
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+
+#include "sim_avr.h"
+#include "spi_virt.h"
+#include "sim_harness.h"
+
+/*-----------------------------------------------------------------------*/
+
+// first transaction of each workload, well after the bootloader has
+// flashed the LED
+#define BENCH_START_CYCLE 3000000
+// give up on a workload that runs this long
+#define BENCH_MAX_CYCLES 500000000UL
+// default flash page size in bytes (atmega328p), -p for other parts
+#define BENCH_PAGE_SIZE 128
+// hello and signature are repeated to average out the handshake
+#define BENCH_REPEAT 16
+// default allowed slowdown against the baseline, in percent
+#define BENCH_TOLERANCE 5.0
+// sweep only runs workloads up to this size
+#define BENCH_SWEEP_MAX_SIZE 1024
+
+/*-----------------------------------------------------------------------*/
+
+typedef enum {
+    Hello,
+    Signature,
+    FlashWrite,
+    FlashRead,
+    EepromWrite,
+    EepromRead,
+} bench_cmd_t;
+
+typedef struct bench_workload
+{
+    const char * name;
+    bench_cmd_t cmd;
+    int size;
+} bench_workload_t;
+
+typedef struct bench_result
+{
+    int ok;
+    int spi_errors;
+    int commands;
+    int txns;
+    int pages;
+    avr_cycle_count_t total_cycles;
+    avr_cycle_count_t bus_cycles;
+    avr_cycle_count_t turnaround_cycles;
+    // longest from a byte landing in SPDR to the next byte loaded
+    avr_cycle_count_t reload_max;
+} bench_result_t;
+
+/*-----------------------------------------------------------------------*/
+
+static const bench_workload_t workloads[] = {
+    { "hello", Hello, 0 },
+    { "signature", Signature, 0 },
+    { "flash_write_1k", FlashWrite, 1024 },
+    { "flash_write_4k", FlashWrite, 4096 },
+    { "flash_write_14k", FlashWrite, 14336 },
+    { "flash_read_1k", FlashRead, 1024 },
+    { "flash_read_4k", FlashRead, 4096 },
+    { "flash_read_14k", FlashRead, 14336 },
+    { "eeprom_write_256", EepromWrite, 256 },
+    { "eeprom_write_1k", EepromWrite, 1024 },
+    { "eeprom_read_256", EepromRead, 256 },
+    { "eeprom_read_1k", EepromRead, 1024 },
+};
+
+#define NUM_WORKLOADS (sizeof(workloads) / sizeof(workloads[0]))
+
+// SCK periods tried by the sweep, fastest first, fosc/4 is the limit
+// for an avr spi peripheral
+static const int sweep_sck[] = { 4, 6, 8, 10, 12, 16, 24, 32, 48, 64, 128 };
+// gaps between bytes tried at each SCK period, smallest first
+static const int sweep_gap[] = { 0, 8, 16, 32, 64, 128, 256, 512 };
+
+#define NUM_SWEEP_SCK (sizeof(sweep_sck) / sizeof(sweep_sck[0]))
+#define NUM_SWEEP_GAP (sizeof(sweep_gap) / sizeof(sweep_gap[0]))
+
+// total cycles of each workload from a previous run, 0 if not known
+static avr_cycle_count_t baseline[NUM_WORKLOADS];
+
+// bytes per write or read command, the flash page of the part
+static int page_size = BENCH_PAGE_SIZE;
+
+/*-----------------------------------------------------------------------*/
+
+static void
+push_txn(spi_virt_t * part, uint8_t b0, uint8_t b1, uint8_t b2, uint8_t b3)
+{
+    uint8_t buf[4] = { b0, b1, b2, b3 };
+    spi_txn_input_append(part, buf, 1);
+}
+
+/*-----------------------------------------------------------------------*/
+
+// set address, in words
+static void
+push_address(spi_virt_t * part, uint16_t address)
+{
+    push_txn(part, 'U', address & 0xFF, address >> 8, 0);
+}
+
+/*-----------------------------------------------------------------------*/
+
+// write memory, data bytes follow the header padded out to 4 bytes
+static void
+push_write(spi_virt_t * part, int eeprom, int offset, int length)
+{
+    push_txn(part, 'd', length >> 8, length & 0xFF, eeprom ? 'E' : 0);
+    for (int i=0; i<length; i+=4) {
+        uint8_t buf[4] = { 0, 0, 0, 0 };
+        for (int j=0; j<4 && i+j<length; j++)
+            buf[j] = ((offset + i + j) * 7 + 3) & 0xFF;
+        spi_txn_input_append(part, buf, 1);
+    }
+}
+
+/*-----------------------------------------------------------------------*/
+
+// read memory, one empty transaction per 4 bytes to clock out the data
+static void
+push_read(spi_virt_t * part, int eeprom, int length)
+{
+    push_txn(part, 't', length >> 8, length & 0xFF, eeprom ? 'E' : 0);
+    for (int i=0; i<length; i+=4)
+        push_txn(part, 0, 0, 0, 0);
+}
+
+/*-----------------------------------------------------------------------*/
+
+// build the transactions for a workload, returns number of commands
+static int
+build_workload(spi_virt_t * part, const bench_workload_t * wl)
+{
+    int commands = 0;
+    int eeprom = (wl->cmd == EepromWrite || wl->cmd == EepromRead);
+    switch (wl->cmd) {
+    case Hello:
+    case Signature:
+        for (int i=0; i<BENCH_REPEAT; i++) {
+            push_txn(part, wl->cmd == Hello ? '0' : 'u', 0, 0, 0);
+            push_txn(part, 0, 0, 0, 0);
+            commands++;
+        }
+        break;
+    case FlashWrite:
+    case FlashRead:
+    case EepromWrite:
+    case EepromRead:
+        for (int offset=0; offset<wl->size; offset+=page_size) {
+            // bootloader takes addresses in words
+            push_address(part, offset >> 1);
+            if (wl->cmd == FlashWrite || wl->cmd == EepromWrite)
+                push_write(part, eeprom, offset, page_size);
+            else
+                push_read(part, eeprom, page_size);
+            commands += 2;
+        }
+        break;
+    }
+    return commands;
+}
+
+/*-----------------------------------------------------------------------*/
+
+// does the workload fit the part, below the bootloader or in the eeprom
+static int
+workload_fits(sim_harness_t * sim, const bench_workload_t * wl)
+{
+    if (wl->cmd == EepromWrite || wl->cmd == EepromRead)
+        return wl->size <= sim->avr->e2end + 1;
+    return wl->size <= sim->boot_base;
+}
+
+/*-----------------------------------------------------------------------*/
+
+// returns 0 if the workload ran, 1 if it doesn't fit the part
+static int
+run_workload(const sim_config_t * cfg, const bench_workload_t * wl,
+             bench_result_t * res)
+{
+    sim_harness_t sim;
+    memset(res, 0, sizeof(bench_result_t));
+
+    if (sim_harness_init(&sim, cfg) != 0)
+        return -1;
+    if (!workload_fits(&sim, wl)) {
+        fprintf(stderr, "BENCH: %s doesn't fit the %s, skipped\n", wl->name, cfg->mmcu);
+        sim_harness_cleanup(&sim);
+        return 1;
+    }
+
+    sim.spi.input.start_cycle = BENCH_START_CYCLE;
+    res->commands = build_workload(&sim.spi, wl);
+    sim_harness_start(&sim);
+    sim_harness_run(&sim);
+
+    if (sim.spi.done) {
+        res->ok = 1;
+        spi_test_txn_t * first = sim.spi.input.first;
+        spi_test_txn_t * last = NULL;
+        for (spi_test_txn_t * txn = first; txn != NULL; txn = txn->next) {
+            res->txns++;
+            res->bus_cycles += txn->end_cycle - txn->start_cycle;
+            res->turnaround_cycles += txn->cycle - txn->end_cycle;
+            last = txn;
+        }
+        if (last != NULL)
+            res->total_cycles = last->cycle - first->start_cycle;
+        res->pages = (wl->size + page_size - 1) / page_size;
+        res->spi_errors = spi_virt_error_count(&sim.spi);
+        res->reload_max = sim.spi.reload_max;
+    } else {
+        fprintf(stderr, "workload '%s' did not complete, stopped at cycle %lu\n",
+                wl->name, sim.avr->cycle);
+    }
+
+    sim_harness_cleanup(&sim);
+    return res->ok ? 0 : -1;
+}
+
+/*-----------------------------------------------------------------------*/
+
+static void
+print_header(FILE * out)
+{
+    fprintf(out, "workload,bytes,commands,txns,pages,total_cycles,bus_cycles,"
+            "turnaround_cycles,cycles_per_command,cycles_per_byte,"
+            "cycles_per_page,handshake_cycles_per_txn,bytes_per_sec,"
+            "spi_errors,spdr_reload_max_cycles\n");
+}
+
+/*-----------------------------------------------------------------------*/
+
+static void
+print_result(FILE * out, const bench_workload_t * wl,
+             const bench_result_t * res, uint32_t freq)
+{
+    double total = (double)res->total_cycles;
+    fprintf(out, "%s,%d,%d,%d,%d,%lu,%lu,%lu,%.1f,%.2f,%.1f,%.1f,%.0f,%d,%lu\n",
+            wl->name, wl->size, res->commands, res->txns, res->pages,
+            res->total_cycles, res->bus_cycles, res->turnaround_cycles,
+            res->commands ? total / res->commands : 0.0,
+            wl->size ? total / wl->size : 0.0,
+            res->pages ? total / res->pages : 0.0,
+            res->txns ? (double)res->turnaround_cycles / res->txns : 0.0,
+            res->total_cycles ? wl->size * (double)freq / total : 0.0,
+            res->spi_errors, res->reload_max);
+}
+
+/*-----------------------------------------------------------------------*/
+
+// for each SCK period find the smallest gap between bytes that the
+// bootloader keeps up with, and report the fastest reliable setting
+static int
+run_sweep(sim_config_t * cfg, FILE * out)
+{
+    int failed = 0;
+    fprintf(out, "workload,sck_cycles,sck_hz,min_byte_gap_cycles,"
+            "min_byte_gap_us,total_cycles,bytes_per_sec\n");
+    for (int i=0; i<NUM_WORKLOADS; i++) {
+        const bench_workload_t * wl = &workloads[i];
+        if (wl->size > BENCH_SWEEP_MAX_SIZE)
+            continue;
+        avr_cycle_count_t best_cycles = 0;
+        int best_sck = 0, best_gap = 0;
+        int skipped = 0;
+        for (int k=0; k<NUM_SWEEP_SCK && !skipped; k++) {
+            for (int g=0; g<NUM_SWEEP_GAP && !skipped; g++) {
+                bench_result_t res;
+                cfg->sck_cycles = sweep_sck[k];
+                cfg->byte_gap = sweep_gap[g];
+                int ran = run_workload(cfg, wl, &res);
+                if (ran > 0)
+                    skipped = 1;
+                if (ran != 0 || res.spi_errors != 0)
+                    continue;
+                fprintf(out, "%s,%d,%.0f,%d,%.2f,%lu,%.0f\n", wl->name,
+                        cfg->sck_cycles, (double)cfg->freq / cfg->sck_cycles,
+                        cfg->byte_gap, 1e6 * cfg->byte_gap / cfg->freq,
+                        res.total_cycles,
+                        wl->size * (double)cfg->freq / res.total_cycles);
+                if (best_cycles == 0 || res.total_cycles < best_cycles) {
+                    best_cycles = res.total_cycles;
+                    best_sck = cfg->sck_cycles;
+                    best_gap = cfg->byte_gap;
+                }
+                break;
+            }
+        }
+        if (skipped)
+            continue;
+        if (best_cycles == 0) {
+            fprintf(stderr, "BENCH: %s: no reliable SCK found\n", wl->name);
+            failed++;
+            continue;
+        }
+        fprintf(stderr, "BENCH: %s: fastest reliable SCK %.0f Hz with %.2f us "
+                "between bytes\n", wl->name, (double)cfg->freq / best_sck,
+                1e6 * best_gap / cfg->freq);
+    }
+    return failed;
+}
+
+/*-----------------------------------------------------------------------*/
+
+// read total_cycles for each workload from a csv written by this program
+static int
+load_baseline(const char * path)
+{
+    char line[256];
+    FILE * f = fopen(path, "r");
+    if (f == NULL) {
+        perror(path);
+        return -1;
+    }
+    while (fgets(line, sizeof(line), f) == line) {
+        if (line[0] == '#' || line[0] == '\n' || !strncmp(line, "workload,", 9))
+            continue;
+        char * comma = strchr(line, ',');
+        if (comma == NULL)
+            continue;
+        *comma = 0;
+        // total_cycles is the 6th column
+        char * field = comma + 1;
+        for (int col=1; col<5 && field != NULL; col++) {
+            field = strchr(field, ',');
+            if (field != NULL)
+                field++;
+        }
+        if (field == NULL)
+            continue;
+        for (int i=0; i<NUM_WORKLOADS; i++)
+            if (!strcmp(line, workloads[i].name))
+                baseline[i] = strtoull(field, NULL, 10);
+    }
+    fclose(f);
+    return 0;
+}
+
+/*-----------------------------------------------------------------------*/
+
+// compare a result against the baseline, returns non-zero on regression
+// or when the workload has no baseline row
+static int
+check_baseline(int idx, const bench_result_t * res, double tolerance)
+{
+    const char * name = workloads[idx].name;
+    if (baseline[idx] == 0) {
+        fprintf(stderr, "BENCH: %s: no baseline, regenerate it with make bench_baseline\n",
+                name);
+        return 1;
+    }
+    double change = 100.0 * ((double)res->total_cycles - baseline[idx]) / baseline[idx];
+    if (change > tolerance) {
+        fprintf(stderr, "BENCH: %s: REGRESSION %lu cycles, baseline %lu (%+.1f%%)\n",
+                name, res->total_cycles, baseline[idx], change);
+        return 1;
+    }
+    if (change < -tolerance)
+        fprintf(stderr, "BENCH: %s: improved %lu cycles, baseline %lu (%+.1f%%), "
+                "update the baseline\n", name, res->total_cycles, baseline[idx], change);
+    return 0;
+}
+
+/*-----------------------------------------------------------------------*/
+
+int main(int argc, char *argv[])
+{
+    char boot_path[1024] = "../build-power-monitor-bootloader-avr/power-monitor-bootloader-atmega328p.hex";
+    char output_path[1024] = "";
+    char * baseline_path = NULL;
+    double tolerance = BENCH_TOLERANCE;
+    char * mmcu = "atmega328p";
+    uint32_t freq = 8000000;
+    int verbose = 0;
+    int sweep = 0;
+    int cold = 0;
+    int fast = 1;
+    int sck_cycles = SCK_DELAY_CYCLES * 2;
+    int byte_gap = BYTE_GAP_CYCLES;
+    int failed = 0;
+
+    for (int i = 1; i < argc; i++) {
+        if (!strcmp(argv[i] + strlen(argv[i]) - 4, ".hex"))
+            strncpy(boot_path, argv[i], sizeof(boot_path));
+        else if (!strcmp(argv[i], "-v"))
+            verbose++;
+        else if (!strcmp(argv[i], "-m") && i + 1 < argc)
+            mmcu = argv[++i];
+        else if (!strcmp(argv[i], "-f") && i + 1 < argc)
+            freq = strtoul(argv[++i], NULL, 0);
+        else if (!strcmp(argv[i], "-p") && i + 1 < argc)
+            page_size = atoi(argv[++i]);
+        else if (!strcmp(argv[i], "-o") && i + 1 < argc)
+            strncpy(output_path, argv[++i], sizeof(output_path));
+        else if (!strcmp(argv[i], "-b") && i + 1 < argc)
+            baseline_path = argv[++i];
+        else if (!strcmp(argv[i], "-t") && i + 1 < argc)
+            tolerance = strtod(argv[++i], NULL);
+        else if (!strcmp(argv[i], "-k") && i + 1 < argc)
+            sck_cycles = atoi(argv[++i]);
+        else if (!strcmp(argv[i], "-g") && i + 1 < argc)
+            byte_gap = atoi(argv[++i]);
+        else if (!strcmp(argv[i], "-s"))
+            sweep++;
+        else if (!strcmp(argv[i], "-c"))
+            cold++;
+        else if (!strcmp(argv[i], "-I"))
+            fast = 0;
+        else {
+            fprintf(stderr, "%s: invalid argument %s\n", argv[0], argv[i]);
+            fprintf(stderr, "usage: %s [-v] [-m mcu] [-f freq] [-p page_size] [-o out.csv] "
+                    "[-b baseline.csv] [-t tolerance%%] [-k sck_cycles] "
+                    "[-g byte_gap_cycles] [-s] [-c] [-I] bootloader.hex\n", argv[0]);
+            exit(1);
+        }
+    }
+
+    // whole transactions, and no more than a 'd' command takes
+    if (page_size <= 0 || page_size % 4 || page_size > 256) {
+        fprintf(stderr, "%s: bad page size %d\n", argv[0], page_size);
+        exit(1);
+    }
+    if (baseline_path != NULL && load_baseline(baseline_path) != 0)
+        exit(1);
+
+    FILE * out = stdout;
+    if (strlen(output_path) != 0) {
+        out = fopen(output_path, "w");
+        if (out == NULL) {
+            perror(output_path);
+            exit(1);
+        }
+    }
+
+    sim_config_t cfg;
+    sim_config_defaults(&cfg);
+    cfg.boot_path = boot_path;
+    cfg.mmcu = mmcu;
+    cfg.freq = freq;
+    cfg.log = 1 + verbose;
+    cfg.verbose = 0;
+    cfg.sck_cycles = sck_cycles;
+    cfg.byte_gap = byte_gap;
+    cfg.fast = fast;
+    cfg.stop_when_done = 1;
+    cfg.max_cycles = BENCH_MAX_CYCLES;
+
+    // boot once, every workload starts from the bootloader waiting for
+    // its first transaction
+    sim_snapshot_t snap;
+    memset(&snap, 0, sizeof(sim_snapshot_t));
+    if (!cold && sim_snapshot_boot(&snap, &cfg) == 0)
+        cfg.snapshot = &snap;
+
+    if (sweep) {
+        failed = run_sweep(&cfg, out);
+    } else {
+        print_header(out);
+        for (int i=0; i<NUM_WORKLOADS; i++) {
+            bench_result_t res;
+            int ran = run_workload(&cfg, &workloads[i], &res);
+            if (ran > 0)
+                continue;
+            if (ran != 0) {
+                failed++;
+                continue;
+            }
+            print_result(out, &workloads[i], &res, freq);
+            if (baseline_path != NULL)
+                failed += check_baseline(i, &res, tolerance);
+        }
+    }
+
+    sim_snapshot_free(&snap);
+    if (out != stdout)
+        fclose(out);
+    return failed ? 1 : 0;
+}
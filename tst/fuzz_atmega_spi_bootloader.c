@@ -0,0 +1,623 @@
+/*
+	fuzz_atmega_spi_bootloader.c
+
+    Copyright 2021 Greg Green <ggreen@bit-builder.com>
+
+ 	This file is part of avr_bootloaders.
+    Coverage guided fuzzer of the bootloader command parser, random
+    transaction streams go through spi_virt into the simulated bootloader
+ */
+
+#include <unistd.h>
+#include <sys/stat.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <time.h>
+
+#include "sim_avr.h"
+#include "sim_harness.h"
+
+/*-----------------------------------------------------------------------*/
+
+#define FUZZ_MAP_SIZE 65536
+#define FUZZ_MAX_TXNS 64
+#define FUZZ_MAX_LEN (FUZZ_MAX_TXNS * 4)
+#define FUZZ_MAX_CORPUS 4096
+#define FUZZ_MAX_FINDINGS 256
+#define FUZZ_MAX_STACKED 4
+// no ready signal for this long is a hang, an eeprom write of a full
+// buffer takes about a second
+#define FUZZ_HANG_SECONDS 2
+
+// SPMCSR in data space and its erase and write bits
+#define FUZZ_SPMCSR 0x57
+#define FUZZ_SPM_ERASE_WRITE 0x06
+#define FUZZ_OP_SPM 0x95E8
+
+/*-----------------------------------------------------------------------*/
+
+typedef enum {
+    FuzzOk,
+    FuzzSramOverflow,   // store into free ram between the globals and the
+                        // stack, or a pointer walking off the end of a global
+    FuzzStackOverflow,  // stack pointer below the end of the globals
+    FuzzBootWrite,      // page erase or write in the boot section
+    FuzzHang,
+    FuzzCrash,
+} fuzz_result_t;
+
+static const char * fuzz_result_names[] = {
+    [FuzzOk] = "ok",
+    [FuzzSramOverflow] = "sram-overflow",
+    [FuzzStackOverflow] = "stack-overflow",
+    [FuzzBootWrite] = "boot-write",
+    [FuzzHang] = "hang",
+    [FuzzCrash] = "crash",
+};
+
+/*-----------------------------------------------------------------------*/
+
+typedef struct fuzz_input
+{
+    uint8_t data[FUZZ_MAX_LEN];
+    int len;            // always a multiple of 4, one transaction each
+} fuzz_input_t;
+
+/*-----------------------------------------------------------------------*/
+
+typedef struct fuzz_finding
+{
+    fuzz_result_t result;
+    uint32_t pc;
+} fuzz_finding_t;
+
+/*-----------------------------------------------------------------------*/
+
+typedef struct fuzz
+{
+    sim_config_t config;
+    sim_snapshot_t snap;
+    sim_profile_t symbols;
+    const char * out_dir;
+    uint64_t rng;
+    // firmware layout from the elf
+    uint32_t app_start;
+    uint16_t ram_end;       // end of the globals, _end
+    uint32_t boot_base;
+    avr_cycle_count_t hang_cycles;
+    // edge coverage of the current input and everything seen so far
+    uint8_t trace[FUZZ_MAP_SIZE];
+    uint8_t virgin[FUZZ_MAP_SIZE];
+    uint32_t prev_loc;
+    int edges;
+    // the last store through X, Y and Z and the global it was in
+    int32_t last_store[3];
+    int last_object[3];
+    // where the current input went wrong
+    fuzz_result_t result;
+    uint32_t result_pc;
+    uint32_t result_addr;
+    fuzz_input_t * corpus;
+    int corpus_count;
+    fuzz_finding_t findings[FUZZ_MAX_FINDINGS];
+    int finding_count;
+    uint64_t execs;
+    int verbose;
+} fuzz_t;
+
+/*-----------------------------------------------------------------------*/
+
+static uint32_t
+fuzz_rand(fuzz_t * fz, uint32_t limit)
+{
+    // xorshift64
+    fz->rng ^= fz->rng << 13;
+    fz->rng ^= fz->rng >> 7;
+    fz->rng ^= fz->rng << 17;
+    return limit ? fz->rng % limit : 0;
+}
+
+/*-----------------------------------------------------------------------*/
+
+static uint16_t
+reg16(avr_t * avr, int lo)
+{
+    return avr->data[lo] | (avr->data[lo + 1] << 8);
+}
+
+/*-----------------------------------------------------------------------*/
+
+// data address the instruction stores to, -1 if it doesn't store
+// through a pointer or address (push and call are caught by the sp check).
+// ptr is the pointer register, 0 X, 1 Y, 2 Z, -1 for sts
+static int32_t
+store_target(avr_t * avr, uint16_t op, uint16_t op2, int * ptr)
+{
+    uint16_t x = reg16(avr, R_XL);
+    uint16_t y = reg16(avr, R_YL);
+    uint16_t z = reg16(avr, R_ZL);
+
+    *ptr = -1;
+    switch (op & 0xFE0F) {
+        case 0x9200: return op2;        // sts k, Rr
+        case 0x920C: *ptr = 0; return x;        // st X, Rr
+        case 0x920D: *ptr = 0; return x;        // st X+, Rr
+        case 0x920E: *ptr = 0; return x - 1;    // st -X, Rr
+        case 0x9209: *ptr = 1; return y;        // st Y+, Rr
+        case 0x920A: *ptr = 1; return y - 1;    // st -Y, Rr
+        case 0x9201: *ptr = 2; return z;        // st Z+, Rr
+        case 0x9202: *ptr = 2; return z - 1;    // st -Z, Rr
+    }
+    if ((op & 0xD200) == 0x8200) {      // std Y+q, Rr and std Z+q, Rr
+        int q = ((op >> 8) & 0x20) | ((op >> 7) & 0x18) | (op & 0x07);
+        *ptr = (op & 0x08) ? 1 : 2;
+        return ((op & 0x08) ? y : z) + q;
+    }
+    return -1;
+}
+
+/*-----------------------------------------------------------------------*/
+
+static void
+fuzz_flag(fuzz_t * fz, fuzz_result_t result, uint32_t pc, uint32_t addr)
+{
+    if (fz->result != FuzzOk)
+        return;
+    fz->result = result;
+    fz->result_pc = pc;
+    fz->result_addr = addr;
+}
+
+/*-----------------------------------------------------------------------*/
+
+// look at the instruction about to run, then run it
+static int
+fuzz_step(fuzz_t * fz, sim_harness_t * sim)
+{
+    avr_t * avr = sim->avr;
+    uint32_t pc = avr->pc;
+    uint16_t op = avr->flash[pc] | (avr->flash[pc + 1] << 8);
+    uint16_t op2 = avr->flash[pc + 2] | (avr->flash[pc + 3] << 8);
+    uint16_t sp = reg16(avr, R_SPL);
+
+    int ptr;
+    int32_t addr = store_target(avr, op, op2, &ptr);
+    // the gap between the globals and the stack is nobody's
+    if (addr >= fz->ram_end && addr <= sp)
+        fuzz_flag(fz, FuzzSramOverflow, pc, addr);
+    // a pointer stepping from a global to the byte next to it, in
+    // another global or none, has run off the end of buff or the like
+    if (ptr >= 0 && addr >= 0) {
+        int obj = sim_profile_find_object(&fz->symbols, addr);
+        int32_t step = addr - fz->last_store[ptr];
+        if (fz->last_object[ptr] >= 0 && (step == 1 || step == -1) &&
+            obj != fz->last_object[ptr])
+            fuzz_flag(fz, FuzzSramOverflow, pc, addr);
+        fz->last_store[ptr] = addr;
+        fz->last_object[ptr] = obj;
+    }
+    if (op == FUZZ_OP_SPM && (avr->data[FUZZ_SPMCSR] & FUZZ_SPM_ERASE_WRITE)) {
+        uint16_t z = reg16(avr, R_ZL);
+        if (z >= fz->boot_base)
+            fuzz_flag(fz, FuzzBootWrite, pc, z);
+    }
+
+    // edge coverage, afl style
+    uint32_t loc = ((pc >> 1) * 0x9E37) & (FUZZ_MAP_SIZE - 1);
+    fz->trace[loc ^ fz->prev_loc]++;
+    fz->prev_loc = loc >> 1;
+
+    int state = sim_harness_step(sim);
+
+    sp = reg16(avr, R_SPL);
+    if (sp < fz->ram_end)
+        fuzz_flag(fz, FuzzStackOverflow, pc, sp);
+    return state;
+}
+
+/*-----------------------------------------------------------------------*/
+
+// run one input from the snapshot, returns the result
+static fuzz_result_t
+fuzz_run(fuzz_t * fz, const fuzz_input_t * in)
+{
+    sim_harness_t sim;
+
+    memset(fz->trace, 0, FUZZ_MAP_SIZE);
+    fz->prev_loc = 0;
+    fz->result = FuzzOk;
+    for (int i=0; i<3; i++) {
+        fz->last_store[i] = -1;
+        fz->last_object[i] = -1;
+    }
+    if (sim_harness_init(&sim, &fz->config) != 0 || !sim.restored) {
+        fprintf(stderr, "FUZZ: unable to start from the snapshot\n");
+        exit(1);
+    }
+    for (int i=0; i<in->len; i+=4)
+        spi_txn_input_append(&sim.spi, (uint8_t *)in->data + i, 1);
+    sim_harness_start(&sim);
+
+    avr_t * avr = sim.avr;
+    avr_cycle_count_t progress = avr->cycle;
+    int txn_number = 0;
+    while (fz->result == FuzzOk) {
+        int state = fuzz_step(fz, &sim);
+        if (state == cpu_Done || state == cpu_Crashed) {
+            fuzz_flag(fz, FuzzCrash, avr->pc, 0);
+            break;
+        }
+        // script done or the bootloader gave up and left for the app
+        if (sim.spi.done || avr->pc == fz->app_start)
+            break;
+        if (sim.spi.txn_number != txn_number || sim.spi.ready_cycle > progress) {
+            txn_number = sim.spi.txn_number;
+            progress = avr->cycle;
+        }
+        if (avr->cycle - progress > fz->hang_cycles)
+            fuzz_flag(fz, FuzzHang, avr->pc, 0);
+    }
+    // catch anything else that changed the boot section
+    uint32_t boot_len = avr->flashend + 1 - fz->boot_base;
+    if (memcmp(avr->flash + fz->boot_base, fz->snap.flash + fz->boot_base, boot_len) != 0)
+        fuzz_flag(fz, FuzzBootWrite, avr->pc, fz->boot_base);
+
+    sim_harness_cleanup(&sim);
+    fz->execs++;
+    return fz->result;
+}
+
+/*-----------------------------------------------------------------------*/
+
+// hit counts in afl buckets
+static uint8_t
+bucket(uint8_t count)
+{
+    if (count <= 3) return count;
+    if (count <= 7) return 8;
+    if (count <= 15) return 16;
+    if (count <= 31) return 32;
+    if (count <= 127) return 64;
+    return 128;
+}
+
+/*-----------------------------------------------------------------------*/
+
+// merge the trace into everything seen, returns non zero if new
+static int
+fuzz_new_coverage(fuzz_t * fz)
+{
+    int new = 0;
+    for (int i=0; i<FUZZ_MAP_SIZE; i++) {
+        if (fz->trace[i] == 0)
+            continue;
+        uint8_t b = bucket(fz->trace[i]);
+        if (fz->virgin[i] & b)
+            continue;
+        if (fz->virgin[i] == 0)
+            fz->edges++;
+        fz->virgin[i] |= b;
+        new = 1;
+    }
+    return new;
+}
+
+/*-----------------------------------------------------------------------*/
+
+// write an input as a transaction script tst_atmega_spi_bootloader can replay
+static void
+fuzz_save(fuzz_t * fz, const fuzz_input_t * in, const char * path)
+{
+    FILE * f = fopen(path, "w");
+    if (f == NULL) {
+        perror(path);
+        return;
+    }
+    int sym = sim_profile_find_symbol(&fz->symbols, fz->result_pc);
+    fprintf(f, "# %s at pc 0x%04x (%s), address 0x%04x\n",
+            fuzz_result_names[fz->result], fz->result_pc,
+            sym < 0 ? "[unknown]" : fz->symbols.symbols[sym].name, fz->result_addr);
+    fprintf(f, "3000000\n");
+    for (int i=0; i<in->len; i+=4)
+        fprintf(f, "%02x %02x %02x %02x 1\n", in->data[i], in->data[i+1],
+                in->data[i+2], in->data[i+3]);
+    fclose(f);
+}
+
+/*-----------------------------------------------------------------------*/
+
+static void
+fuzz_record(fuzz_t * fz, const fuzz_input_t * in)
+{
+    for (int i=0; i<fz->finding_count; i++)
+        if (fz->findings[i].result == fz->result && fz->findings[i].pc == fz->result_pc)
+            return;
+    if (fz->finding_count == FUZZ_MAX_FINDINGS)
+        return;
+    fuzz_finding_t * found = &fz->findings[fz->finding_count++];
+    found->result = fz->result;
+    found->pc = fz->result_pc;
+
+    char path[1200];
+    snprintf(path, sizeof(path), "%s/%s-%04x.txt", fz->out_dir,
+             fuzz_result_names[fz->result], fz->result_pc);
+    fuzz_save(fz, in, path);
+    printf("FUZZ: %s at pc 0x%04x, address 0x%04x, saved %s\n",
+           fuzz_result_names[fz->result], fz->result_pc, fz->result_addr, path);
+}
+
+/*-----------------------------------------------------------------------*/
+
+static void
+fuzz_add_corpus(fuzz_t * fz, const fuzz_input_t * in)
+{
+    if (fz->corpus_count == FUZZ_MAX_CORPUS)
+        return;
+    fz->corpus[fz->corpus_count++] = *in;
+}
+
+/*-----------------------------------------------------------------------*/
+
+static const uint8_t commands[] = { '0', 'Q', 'U', 'd', 't', 'u' };
+static const uint8_t interesting8[] = { 0, 1, 3, 4, 0x7f, 0x80, 0xff, 'E' };
+static const uint16_t interesting16[] = {
+    0, 1, 2, 3, 4, 5, 127, 128, 129, 255, 256, 257, 512, 0x3800 >> 1,
+    0x7fff, 0x8000, 0xffff
+};
+
+#define NUM(a) (sizeof(a) / sizeof(a[0]))
+
+/*-----------------------------------------------------------------------*/
+
+// a random well formed command header
+static void
+random_command(fuzz_t * fz, uint8_t * txn)
+{
+    uint16_t v = interesting16[fuzz_rand(fz, NUM(interesting16))];
+    txn[0] = commands[fuzz_rand(fz, NUM(commands))];
+    if (txn[0] == 'U') {
+        // address, little endian
+        txn[1] = v & 0xff;
+        txn[2] = v >> 8;
+    } else {
+        // length, big endian
+        txn[1] = v >> 8;
+        txn[2] = v & 0xff;
+    }
+    txn[3] = fuzz_rand(fz, 2) ? 'E' : 0;
+}
+
+/*-----------------------------------------------------------------------*/
+
+static void
+fuzz_mutate(fuzz_t * fz, fuzz_input_t * in)
+{
+    int stacked = 1 + fuzz_rand(fz, FUZZ_MAX_STACKED);
+    for (int m=0; m<stacked; m++) {
+        int txns = in->len / 4;
+        int t = fuzz_rand(fz, txns ? txns : 1);
+        uint8_t * txn = in->data + t * 4;
+        switch (fuzz_rand(fz, 8)) {
+            case 0:
+                if (in->len)
+                    in->data[fuzz_rand(fz, in->len)] ^= 1 << fuzz_rand(fz, 8);
+                break;
+            case 1:
+                if (in->len)
+                    in->data[fuzz_rand(fz, in->len)] =
+                        interesting8[fuzz_rand(fz, NUM(interesting8))];
+                break;
+            case 2:
+                if (in->len)
+                    txn[0] = commands[fuzz_rand(fz, NUM(commands))];
+                break;
+            case 3: {
+                if (in->len) {
+                    uint16_t v = interesting16[fuzz_rand(fz, NUM(interesting16))];
+                    txn[1] = v >> 8;
+                    txn[2] = v & 0xff;
+                }
+                break;
+            }
+            case 4:
+                // insert a command
+                if (in->len + 4 <= FUZZ_MAX_LEN) {
+                    memmove(txn + 4, txn, in->len - t * 4);
+                    random_command(fz, txn);
+                    in->len += 4;
+                }
+                break;
+            case 5:
+                // delete a transaction
+                if (txns > 1) {
+                    memmove(txn, txn + 4, in->len - t * 4 - 4);
+                    in->len -= 4;
+                }
+                break;
+            case 6:
+                // duplicate a transaction
+                if (in->len && in->len + 4 <= FUZZ_MAX_LEN) {
+                    memmove(txn + 4, txn, in->len - t * 4);
+                    in->len += 4;
+                }
+                break;
+            case 7: {
+                // splice the tail of another input
+                const fuzz_input_t * other = &fz->corpus[fuzz_rand(fz, fz->corpus_count)];
+                int from = fuzz_rand(fz, other->len / 4 + 1) * 4;
+                int n = other->len - from;
+                if (t * 4 + n > FUZZ_MAX_LEN)
+                    n = FUZZ_MAX_LEN - t * 4;
+                memcpy(in->data + t * 4, other->data + from, n);
+                in->len = t * 4 + n;
+                break;
+            }
+        }
+    }
+    if (in->len == 0) {
+        random_command(fz, in->data);
+        in->len = 4;
+    }
+}
+
+/*-----------------------------------------------------------------------*/
+
+// seeds from transaction scripts, plus one of each command, returns -1
+// if a script doesn't parse
+static int
+fuzz_seed(fuzz_t * fz, char ** scripts, int script_count)
+{
+    fuzz_input_t in;
+    for (int i=0; i<script_count; i++) {
+        spi_virt_t part;
+        memset(&part, 0, sizeof(spi_virt_t));
+        if (spi_txn_input_init(scripts[i], &part) != 0)
+            return -1;
+        in.len = 0;
+        for (spi_test_txn_t * txn = part.input.first;
+             txn != NULL && in.len < FUZZ_MAX_LEN; txn = txn->next) {
+            memcpy(in.data + in.len, txn->transaction.buf, 4);
+            in.len += 4;
+        }
+        spi_txn_input_cleanup(&part);
+        if (in.len)
+            fuzz_add_corpus(fz, &in);
+    }
+    static const uint8_t builtin[][12] = {
+        { '0', 0, 0, 0,  0, 0, 0, 0 },
+        { 'u', 0, 0, 0,  0, 0, 0, 0 },
+        { 'U', 0, 0, 0,  'd', 0, 4, 0,  1, 2, 3, 4 },
+        { 'U', 0, 0, 0,  'd', 0, 4, 'E',  1, 2, 3, 4 },
+        { 'U', 0, 0, 0,  't', 0, 4, 0,  0, 0, 0, 0 },
+        { 'U', 0, 0, 0,  't', 0, 4, 'E',  0, 0, 0, 0 },
+    };
+    for (int i=0; i<NUM(builtin); i++) {
+        in.len = builtin[i][0] == 'U' ? 12 : 8;
+        memcpy(in.data, builtin[i], in.len);
+        fuzz_add_corpus(fz, &in);
+    }
+    return 0;
+}
+
+/*-----------------------------------------------------------------------*/
+
+int main(int argc, char *argv[])
+{
+    static fuzz_t fz;
+    char boot_path[1024] = "../build-power-monitor-bootloader-avr/power-monitor-bootloader-atmega328p.hex";
+    char elf_path[1024] = "";
+    char * scripts[256];
+    int script_count = 0;
+    char * mmcu = "atmega328p";
+    uint32_t freq = 8000000;
+    uint64_t max_execs = 0;
+    int max_seconds = 0;
+    uint64_t seed = time(NULL);
+    avr_cycle_count_t hang_cycles = 0;
+
+    fz.out_dir = "fuzz_findings";
+    for (int i = 1; i < argc; i++) {
+        if (!strcmp(argv[i] + strlen(argv[i]) - 4, ".hex"))
+            strncpy(boot_path, argv[i], sizeof(boot_path) - 1);
+        else if (!strcmp(argv[i] + strlen(argv[i]) - 4, ".elf"))
+            strncpy(elf_path, argv[i], sizeof(elf_path) - 1);
+        else if (!strcmp(argv[i] + strlen(argv[i]) - 4, ".txt") && script_count < 256)
+            scripts[script_count++] = argv[i];
+        else if (!strcmp(argv[i], "-v"))
+            fz.verbose++;
+        else if (!strcmp(argv[i], "-m") && i + 1 < argc)
+            mmcu = argv[++i];
+        else if (!strcmp(argv[i], "-f") && i + 1 < argc)
+            freq = strtoul(argv[++i], NULL, 0);
+        else if (!strcmp(argv[i], "-n") && i + 1 < argc)
+            max_execs = strtoull(argv[++i], NULL, 0);
+        else if (!strcmp(argv[i], "-t") && i + 1 < argc)
+            max_seconds = atoi(argv[++i]);
+        else if (!strcmp(argv[i], "-s") && i + 1 < argc)
+            seed = strtoull(argv[++i], NULL, 0);
+        else if (!strcmp(argv[i], "-H") && i + 1 < argc)
+            hang_cycles = strtoull(argv[++i], NULL, 0);
+        else if (!strcmp(argv[i], "-o") && i + 1 < argc)
+            fz.out_dir = argv[++i];
+        else {
+            fprintf(stderr, "%s: invalid argument %s\n", argv[0], argv[i]);
+            fprintf(stderr, "usage: %s [-v] [-m mcu] [-f freq] [-n execs] [-t seconds] "
+                    "[-s seed] [-H hang_cycles] [-o dir] bootloader.elf "
+                    "bootloader.hex [seed.txt...]\n", argv[0]);
+            exit(1);
+        }
+    }
+
+    // the elf says where the globals end and where the app starts
+    uint32_t value;
+    if (strlen(elf_path) == 0
+        || sim_profile_elf_symbol(elf_path, "app_start", &fz.app_start) != 0
+        || sim_profile_elf_symbol(elf_path, "_end", &value) != 0) {
+        fprintf(stderr, "FUZZ: need the bootloader elf with app_start and _end\n");
+        exit(1);
+    }
+    fz.ram_end = value - SIM_PROFILE_DATA_OFFSET;
+
+    sim_config_defaults(&fz.config);
+    fz.config.boot_path = boot_path;
+    fz.config.mmcu = mmcu;
+    fz.config.freq = freq;
+    fz.config.verbose = 0;
+    fz.config.log = fz.verbose;
+    if (sim_snapshot_boot(&fz.snap, &fz.config) != 0)
+        exit(1);
+    fz.config.snapshot = &fz.snap;
+    fz.hang_cycles = hang_cycles ? hang_cycles : (avr_cycle_count_t)freq * FUZZ_HANG_SECONDS;
+
+    // boot section starts where the bootloader was loaded
+    sim_harness_t sim;
+    if (sim_harness_init(&sim, &fz.config) != 0)
+        exit(1);
+    fz.boot_base = sim.boot_base;
+    if (sim_profile_init(&fz.symbols, sim.avr, elf_path) != 0)
+        exit(1);
+    sim_harness_cleanup(&sim);
+
+    mkdir(fz.out_dir, 0755);
+    fz.rng = seed ? seed : 1;
+    fz.corpus = calloc(FUZZ_MAX_CORPUS, sizeof(fuzz_input_t));
+    if (fuzz_seed(&fz, scripts, script_count) != 0)
+        exit(1);
+    int seeds = fz.corpus_count;
+    for (int i=0; i<seeds; i++) {
+        if (fuzz_run(&fz, &fz.corpus[i]) != FuzzOk)
+            fuzz_record(&fz, &fz.corpus[i]);
+        fuzz_new_coverage(&fz);
+    }
+    printf("FUZZ: seed %lu, %d seeds, %d edges, _end 0x%04x, boot 0x%05x\n",
+           seed, seeds, fz.edges, fz.ram_end, fz.boot_base);
+
+    time_t start = time(NULL);
+    time_t last_report = start;
+    while ((max_execs == 0 || fz.execs < max_execs)
+           && (max_seconds == 0 || time(NULL) - start < max_seconds)) {
+        fuzz_input_t in = fz.corpus[fuzz_rand(&fz, fz.corpus_count)];
+        fuzz_mutate(&fz, &in);
+        if (fuzz_run(&fz, &in) != FuzzOk)
+            fuzz_record(&fz, &in);
+        else if (fuzz_new_coverage(&fz))
+            fuzz_add_corpus(&fz, &in);
+
+        time_t now = time(NULL);
+        if (now != last_report) {
+            last_report = now;
+            printf("FUZZ: %lu execs, %.0f/s, corpus %d, edges %d, findings %d\n",
+                   fz.execs, (double)fz.execs / (now - start + 1), fz.corpus_count,
+                   fz.edges, fz.finding_count);
+            fflush(stdout);
+        }
+    }
+
+    printf("FUZZ: done, %lu execs, corpus %d, edges %d, findings %d\n",
+           fz.execs, fz.corpus_count, fz.edges, fz.finding_count);
+    sim_profile_cleanup(&fz.symbols);
+    sim_snapshot_free(&fz.snap);
+    free(fz.corpus);
+    return fz.finding_count ? 1 : 0;
+}
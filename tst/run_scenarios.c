@@ -0,0 +1,328 @@
+/*
+	run_scenarios.c
+
+    Copyright 2021 Greg Green <ggreen@bit-builder.com>
+
+ 	This file is part of avr_bootloaders.
+    Runs a list of simulator scenarios, each on its own simulated avr,
+    spread over a pool of threads
+ */
+
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <time.h>
+
+#include <pthread.h>
+
+#include "sim_avr.h"
+#include "sim_harness.h"
+
+/*-----------------------------------------------------------------------*/
+
+#define MAX_SCENARIOS 1024
+#define MAX_SNAPSHOTS 16
+#define DEFAULT_MAX_CYCLES 200000000UL
+
+/*-----------------------------------------------------------------------*/
+
+typedef struct scenario
+{
+    char name[64];
+    char boot_path[1024];
+    char spi_input[1024];
+    char output_path[1200];
+    char flash_path[1200];
+    char flash_base[1024];
+    sim_config_t config;
+    int expect_fail;
+    // passes when the bootloader resets before the script is done
+    int expect_reset;
+    // results
+    int state;
+    int done;
+    int spi_errors;
+    avr_cycle_count_t cycles;
+    double seconds;
+    // simulation speed, and stopped by the cycle budget
+    double mcycles_per_sec;
+    int budget_exceeded;
+    int resets;
+    int passed;
+} scenario_t;
+
+/*-----------------------------------------------------------------------*/
+
+static scenario_t scenarios[MAX_SCENARIOS];
+static int scenario_count = 0;
+static sim_snapshot_t snapshots[MAX_SNAPSHOTS];
+static int snapshot_count = 0;
+static int next_scenario = 0;
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+
+/*-----------------------------------------------------------------------*/
+
+/* example of scenario file
+ *
+ * # name     hex file                      script file       options
+ * hello      power-monitor-bootloader.hex  hello.txt
+ * blink-16m  power-monitor-bootloader.hex  blink.txt         freq=16000000
+ * fast-sck   power-monitor-bootloader.hex  blink.txt         sck=4 gap=0 expect=fail
+ * bitflip    power-monitor-bootloader.hex  blink.txt         fault=12:0:0x01
+ *
+ * options are mcu=, freq=, sck= and gap= in cycles, cycles= limit,
+ * fault=txn:byte:xor to flip bits sent to the bootloader (txn counts
+ * from 1), base= flash image to start from, expect=fail when the
+ * scenario is supposed to fail, expect=reset when the bootloader is
+ * supposed to reset before the end of the script
+ */
+
+// read the scenario file
+static int
+load_scenarios(const char * path, const char * outdir, const char * base, int verbose)
+{
+    char line[2048];
+    int lineno = 0;
+    FILE * f = fopen(path, "r");
+    if (f == NULL) {
+        perror(path);
+        return -1;
+    }
+    while (fgets(line, sizeof(line), f) == line) {
+        lineno++;
+        char * comment = strchr(line, '#');
+        if (comment != NULL)
+            *comment = 0;
+        char * tok = strtok(line, " \t\n");
+        if (tok == NULL)
+            continue;
+        if (scenario_count == MAX_SCENARIOS) {
+            fprintf(stderr, "%s:%d: too many scenarios\n", path, lineno);
+            break;
+        }
+        scenario_t * sc = &scenarios[scenario_count];
+        memset(sc, 0, sizeof(scenario_t));
+        sim_config_defaults(&sc->config);
+        strncpy(sc->name, tok, sizeof(sc->name) - 1);
+        char * hex = strtok(NULL, " \t\n");
+        char * script = strtok(NULL, " \t\n");
+        if (hex == NULL || script == NULL) {
+            fprintf(stderr, "%s:%d: need a name, hex file and script\n", path, lineno);
+            fclose(f);
+            return -1;
+        }
+        strncpy(sc->boot_path, hex, sizeof(sc->boot_path) - 1);
+        strncpy(sc->spi_input, script, sizeof(sc->spi_input) - 1);
+        strncpy(sc->flash_base, base, sizeof(sc->flash_base) - 1);
+        sc->config.max_cycles = DEFAULT_MAX_CYCLES;
+        while ((tok = strtok(NULL, " \t\n")) != NULL) {
+            char * value = strchr(tok, '=');
+            if (value == NULL)
+                goto bad_option;
+            *value++ = 0;
+            if (!strcmp(tok, "mcu"))
+                sc->config.mmcu = strdup(value);
+            else if (!strcmp(tok, "freq"))
+                sc->config.freq = strtoul(value, NULL, 0);
+            else if (!strcmp(tok, "sck"))
+                sc->config.sck_cycles = atoi(value);
+            else if (!strcmp(tok, "gap"))
+                sc->config.byte_gap = atoi(value);
+            else if (!strcmp(tok, "base"))
+                strncpy(sc->flash_base, value, sizeof(sc->flash_base) - 1);
+            else if (!strcmp(tok, "cycles"))
+                sc->config.max_cycles = strtoull(value, NULL, 0);
+            else if (!strcmp(tok, "expect")) {
+                sc->expect_fail = !strcmp(value, "fail");
+                sc->expect_reset = !strcmp(value, "reset");
+                sc->config.stop_at_reset = sc->expect_reset;
+            }
+            else if (!strcmp(tok, "fault")) {
+                unsigned int txn, byte, mask;
+                if (sscanf(value, "%u:%u:%x", &txn, &byte, &mask) != 3)
+                    goto bad_option;
+                sc->config.fault_txn = txn;
+                sc->config.fault_byte = byte;
+                sc->config.fault_xor = mask;
+            } else
+                goto bad_option;
+        }
+        snprintf(sc->output_path, sizeof(sc->output_path), "%s/%s_output.txt",
+                 outdir, sc->name);
+        snprintf(sc->flash_path, sizeof(sc->flash_path), "%s/%s_flash.bin",
+                 outdir, sc->name);
+        sc->config.boot_path = sc->boot_path;
+        sc->config.spi_input = sc->spi_input;
+        sc->config.output_path = sc->output_path;
+        // with a base image the flash is a private copy on write of it
+        sc->config.flash_path = strlen(sc->flash_base) ? "" : sc->flash_path;
+        sc->config.flash_base = sc->flash_base;
+        sc->config.stop_when_done = 1;
+        sc->config.verbose = verbose;
+        sc->config.log = 1 + verbose;
+        scenario_count++;
+        continue;
+    bad_option:
+        fprintf(stderr, "%s:%d: bad option '%s'\n", path, lineno, tok);
+        fclose(f);
+        return -1;
+    }
+    fclose(f);
+    return 0;
+}
+
+/*-----------------------------------------------------------------------*/
+
+// boot each bootloader, mcu and frequency once, all the scenarios using
+// it start from the snapshot
+static void
+boot_snapshots(void)
+{
+    for (int i=0; i<scenario_count; i++) {
+        sim_config_t * config = &scenarios[i].config;
+        for (int j=0; j<snapshot_count; j++) {
+            if (sim_snapshot_matches(&snapshots[j], config)) {
+                config->snapshot = &snapshots[j];
+                break;
+            }
+        }
+        if (config->snapshot != NULL || snapshot_count == MAX_SNAPSHOTS)
+            continue;
+        if (sim_snapshot_boot(&snapshots[snapshot_count], config) == 0)
+            config->snapshot = &snapshots[snapshot_count++];
+    }
+}
+
+/*-----------------------------------------------------------------------*/
+
+static void
+run_scenario(scenario_t * sc)
+{
+    sim_harness_t sim;
+    struct timespec start, end;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    // every run starts from an erased flash or the base image
+    unlink(sc->flash_path);
+    if (sim_harness_init(&sim, &sc->config) != 0) {
+        sc->state = cpu_Crashed;
+    } else {
+        sc->state = sim_harness_run(&sim);
+        sc->done = sim.spi.done;
+        sc->spi_errors = spi_virt_error_count(&sim.spi);
+        sc->cycles = sim.avr->cycle;
+        if (sim.run_seconds > 0)
+            sc->mcycles_per_sec = sim.run_cycles / sim.run_seconds * 1e-6;
+        sc->budget_exceeded = sim.budget_exceeded;
+        sc->resets = sim.resets;
+        sim_harness_cleanup(&sim);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    sc->seconds = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) * 1e-9;
+
+    int ok = sc->done && sc->state != cpu_Crashed && sc->spi_errors == 0;
+    // a reset in the middle of the script leaves bytes unread, those
+    // aren't errors here
+    if (sc->expect_reset)
+        sc->passed = sc->resets && !sc->done && sc->state != cpu_Crashed;
+    else
+        sc->passed = sc->expect_fail ? !ok : ok;
+}
+
+/*-----------------------------------------------------------------------*/
+
+static void *
+worker(void * param)
+{
+    while (1) {
+        pthread_mutex_lock(&lock);
+        int idx = next_scenario++;
+        pthread_mutex_unlock(&lock);
+        if (idx >= scenario_count)
+            break;
+        scenario_t * sc = &scenarios[idx];
+        run_scenario(sc);
+        pthread_mutex_lock(&lock);
+        printf("%-4s %s (%.2fs)\n", sc->passed ? "ok" : "FAIL", sc->name, sc->seconds);
+        fflush(stdout);
+        pthread_mutex_unlock(&lock);
+    }
+    return NULL;
+}
+
+/*-----------------------------------------------------------------------*/
+
+int main(int argc, char *argv[])
+{
+    char * scenario_path = NULL;
+    char * outdir = ".";
+    char * base = "";
+    int threads = sysconf(_SC_NPROCESSORS_ONLN);
+    int verbose = 0;
+    int cold = 0;
+    int failed = 0;
+
+    for (int i = 1; i < argc; i++) {
+        if (!strcmp(argv[i], "-j") && i + 1 < argc)
+            threads = atoi(argv[++i]);
+        else if (!strcmp(argv[i], "-o") && i + 1 < argc)
+            outdir = argv[++i];
+        else if (!strcmp(argv[i], "-b") && i + 1 < argc)
+            base = argv[++i];
+        else if (!strcmp(argv[i], "-v"))
+            verbose++;
+        else if (!strcmp(argv[i], "-c"))
+            cold++;
+        else if (scenario_path == NULL && argv[i][0] != '-')
+            scenario_path = argv[i];
+        else {
+            fprintf(stderr, "%s: invalid argument %s\n", argv[0], argv[i]);
+            fprintf(stderr, "usage: %s [-v] [-c] [-j threads] [-o outdir] [-b base.bin] scenarios.txt\n",
+                    argv[0]);
+            exit(1);
+        }
+    }
+    if (scenario_path == NULL) {
+        fprintf(stderr, "usage: %s [-v] [-c] [-j threads] [-o outdir] [-b base.bin] scenarios.txt\n",
+                argv[0]);
+        exit(1);
+    }
+    if (load_scenarios(scenario_path, outdir, base, verbose) != 0)
+        exit(1);
+    if (threads < 1)
+        threads = 1;
+    if (threads > scenario_count)
+        threads = scenario_count;
+
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    if (!cold)
+        boot_snapshots();
+    pthread_t * pool = calloc(threads, sizeof(pthread_t));
+    for (int i=0; i<threads; i++)
+        pthread_create(&pool[i], NULL, worker, NULL);
+    for (int i=0; i<threads; i++)
+        pthread_join(pool[i], NULL);
+    free(pool);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    for (int i=0; i<snapshot_count; i++)
+        sim_snapshot_free(&snapshots[i]);
+
+    printf("\n%-24s %-6s %-8s %12s %6s %8s %9s\n", "scenario", "result", "state",
+           "cycles", "errors", "seconds", "Mcycles/s");
+    for (int i=0; i<scenario_count; i++) {
+        scenario_t * sc = &scenarios[i];
+        printf("%-24s %-6s %-8s %12lu %6d %8.2f %9.2f\n", sc->name,
+               sc->passed ? "ok" : "FAIL",
+               sc->state == cpu_Crashed ? "crashed" : sc->done ? "done" :
+               sc->resets ? "reset" : sc->budget_exceeded ? "budget" : "timeout",
+               sc->cycles, sc->spi_errors, sc->seconds, sc->mcycles_per_sec);
+        if (!sc->passed)
+            failed++;
+    }
+    printf("%d scenarios, %d failed, %d threads, %.2fs\n", scenario_count, failed,
+           threads,
+           (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) * 1e-9);
+    return failed ? 1 : 0;
+}
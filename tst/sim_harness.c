@@ -0,0 +1,554 @@
+/*
+	sim_harness.c
+
+    Copyright 2021 Greg Green <ggreen@bit-builder.com>
+
+ 	This file is part of avr_bootloaders.
+ */
+
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+
+#include "sim_avr.h"
+#include "sim_hex.h"
+#include "sim_harness.h"
+
+/*-----------------------------------------------------------------------*/
+
+// avr special flash initalization
+// here: map a file over the flash memory, so everything the bootloader
+// writes lands in the file as it happens and survives a crash
+static void
+sim_flash_init(avr_t * avr, void * data)
+{
+    sim_flash_t * flash = (sim_flash_t *)data;
+    size_t size = avr->flashend + 1;
+    int flags = MAP_SHARED;
+    int fd = -1;
+
+    if (strlen(flash->base) != 0) {
+        fd = open(flash->base, O_RDONLY);
+        struct stat st;
+        if (fd < 0 || fstat(fd, &st) != 0 || st.st_size < size) {
+            fprintf(stderr, "flash base image '%s' missing or smaller than %zu bytes\n",
+                    flash->base, size);
+            if (fd >= 0)
+                close(fd);
+            return;
+        }
+        if (strlen(flash->path) == 0) {
+            // private copy on write of the base, nothing is saved
+            flags = MAP_PRIVATE;
+        } else {
+            // start the flash file as a copy of the base
+            int out = open(flash->path, O_RDWR|O_CREAT|O_TRUNC, 0644);
+            if (out < 0) {
+                perror(flash->path);
+                close(fd);
+                return;
+            }
+            uint8_t * base = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+            ssize_t r = base == MAP_FAILED ? -1 : write(out, base, size);
+            if (base != MAP_FAILED)
+                munmap(base, size);
+            close(fd);
+            fd = out;
+            if (r != size) {
+                perror(flash->path);
+                close(fd);
+                return;
+            }
+        }
+    } else {
+        fd = open(flash->path, O_RDWR|O_CREAT, 0644);
+        if (fd < 0) {
+            perror(flash->path);
+            return;
+        }
+        // a new or short file is erased flash
+        struct stat st;
+        if (fstat(fd, &st) == 0 && st.st_size < size) {
+            uint8_t erased[256];
+            memset(erased, 0xff, sizeof(erased));
+            lseek(fd, st.st_size, SEEK_SET);
+            for (off_t left = size - st.st_size; left > 0; left -= sizeof(erased))
+                if (write(fd, erased, left < sizeof(erased) ? left : sizeof(erased)) < 0)
+                    break;
+        }
+    }
+
+    uint8_t * map = mmap(NULL, size, PROT_READ|PROT_WRITE, flags, fd, 0);
+    // the mapping keeps its own reference to the file
+    close(fd);
+    if (map == MAP_FAILED) {
+        fprintf(stderr, "unable to map flash memory\n");
+        perror(strlen(flash->path) ? flash->path : flash->base);
+        return;
+    }
+    // simavr frees its own buffer at terminate, keep it to put back
+    flash->heap = avr->flash;
+    flash->map = map;
+    flash->size = size;
+    avr->flash = map;
+}
+
+/*-----------------------------------------------------------------------*/
+
+// avr special flash deinitalization
+// here: unmap the flash file and give simavr its buffer back
+static void
+sim_flash_deinit(avr_t * avr, void * data)
+{
+    sim_flash_t * flash = (sim_flash_t *)data;
+
+    if (flash->map == NULL)
+        return;
+    avr->flash = flash->heap;
+    munmap(flash->map, flash->size);
+    flash->map = NULL;
+    flash->heap = NULL;
+}
+
+/*-----------------------------------------------------------------------*/
+
+static avr_cycle_count_t
+sim_vcd_stop_proc(struct avr_t * avr, avr_cycle_count_t when, void * param)
+{
+    sim_harness_t * sim = (sim_harness_t *)param;
+    if (sim->vcd_recording) {
+        avr_vcd_stop(sim->vcd);
+        sim->vcd_recording = 0;
+        if (sim->config.verbose)
+            printf("VCD: stopped at cycle %lu\n", when);
+    }
+    return 0;
+}
+
+/*-----------------------------------------------------------------------*/
+
+// start recording, and schedule the end of the window
+static avr_cycle_count_t
+sim_vcd_start_proc(struct avr_t * avr, avr_cycle_count_t when, void * param)
+{
+    sim_harness_t * sim = (sim_harness_t *)param;
+    if (sim->vcd_recording)
+        return 0;
+    avr_vcd_start(sim->vcd);
+    sim->vcd_recording = 1;
+    if (sim->config.verbose)
+        printf("VCD: started at cycle %lu\n", when);
+    if (sim->config.vcd_length)
+        avr_cycle_timer_register(avr, sim->config.vcd_length, sim_vcd_stop_proc, sim);
+    return 0;
+}
+
+/*-----------------------------------------------------------------------*/
+
+// CS going low, start recording on the trigger transaction
+static void
+sim_vcd_cs_hook(struct avr_irq_t * irq, uint32_t value, void * param)
+{
+    sim_harness_t * sim = (sim_harness_t *)param;
+    if (value == 0 && sim->spi.txn_number == sim->config.vcd_trigger_txn)
+        sim_vcd_start_proc(sim->avr, sim->avr->cycle, sim);
+}
+
+/*-----------------------------------------------------------------------*/
+
+// record CS, the bytes on SDI and SDO, SCK activity, BUTTON and
+// MCU_RUNNING, after the snapshot restore as that drops all timers
+static int
+sim_vcd_init(sim_harness_t * sim)
+{
+    const sim_config_t * config = &sim->config;
+    avr_irq_t * irq = sim->spi.irq;
+
+    sim->vcd = calloc(1, sizeof(avr_vcd_t));
+    if (avr_vcd_init(sim->avr, config->vcd_path, sim->vcd, 100000) != 0) {
+        fprintf(stderr, "unable to create %s\n", config->vcd_path);
+        free(sim->vcd);
+        sim->vcd = NULL;
+        return -1;
+    }
+    avr_vcd_add_signal(sim->vcd, irq + SPI_VIRT_CS, 1, "CS");
+    avr_vcd_add_signal(sim->vcd, irq + SPI_VIRT_SCK, 1, "SCK");
+    avr_vcd_add_signal(sim->vcd, irq + SPI_VIRT_SDI, 8, "SDI");
+    avr_vcd_add_signal(sim->vcd, irq + SPI_VIRT_SDO, 8, "SDO");
+    avr_vcd_add_signal(sim->vcd, irq + SPI_VIRT_BUTTON, 1, "BUTTON");
+    avr_vcd_add_signal(sim->vcd, irq + SPI_VIRT_MCU_RUNNING, 1, "MCU_RUNNING");
+
+    if (config->vcd_trigger_txn > 0) {
+        avr_irq_register_notify(irq + SPI_VIRT_CS, sim_vcd_cs_hook, sim);
+    } else if (config->vcd_start > sim->avr->cycle) {
+        avr_cycle_timer_register(sim->avr, config->vcd_start - sim->avr->cycle,
+                                 sim_vcd_start_proc, sim);
+    } else {
+        sim_vcd_start_proc(sim->avr, sim->avr->cycle, sim);
+    }
+    return 0;
+}
+
+/*-----------------------------------------------------------------------*/
+
+void sim_config_defaults(sim_config_t * config)
+{
+    memset(config, 0, sizeof(sim_config_t));
+    config->boot_path = "../build-power-monitor-bootloader-avr/power-monitor-bootloader-atmega328p.hex";
+    config->mmcu = "atmega328p";
+    config->freq = 8000000;
+    config->spi_input = "";
+    config->flash_path = "";
+    config->flash_base = "";
+    config->output_path = "";
+    config->vcd_path = "";
+    config->socket_path = "";
+    config->sck_cycles = SCK_DELAY_CYCLES * 2;
+    config->byte_gap = BYTE_GAP_CYCLES;
+    config->fast = 1;
+    config->log = 1;
+    config->verbose = 1;
+    config->max_cycles = SIM_DEFAULT_MAX_CYCLES;
+    config->fault_txn = -1;
+}
+
+/*-----------------------------------------------------------------------*/
+
+// create the avr, load the bootloader and attach the spi controller
+int sim_harness_init(sim_harness_t * sim, const sim_config_t * config)
+{
+    memset(sim, 0, sizeof(sim_harness_t));
+    sim->config = *config;
+    sim->state = cpu_Limbo;
+    sim->min_sp = 0xffff;
+
+    // the bootloader may have more than one chunk, the jump table for the
+    // application sits at the end of the flash
+    ihex_chunk_p boot;
+    int chunks = read_ihex_chunks(config->boot_path, &boot);
+    if (chunks <= 0) {
+        fprintf(stderr, "Unable to load %s\n", config->boot_path);
+        return -1;
+    }
+    uint32_t boot_end = 0;
+    sim->boot_base = boot[0].baseaddr;
+    for (int i = 0; i < chunks; i++) {
+        if (boot[i].baseaddr < sim->boot_base)
+            sim->boot_base = boot[i].baseaddr;
+        if (boot[i].baseaddr + boot[i].size > boot_end)
+            boot_end = boot[i].baseaddr + boot[i].size;
+    }
+    sim->boot_size = boot_end - sim->boot_base;
+    if (sim->boot_base > 32*1024*1024) {
+        sim->config.mmcu = "atmega2560";
+        sim->config.freq = 20000000;
+    }
+
+    sim->avr = avr_make_mcu_by_name(sim->config.mmcu);
+    if (!sim->avr) {
+        fprintf(stderr, "Error creating the AVR core '%s'\n", sim->config.mmcu);
+        free_ihex_chunks(boot);
+        return -1;
+    }
+    avr_t * avr = sim->avr;
+
+    // register our own functions
+    int mapped = strlen(config->flash_path) != 0 || strlen(config->flash_base) != 0;
+    if (mapped) {
+        strncpy(sim->flash.path, config->flash_path, sizeof(sim->flash.path) - 1);
+        strncpy(sim->flash.base, config->flash_base, sizeof(sim->flash.base) - 1);
+        avr->custom.init = sim_flash_init;
+        avr->custom.deinit = sim_flash_deinit;
+        avr->custom.data = &sim->flash;
+    }
+    avr_init(avr);
+    if (mapped && sim->flash.map == NULL) {
+        free_ihex_chunks(boot);
+        avr_terminate(avr);
+        sim->avr = NULL;
+        return -1;
+    }
+    avr->frequency = sim->config.freq;
+
+    if (config->verbose)
+        printf("%s bootloader 0x%05x: %d bytes\n", sim->config.mmcu,
+               sim->boot_base, sim->boot_size);
+    if (boot_end > avr->flashend + 1u) {
+        fprintf(stderr, "%s doesn't fit in the %s flash\n", config->boot_path, sim->config.mmcu);
+        free_ihex_chunks(boot);
+        avr_terminate(avr);
+        sim->avr = NULL;
+        return -1;
+    }
+    for (int i = 0; i < chunks; i++)
+        memcpy(avr->flash + boot[i].baseaddr, boot[i].data, boot[i].size);
+    free_ihex_chunks(boot);
+    avr->pc = sim->boot_base;
+    /* end of flash, remember we are writing /code/ */
+    avr->codeend = avr->flashend;
+    avr->log = config->log;
+
+    spi_virt_wiring_t wiring = {
+        .chip_select = { .port = 'B', .pin = 2 },
+        .mcu_running = { .port = 'B', .pin = 1 },
+        .button = { .port = 'D', .pin = 2 },
+        .spsr = 0x4D,
+        .spdr = 0x4E,
+    };
+
+    spi_virt_init(avr, &sim->spi, &wiring);
+    sim->spi.verbose = config->verbose;
+    sim->spi.fast = config->fast;
+    spi_virt_set_timing(&sim->spi, config->sck_cycles, config->byte_gap);
+    sim->spi.fault_txn = config->fault_txn;
+    sim->spi.fault_byte = config->fault_byte;
+    sim->spi.fault_xor = config->fault_xor;
+    if (config->snapshot != NULL && sim_snapshot_matches(config->snapshot, config)) {
+        if (sim_snapshot_restore(sim, config->snapshot) == 0)
+            sim->restored = 1;
+        else if (config->verbose)
+            printf("snapshot doesn't match the bootloader, booting from reset\n");
+    }
+    if (strlen(config->vcd_path) != 0 && sim_vcd_init(sim) != 0) {
+        sim_harness_cleanup(sim);
+        return -1;
+    }
+    if (spi_txn_input_init(config->spi_input, &sim->spi) != 0) {
+        sim_harness_cleanup(sim);
+        return -1;
+    }
+    spi_virt_save_to_file(&sim->spi, config->output_path);
+    if (strlen(config->socket_path) != 0) {
+        if (sim_socket_open(&sim->socket, &sim->spi, config->socket_path) != 0) {
+            sim_harness_cleanup(sim);
+            return -1;
+        }
+        // the uploader starts on the bootloader's first ready signal
+        return 0;
+    }
+    if (sim->spi.input.first != NULL)
+        sim_harness_start(sim);
+    return 0;
+}
+
+/*-----------------------------------------------------------------------*/
+
+// schedule the transaction script, right away when started from a
+// snapshot as the bootloader is already waiting
+void sim_harness_start(sim_harness_t * sim)
+{
+    if (sim->restored)
+        sim->spi.input.start_cycle = sim->avr->cycle + SIM_SNAPSHOT_TXN_DELAY;
+    spi_txn_input_start(&sim->spi);
+}
+
+/*-----------------------------------------------------------------------*/
+
+// run one instruction
+int sim_harness_step(sim_harness_t * sim)
+{
+    if (sim->profile != NULL)
+        sim->state = sim_profile_run(sim->profile);
+    else
+        sim->state = avr_run(sim->avr);
+    // only a reset starts at the reset address, the vectors are after it
+    if (sim->avr->pc == sim->avr->reset_pc) {
+        if (sim->resets++ == 0)
+            sim->reset_cycle = sim->avr->cycle;
+    }
+    // an interrupt taken with the vectors in the boot section, nothing
+    // else runs below the bootloader until the reset clears IVSEL
+    if ((sim->avr->data[SIM_MCUCR] & SIM_IVSEL) && sim->avr->pc < sim->boot_base)
+        sim->avr->pc += sim->boot_base;
+    if (sim->config.track_stack) {
+        uint16_t sp = sim->avr->data[R_SPL] | (sim->avr->data[R_SPH] << 8);
+        if (sp < sim->min_sp)
+            sim->min_sp = sp;
+    }
+    return sim->state;
+}
+
+/*-----------------------------------------------------------------------*/
+
+// add the cycles and time since the phase began to it
+static void
+sim_phase_end(sim_harness_t * sim)
+{
+    if (!sim->phase_running)
+        return;
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    avr_cycle_count_t cycles = sim->avr->cycle - sim->phase_cycle;
+    double seconds = (now.tv_sec - sim->phase_clock.tv_sec) +
+        (now.tv_nsec - sim->phase_clock.tv_nsec) * 1e-9;
+    sim->phase_time[sim->phase].cycles += cycles;
+    sim->phase_time[sim->phase].seconds += seconds;
+    sim->run_cycles += cycles;
+    sim->run_seconds += seconds;
+    sim->phase_running = 0;
+}
+
+/*-----------------------------------------------------------------------*/
+
+// the script moved on to the phase of its next transaction, only looked
+// at when it changes so the clock isn't read every instruction
+static void
+sim_phase_begin(sim_harness_t * sim, int phase)
+{
+    sim_phase_end(sim);
+    if (phase != 0 && sim->ready_cycle == 0)
+        sim->ready_cycle = sim->spi.ready_cycle;
+    sim->phase = phase;
+    sim->phase_cycle = sim->avr->cycle;
+    clock_gettime(CLOCK_MONOTONIC, &sim->phase_clock);
+    sim->phase_running = 1;
+}
+
+/*-----------------------------------------------------------------------*/
+
+// where a run that used up its cycle budget was stuck
+static void
+sim_budget_report(sim_harness_t * sim)
+{
+    avr_t * avr = sim->avr;
+    spi_virt_t * spi = &sim->spi;
+    spi_test_txn_t * txn = spi->current_txn;
+
+    fprintf(stderr, "SIM: cycle budget of %lu cycles used up at pc 0x%05x in the %s, "
+            "phase %s\n", sim->config.max_cycles, avr->pc,
+            avr->pc >= sim->boot_base ? "bootloader" : "application",
+            spi->input.phase_names[sim->phase]);
+    if (txn == NULL)
+        fprintf(stderr, "SIM: %d transactions, %s\n", spi->txn_number,
+                spi->done ? "the script is done" : "no transaction scheduled");
+    else if (txn->start_cycle == 0)
+        fprintf(stderr, "SIM: transaction %d (line %d) scheduled, not started\n",
+                spi->txn_number + 1, txn->line);
+    else if (txn->end_cycle < txn->start_cycle)
+        fprintf(stderr, "SIM: transaction %d (line %d) clocking since cycle %lu\n",
+                spi->txn_number, txn->line, txn->start_cycle);
+    else
+        fprintf(stderr, "SIM: transaction %d (line %d) clocked at cycle %lu, "
+                "waiting for BUTTON low\n", spi->txn_number, txn->line, txn->end_cycle);
+    if (spi->ready_cycle != 0)
+        fprintf(stderr, "SIM: BUTTON %s, bootloader last ready at cycle %lu, "
+                "%lu cycles ago\n", spi->button ? "high" : "low", spi->ready_cycle,
+                avr->cycle - spi->ready_cycle);
+    else
+        fprintf(stderr, "SIM: BUTTON %s, the bootloader was never ready\n",
+                spi->button ? "high" : "low");
+}
+
+/*-----------------------------------------------------------------------*/
+
+// run until the avr stops, the script is done or got a wrong reply, it
+// was reset with stop_at_reset, or the cycle budget is used up
+int sim_harness_run(sim_harness_t * sim)
+{
+    avr_t * avr = sim->avr;
+    sim_phase_begin(sim, sim->spi.phase);
+    while (1) {
+        int state = sim_harness_step(sim);
+        if ( state == cpu_Done || state == cpu_Crashed)
+            break;
+        if (sim->config.stop_when_done && sim->spi.done)
+            break;
+        // a wrong reply stops the script, nothing more to see
+        if (sim->spi.mismatches)
+            break;
+        if (sim->config.stop_at_reset && sim->resets)
+            break;
+        if (sim->spi.phase != sim->phase)
+            sim_phase_begin(sim, sim->spi.phase);
+        if (sim->config.max_cycles && avr->cycle >= sim->config.max_cycles) {
+            sim->budget_exceeded = 1;
+            sim_budget_report(sim);
+            break;
+        }
+    }
+    sim_phase_end(sim);
+    return sim->state;
+}
+
+/*-----------------------------------------------------------------------*/
+
+// cycles, wall clock time and simulation speed per phase of the runs
+// so far, and the whole of them against real time
+void sim_harness_time_report(sim_harness_t * sim)
+{
+    avr_t * avr = sim->avr;
+    spi_txn_input_t * input = &sim->spi.input;
+
+    for (int i=0; i<input->phase_count; i++) {
+        sim_phase_time_t * t = &sim->phase_time[i];
+        if (t->cycles == 0)
+            continue;
+        printf("TIME: %-16s %12lu cycles %9.3f s %8.2f Mcycles/s\n",
+               input->phase_names[i], t->cycles, t->seconds,
+               t->seconds > 0 ? t->cycles / t->seconds * 1e-6 : 0);
+    }
+    double simulated = (double)sim->run_cycles / avr->frequency;
+    printf("TIME: %lu cycles, %.3f s simulated at %.1f MHz in %.3f s, "
+           "%.2f Mcycles/s, %.2fx real time\n", sim->run_cycles, simulated,
+           avr->frequency * 1e-6, sim->run_seconds,
+           sim->run_seconds > 0 ? sim->run_cycles / sim->run_seconds * 1e-6 : 0,
+           sim->run_seconds > 0 ? simulated / sim->run_seconds : 0);
+    if (sim->ready_cycle != 0)
+        printf("TIME: bootloader ready at cycle %lu, %.3f ms after reset\n",
+               sim->ready_cycle, sim->ready_cycle * 1e3 / avr->frequency);
+}
+
+/*-----------------------------------------------------------------------*/
+
+// the deepest the stack went and what that leaves above the globals,
+// ram_end is _end from the elf or 0 if not known
+void sim_harness_memory_report(sim_harness_t * sim, uint16_t ram_end)
+{
+    avr_t * avr = sim->avr;
+
+    if (sim->min_sp == 0xffff) {
+        printf("MEMORY: stack not tracked\n");
+        return;
+    }
+    printf("MEMORY: deepest SP 0x%04x, %u bytes of stack\n",
+           sim->min_sp, avr->ramend - sim->min_sp);
+    if (ram_end == 0 || ram_end > avr->ramend)
+        return;
+    int unused = (int)sim->min_sp + 1 - ram_end;
+    printf("MEMORY: globals end at 0x%04x, %d of %u bytes of sram never used\n",
+           ram_end, unused, avr->ramend + 1 - SIM_SRAM_START);
+    // an SRAM_PAINT build also shows the stack before tracking started,
+    // like the boot of a snapshot
+    if (avr->data[ram_end] == SIM_SRAM_PAINT) {
+        uint16_t p = ram_end;
+        while (p <= avr->ramend && avr->data[p] == SIM_SRAM_PAINT)
+            p++;
+        printf("MEMORY: %u painted bytes untouched, %u bytes of stack since reset\n",
+               p - ram_end, avr->ramend + 1 - p);
+    }
+}
+
+/*-----------------------------------------------------------------------*/
+
+void sim_harness_cleanup(sim_harness_t * sim)
+{
+    if (sim->spi.output_file != NULL)
+        fclose(sim->spi.output_file);
+    sim->spi.output_file = NULL;
+    if (sim->vcd != NULL) {
+        avr_vcd_close(sim->vcd);
+        free(sim->vcd);
+        sim->vcd = NULL;
+    }
+    if (sim->socket.path[0] != 0)
+        sim_socket_close(&sim->socket);
+    if (sim->avr != NULL)
+        avr_terminate(sim->avr);
+    sim->avr = NULL;
+    // clean up spi input
+    spi_txn_input_cleanup(&sim->spi);
+}
@@ -0,0 +1,170 @@
+/*
+	sim_harness.h
+    Copyright 2021 Greg Green <ggreen@bit-builder.com>
+
+ 	This file is part of avr_bootloaders.
+    One simulated avr running the bootloader, with the spi controller
+    attached and all the state that goes with it
+ */
+
+#ifndef SIM_HARNESS_H_
+#define SIM_HARNESS_H_
+
+#include <stdint.h>
+#include <time.h>
+#include "sim_avr.h"
+#include "sim_vcd_file.h"
+#include "spi_virt.h"
+#include "sim_profile.h"
+#include "sim_snapshot.h"
+#include "sim_socket.h"
+
+/*-----------------------------------------------------------------------*/
+
+#define SIM_DEFAULT_MAX_CYCLES 0
+
+// first byte of sram in data space, and the SRAM_PAINT fill byte of the
+// bootloader
+#define SIM_SRAM_START 0x100
+#define SIM_SRAM_PAINT 0xc5
+
+// MCUCR in data space and its IVSEL bit, simavr always takes the
+// vectors at 0 so the harness moves them to the bootloader
+#define SIM_MCUCR 0x55
+#define SIM_IVSEL 0x02
+
+// Timer1 in data space, simavr keeps its clock select and compare
+// timers outside of it, a snapshot writes them again
+#define SIM_TIMSK1 0x6f
+#define SIM_TCCR1A 0x80
+#define SIM_TCCR1B 0x81
+#define SIM_TCNT1L 0x84
+#define SIM_TCNT1H 0x85
+#define SIM_OCR1AL 0x88
+#define SIM_OCR1AH 0x89
+
+/*-----------------------------------------------------------------------*/
+
+typedef struct sim_config
+{
+    const char * boot_path;     // bootloader hex file
+    const char * mmcu;
+    uint32_t freq;
+    const char * spi_input;     // transaction script, may be empty
+    const char * flash_path;    // persistent flash file, may be empty
+    const char * flash_base;    // flash image to start from, may be empty
+    const char * output_path;   // transaction log, may be empty
+    int sck_cycles;
+    int byte_gap;
+    // spi_virt fast transport, off for the per byte irq chain
+    int fast;
+    int log;
+    int verbose;
+    // stop once the transaction script is done
+    int stop_when_done;
+    // cycle budget, stop with a diagnostic after this many cycles, 0 for
+    // no limit
+    avr_cycle_count_t max_cycles;
+    // flip bits of one byte sent to the bootloader, off if fault_txn < 0
+    int fault_txn;
+    int fault_byte;
+    uint8_t fault_xor;
+    // waveform of the spi lines, off if empty
+    const char * vcd_path;
+    // record from this cycle, or from the start of transaction
+    // vcd_trigger_txn (counting from 1) if it isn't 0
+    avr_cycle_count_t vcd_start;
+    int vcd_trigger_txn;
+    // record this many cycles, 0 until the end
+    avr_cycle_count_t vcd_length;
+    // start from this booted avr instead of reset, if it matches
+    const sim_snapshot_t * snapshot;
+    // keep the deepest stack pointer for sim_harness_memory_report
+    int track_stack;
+    // serve the spi bus to an uploader on this unix socket instead of
+    // running the script, off if empty
+    const char * socket_path;
+    // stop at the first reset, the watchdog reset of a timeout or 'Q'
+    int stop_at_reset;
+} sim_config_t;
+
+/*-----------------------------------------------------------------------*/
+
+// flash of the avr mapped from a file, shared with the file when there
+// is a path, a private copy on write of the base image when only a base
+typedef struct sim_flash
+{
+    char path[1024];
+    char base[1024];
+    uint8_t * map;
+    uint8_t * heap;     // simavr's own flash buffer
+    size_t size;
+} sim_flash_t;
+
+/*-----------------------------------------------------------------------*/
+
+// simulated cycles and wall clock time of one phase of the script
+typedef struct sim_phase_time
+{
+    avr_cycle_count_t cycles;
+    double seconds;
+} sim_phase_time_t;
+
+/*-----------------------------------------------------------------------*/
+
+typedef struct sim_harness
+{
+    sim_config_t config;
+    struct avr_t * avr;
+    spi_virt_t spi;
+    sim_flash_t flash;
+    sim_profile_t * profile;
+    uint32_t boot_base;
+    uint32_t boot_size;
+    int state;
+    // started from a snapshot
+    int restored;
+    avr_vcd_t * vcd;
+    int vcd_recording;
+    sim_socket_t socket;
+    // deepest stack pointer seen, with track_stack
+    uint16_t min_sp;
+    // time per phase, the phase running and when it began
+    sim_phase_time_t phase_time[SPI_VIRT_MAX_PHASES];
+    int phase;
+    int phase_running;
+    avr_cycle_count_t phase_cycle;
+    struct timespec phase_clock;
+    // all the phases of the run
+    avr_cycle_count_t run_cycles;
+    double run_seconds;
+    // the bootloader's first ready signal, the end of the boot
+    avr_cycle_count_t ready_cycle;
+    // stopped by the cycle budget
+    int budget_exceeded;
+    // resets since the start, and the cycle of the first
+    int resets;
+    avr_cycle_count_t reset_cycle;
+} sim_harness_t;
+
+/*-----------------------------------------------------------------------*/
+
+extern void sim_config_defaults(sim_config_t * config);
+
+extern int sim_harness_init(sim_harness_t * sim, const sim_config_t * config);
+
+extern void sim_harness_start(sim_harness_t * sim);
+
+extern int sim_harness_step(sim_harness_t * sim);
+
+extern int sim_harness_run(sim_harness_t * sim);
+
+extern void sim_harness_memory_report(sim_harness_t * sim, uint16_t ram_end);
+
+extern void sim_harness_time_report(sim_harness_t * sim);
+
+extern void sim_harness_cleanup(sim_harness_t * sim);
+
+/*-----------------------------------------------------------------------*/
+
+#endif // SIM_HARNESS_H_
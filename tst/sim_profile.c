@@ -0,0 +1,402 @@
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <elf.h>
+
+#include "sim_avr.h"
+#include "sim_profile.h"
+
+/*-----------------------------------------------------------------------*/
+
+static int
+symbol_compare(const void * a, const void * b)
+{
+    const sim_symbol_t * sa = (const sim_symbol_t *)a;
+    const sim_symbol_t * sb = (const sim_symbol_t *)b;
+    if (sa->addr != sb->addr)
+        return sa->addr < sb->addr ? -1 : 1;
+    // functions before labels at the same address
+    return (int)sb->size - (int)sa->size;
+}
+
+/*-----------------------------------------------------------------------*/
+
+// read a whole 32-bit elf file, NULL if it isn't one
+static uint8_t *
+read_elf(const char * elf_path)
+{
+    FILE * f = fopen(elf_path, "rb");
+    if (f == NULL) {
+        perror(elf_path);
+        return NULL;
+    }
+    fseek(f, 0, SEEK_END);
+    long len = ftell(f);
+    fseek(f, 0, SEEK_SET);
+    uint8_t * image = malloc(len);
+    if (fread(image, 1, len, f) != len) {
+        perror(elf_path);
+        fclose(f);
+        free(image);
+        return NULL;
+    }
+    fclose(f);
+
+    Elf32_Ehdr * ehdr = (Elf32_Ehdr *)image;
+    if (len < sizeof(Elf32_Ehdr) || memcmp(ehdr->e_ident, ELFMAG, SELFMAG) != 0
+        || ehdr->e_ident[EI_CLASS] != ELFCLASS32) {
+        fprintf(stderr, "PROFILE: '%s' is not a 32-bit elf file\n", elf_path);
+        free(image);
+        return NULL;
+    }
+    return image;
+}
+
+/*-----------------------------------------------------------------------*/
+
+// read the function symbols and the globals from the symbol table of
+// the elf file
+static int
+load_symbols(sim_profile_t * prof, const char * elf_path)
+{
+    uint8_t * image = read_elf(elf_path);
+    if (image == NULL)
+        return -1;
+
+    Elf32_Ehdr * ehdr = (Elf32_Ehdr *)image;
+    Elf32_Shdr * shdr = (Elf32_Shdr *)(image + ehdr->e_shoff);
+    for (int i=0; i<ehdr->e_shnum; i++) {
+        if (shdr[i].sh_type != SHT_SYMTAB)
+            continue;
+        Elf32_Sym * syms = (Elf32_Sym *)(image + shdr[i].sh_offset);
+        int count = shdr[i].sh_size / sizeof(Elf32_Sym);
+        const char * strtab = (const char *)(image + shdr[shdr[i].sh_link].sh_offset);
+        prof->symbols = calloc(count, sizeof(sim_symbol_t));
+        prof->objects = calloc(count, sizeof(sim_symbol_t));
+        for (int j=0; j<count; j++) {
+            int type = ELF32_ST_TYPE(syms[j].st_info);
+            const char * name = strtab + syms[j].st_name;
+            if (type == STT_OBJECT && syms[j].st_size > 0 &&
+                syms[j].st_value >= SIM_PROFILE_DATA_OFFSET) {
+                sim_symbol_t * obj = &prof->objects[prof->object_count++];
+                obj->addr = syms[j].st_value - SIM_PROFILE_DATA_OFFSET;
+                obj->size = syms[j].st_size;
+                obj->name = strdup(name);
+                continue;
+            }
+            if (type != STT_FUNC && type != STT_NOTYPE)
+                continue;
+            if (syms[j].st_shndx == SHN_UNDEF || syms[j].st_shndx >= ehdr->e_shnum
+                || !(shdr[syms[j].st_shndx].sh_flags & SHF_EXECINSTR))
+                continue;
+            if (name[0] == 0 || name[0] == '.' || syms[j].st_value >= SIM_PROFILE_DATA_OFFSET)
+                continue;
+            sim_symbol_t * sym = &prof->symbols[prof->symbol_count++];
+            sym->addr = syms[j].st_value;
+            sym->size = syms[j].st_size;
+            sym->name = strdup(name);
+        }
+        break;
+    }
+    free(image);
+
+    qsort(prof->symbols, prof->symbol_count, sizeof(sim_symbol_t), symbol_compare);
+    qsort(prof->objects, prof->object_count, sizeof(sim_symbol_t), symbol_compare);
+    // only keep one symbol per address
+    int n = 0;
+    for (int i=0; i<prof->symbol_count; i++) {
+        if (n > 0 && prof->symbols[n-1].addr == prof->symbols[i].addr) {
+            free(prof->symbols[i].name);
+            continue;
+        }
+        prof->symbols[n++] = prof->symbols[i];
+    }
+    prof->symbol_count = n;
+    printf("PROFILE: %d symbols and %d globals from '%s'\n", n,
+           prof->object_count, elf_path);
+    return 0;
+}
+
+/*-----------------------------------------------------------------------*/
+
+// value of any symbol in the elf file, data symbols are offset by
+// 0x800000, returns -1 if not found
+int sim_profile_elf_symbol(const char * elf_path, const char * name, uint32_t * value)
+{
+    uint8_t * image = read_elf(elf_path);
+    if (image == NULL)
+        return -1;
+
+    int res = -1;
+    Elf32_Ehdr * ehdr = (Elf32_Ehdr *)image;
+    Elf32_Shdr * shdr = (Elf32_Shdr *)(image + ehdr->e_shoff);
+    for (int i=0; i<ehdr->e_shnum && res != 0; i++) {
+        if (shdr[i].sh_type != SHT_SYMTAB)
+            continue;
+        Elf32_Sym * syms = (Elf32_Sym *)(image + shdr[i].sh_offset);
+        int count = shdr[i].sh_size / sizeof(Elf32_Sym);
+        const char * strtab = (const char *)(image + shdr[shdr[i].sh_link].sh_offset);
+        for (int j=0; j<count; j++) {
+            if (!strcmp(strtab + syms[j].st_name, name)) {
+                *value = syms[j].st_value;
+                res = 0;
+                break;
+            }
+        }
+    }
+    free(image);
+    return res;
+}
+
+/*-----------------------------------------------------------------------*/
+
+// index of the symbol containing a flash byte address, -1 if none
+int sim_profile_find_symbol(sim_profile_t * prof, uint32_t addr)
+{
+    int lo = 0, hi = prof->symbol_count - 1, found = -1;
+    while (lo <= hi) {
+        int mid = (lo + hi) / 2;
+        if (prof->symbols[mid].addr <= addr) {
+            found = mid;
+            lo = mid + 1;
+        } else {
+            hi = mid - 1;
+        }
+    }
+    return found;
+}
+
+/*-----------------------------------------------------------------------*/
+
+// index of the global holding a data space address, -1 if it's in none
+int sim_profile_find_object(sim_profile_t * prof, uint32_t addr)
+{
+    int lo = 0, hi = prof->object_count - 1;
+    while (lo <= hi) {
+        int mid = (lo + hi) / 2;
+        const sim_symbol_t * obj = &prof->objects[mid];
+        if (addr < obj->addr)
+            hi = mid - 1;
+        else if (addr >= obj->addr + obj->size)
+            lo = mid + 1;
+        else
+            return mid;
+    }
+    return -1;
+}
+
+/*-----------------------------------------------------------------------*/
+
+static const char *
+symbol_name(sim_profile_t * prof, int idx)
+{
+    return idx < 0 ? "[unknown]" : prof->symbols[idx].name;
+}
+
+/*-----------------------------------------------------------------------*/
+
+// find or create the folded stack for the current shadow stack and leaf
+static int
+find_fold(sim_profile_t * prof, int leaf)
+{
+    int depth = prof->depth + 1;
+    for (int i=0; i<prof->fold_count; i++) {
+        sim_fold_t * fold = &prof->folds[i];
+        if (fold->depth == depth && fold->frames[depth - 1] == leaf
+            && !memcmp(fold->frames, prof->stack, prof->depth * sizeof(int)))
+            return i;
+    }
+    if (prof->fold_count == prof->fold_alloc) {
+        prof->fold_alloc = prof->fold_alloc ? prof->fold_alloc * 2 : 64;
+        prof->folds = realloc(prof->folds, prof->fold_alloc * sizeof(sim_fold_t));
+    }
+    sim_fold_t * fold = &prof->folds[prof->fold_count];
+    fold->depth = depth;
+    memcpy(fold->frames, prof->stack, prof->depth * sizeof(int));
+    fold->frames[depth - 1] = leaf;
+    fold->cycles = 0;
+    return prof->fold_count++;
+}
+
+/*-----------------------------------------------------------------------*/
+
+int sim_profile_init(sim_profile_t * prof, struct avr_t * avr,
+                     const char * elf_path)
+{
+    memset(prof, 0, sizeof(sim_profile_t));
+    prof->avr = avr;
+    prof->pc_words = (avr->flashend + 1) >> 1;
+    prof->pc_cycles = calloc(prof->pc_words, sizeof(avr_cycle_count_t));
+    prof->pc_count = calloc(prof->pc_words, sizeof(uint32_t));
+    if (elf_path != NULL && strlen(elf_path) != 0 && load_symbols(prof, elf_path) != 0)
+        return -1;
+    prof->calls = calloc(prof->symbol_count + 1, sizeof(uint32_t));
+    prof->cur_fold = -1;
+    return 0;
+}
+
+/*-----------------------------------------------------------------------*/
+
+// run one instruction and account its cycles
+int sim_profile_run(sim_profile_t * prof)
+{
+    avr_t * avr = prof->avr;
+    uint32_t pc = avr->pc;
+    uint16_t opcode = avr->flash[pc] | (avr->flash[pc + 1] << 8);
+    uint16_t sp = avr->data[R_SPL] | (avr->data[R_SPH] << 8);
+    avr_cycle_count_t cycle = avr->cycle;
+
+    int state = avr_run(avr);
+
+    avr_cycle_count_t cycles = avr->cycle - cycle;
+    prof->pc_cycles[pc >> 1] += cycles;
+    prof->pc_count[pc >> 1]++;
+
+    int leaf = sim_profile_find_symbol(prof, pc);
+    if (prof->cur_fold < 0 || leaf != prof->cur_leaf) {
+        prof->cur_leaf = leaf;
+        prof->cur_fold = find_fold(prof, leaf);
+    }
+    prof->folds[prof->cur_fold].cycles += cycles;
+
+    // two word instructions
+    int len = ((opcode & 0xFE0C) == 0x940C || (opcode & 0xFC0F) == 0x9000) ? 4 : 2;
+    int is_call = (opcode & 0xFE0E) == 0x940E || (opcode & 0xF000) == 0xD000
+        || opcode == 0x9509 || opcode == 0x9519;
+    int is_ret = opcode == 0x9508 || opcode == 0x9518;
+    uint16_t new_sp = avr->data[R_SPL] | (avr->data[R_SPH] << 8);
+    // an interrupt pushes the pc and jumps without a call instruction
+    int is_irq = !is_call && avr->pc != pc + len
+        && (sp - new_sp == 2 || sp - new_sp == 3);
+
+    if (is_ret) {
+        if (prof->depth > 0)
+            prof->depth--;
+        prof->cur_fold = -1;
+    } else if ((is_call && avr->pc != pc + len) || is_irq) {
+        if (prof->depth < SIM_PROFILE_MAX_DEPTH)
+            prof->stack[prof->depth++] = leaf;
+        prof->calls[sim_profile_find_symbol(prof, avr->pc) + 1]++;
+        prof->cur_fold = -1;
+    }
+    return state;
+}
+
+/*-----------------------------------------------------------------------*/
+
+static void
+write_flat(sim_profile_t * prof, FILE * f)
+{
+    avr_cycle_count_t total = 0;
+    int nsyms = prof->symbol_count + 1;
+    avr_cycle_count_t * sym_cycles = calloc(nsyms, sizeof(avr_cycle_count_t));
+    uint64_t * sym_count = calloc(nsyms, sizeof(uint64_t));
+    for (uint32_t w=0; w<prof->pc_words; w++) {
+        if (prof->pc_count[w] == 0)
+            continue;
+        int idx = sim_profile_find_symbol(prof, w << 1) + 1;
+        sym_cycles[idx] += prof->pc_cycles[w];
+        sym_count[idx] += prof->pc_count[w];
+        total += prof->pc_cycles[w];
+    }
+
+    fprintf(f, "# flat profile, %lu cycles\n", total);
+    fprintf(f, "#%15s %7s %12s %8s  %s\n", "cycles", "%", "instructions", "calls", "symbol");
+    // print symbols in order of cycles spent
+    while (1) {
+        int best = -1;
+        for (int i=0; i<nsyms; i++)
+            if (sym_count[i] != 0 && (best < 0 || sym_cycles[i] > sym_cycles[best]))
+                best = i;
+        if (best < 0)
+            break;
+        fprintf(f, "%16lu %6.2f%% %12lu %8u  %s\n", sym_cycles[best],
+                total ? 100.0 * sym_cycles[best] / total : 0.0,
+                sym_count[best], prof->calls[best], symbol_name(prof, best - 1));
+        sym_count[best] = 0;
+    }
+
+    fprintf(f, "\n# hottest instructions\n");
+    fprintf(f, "#%9s %15s %7s %12s  %s\n", "address", "cycles", "%", "executed", "symbol");
+    uint8_t * printed = calloc(prof->pc_words, 1);
+    for (int n=0; n<SIM_PROFILE_HOT_PCS; n++) {
+        int64_t best = -1;
+        for (uint32_t w=0; w<prof->pc_words; w++)
+            if (!printed[w] && prof->pc_count[w] != 0
+                && (best < 0 || prof->pc_cycles[w] > prof->pc_cycles[best]))
+                best = w;
+        if (best < 0)
+            break;
+        printed[best] = 1;
+        uint32_t addr = best << 1;
+        int idx = sim_profile_find_symbol(prof, addr);
+        fprintf(f, "  0x%06x %15lu %6.2f%% %12u  %s+0x%x\n", addr,
+                prof->pc_cycles[best],
+                total ? 100.0 * prof->pc_cycles[best] / total : 0.0,
+                prof->pc_count[best], symbol_name(prof, idx),
+                idx < 0 ? addr : addr - prof->symbols[idx].addr);
+    }
+    free(printed);
+    free(sym_cycles);
+    free(sym_count);
+}
+
+/*-----------------------------------------------------------------------*/
+
+// one line per call stack, for flamegraph.pl
+static void
+write_folded(sim_profile_t * prof, FILE * f)
+{
+    for (int i=0; i<prof->fold_count; i++) {
+        sim_fold_t * fold = &prof->folds[i];
+        if (fold->cycles == 0)
+            continue;
+        for (int j=0; j<fold->depth; j++)
+            fprintf(f, "%s%s", j ? ";" : "", symbol_name(prof, fold->frames[j]));
+        fprintf(f, " %lu\n", fold->cycles);
+    }
+}
+
+/*-----------------------------------------------------------------------*/
+
+// write <prefix>.flat.txt and <prefix>.folded
+void sim_profile_write(sim_profile_t * prof, const char * prefix)
+{
+    char path[1024];
+    snprintf(path, sizeof(path), "%s.flat.txt", prefix);
+    FILE * f = fopen(path, "w");
+    if (f == NULL) {
+        perror(path);
+        return;
+    }
+    write_flat(prof, f);
+    fclose(f);
+    printf("PROFILE: flat profile written to '%s'\n", path);
+
+    snprintf(path, sizeof(path), "%s.folded", prefix);
+    f = fopen(path, "w");
+    if (f == NULL) {
+        perror(path);
+        return;
+    }
+    write_folded(prof, f);
+    fclose(f);
+    printf("PROFILE: folded stacks written to '%s'\n", path);
+}
+
+/*-----------------------------------------------------------------------*/
+
+void sim_profile_cleanup(sim_profile_t * prof)
+{
+    for (int i=0; i<prof->symbol_count; i++)
+        free(prof->symbols[i].name);
+    free(prof->symbols);
+    for (int i=0; i<prof->object_count; i++)
+        free(prof->objects[i].name);
+    free(prof->objects);
+    free(prof->calls);
+    free(prof->folds);
+    free(prof->pc_cycles);
+    free(prof->pc_count);
+    memset(prof, 0, sizeof(sim_profile_t));
+}
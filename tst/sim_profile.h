@@ -0,0 +1,90 @@
+/*
+	sim_profile.h
+    Copyright 2021 Greg Green <ggreen@bit-builder.com>
+
+ 	This file is part of avr_bootloaders.
+    Counts the cycles spent at each program counter of the avr in simavr
+    and maps them to the symbols of the firmware elf file
+ */
+
+#ifndef SIM_PROFILE_H_
+#define SIM_PROFILE_H_
+
+#include <stdint.h>
+#include "sim_avr.h"
+
+/*-----------------------------------------------------------------------*/
+
+#define SIM_PROFILE_MAX_DEPTH 16
+#define SIM_PROFILE_HOT_PCS 20
+// data space symbols in an avr elf are offset by this
+#define SIM_PROFILE_DATA_OFFSET 0x800000
+
+/*-----------------------------------------------------------------------*/
+
+typedef struct sim_symbol
+{
+    uint32_t addr;      // byte address in flash
+    uint32_t size;
+    char * name;
+} sim_symbol_t;
+
+/*-----------------------------------------------------------------------*/
+
+// cycles spent with one particular call stack
+typedef struct sim_fold
+{
+    int depth;
+    int frames[SIM_PROFILE_MAX_DEPTH + 1];
+    avr_cycle_count_t cycles;
+} sim_fold_t;
+
+/*-----------------------------------------------------------------------*/
+
+typedef struct sim_profile
+{
+    struct avr_t * avr;
+    // cycles and executions per flash word
+    avr_cycle_count_t * pc_cycles;
+    uint32_t * pc_count;
+    uint32_t pc_words;
+    // function symbols sorted by address
+    sim_symbol_t * symbols;
+    int symbol_count;
+    // the globals, data space address without the offset, sorted
+    sim_symbol_t * objects;
+    int object_count;
+    // calls into each symbol
+    uint32_t * calls;
+    // shadow call stack of the symbols of the callers
+    int stack[SIM_PROFILE_MAX_DEPTH];
+    int depth;
+    // folded stacks
+    sim_fold_t * folds;
+    int fold_count;
+    int fold_alloc;
+    int cur_fold;
+    int cur_leaf;
+} sim_profile_t;
+
+/*-----------------------------------------------------------------------*/
+
+extern int sim_profile_init(sim_profile_t * prof, struct avr_t * avr,
+                            const char * elf_path);
+
+extern int sim_profile_run(sim_profile_t * prof);
+
+extern int sim_profile_elf_symbol(const char * elf_path, const char * name,
+                                  uint32_t * value);
+
+extern int sim_profile_find_symbol(sim_profile_t * prof, uint32_t addr);
+
+extern int sim_profile_find_object(sim_profile_t * prof, uint32_t addr);
+
+extern void sim_profile_write(sim_profile_t * prof, const char * prefix);
+
+extern void sim_profile_cleanup(sim_profile_t * prof);
+
+/*-----------------------------------------------------------------------*/
+
+#endif // SIM_PROFILE_H_
@@ -0,0 +1,201 @@
+/*
+	sim_snapshot.c
+
+    Copyright 2021 Greg Green <ggreen@bit-builder.com>
+
+ 	This file is part of avr_bootloaders.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+
+#include "sim_avr.h"
+#include "sim_core.h"
+#include "sim_interrupts.h"
+#include "avr_eeprom.h"
+#include "sim_harness.h"
+#include "sim_snapshot.h"
+
+/*-----------------------------------------------------------------------*/
+
+// read and write i/o registers the way the cpu does, through the
+// peripheral's handlers so simavr's own state follows
+static uint8_t
+sim_snapshot_io_read(avr_t * avr, avr_io_addr_t addr)
+{
+    uint8_t io = AVR_DATA_TO_IO(addr);
+    if (avr->io[io].r.c)
+        avr->data[addr] = avr->io[io].r.c(avr, addr, avr->io[io].r.param);
+    return avr->data[addr];
+}
+
+static void
+sim_snapshot_io_write(avr_t * avr, avr_io_addr_t addr, uint8_t v)
+{
+    uint8_t io = AVR_DATA_TO_IO(addr);
+    if (avr->io[io].w.c)
+        avr->io[io].w.c(avr, addr, v, avr->io[io].w.param);
+    else
+        avr_core_watch_write(avr, addr, v);
+}
+
+/*-----------------------------------------------------------------------*/
+
+// boot the bootloader on a scratch avr until it signals it is ready for
+// the first transaction, and keep a copy of that avr
+int sim_snapshot_boot(sim_snapshot_t * snap, const sim_config_t * config)
+{
+    sim_harness_t sim;
+    sim_config_t boot = *config;
+
+    memset(snap, 0, sizeof(sim_snapshot_t));
+    boot.spi_input = "";
+    boot.flash_path = "";
+    boot.flash_base = "";
+    boot.vcd_path = "";
+    boot.output_path = "";
+    boot.socket_path = "";
+    boot.verbose = 0;
+    boot.snapshot = NULL;
+    if (sim_harness_init(&sim, &boot) != 0)
+        return -1;
+    while (sim.spi.ready_cycle == 0) {
+        int state = sim_harness_step(&sim);
+        if (state == cpu_Done || state == cpu_Crashed ||
+            sim.avr->cycle > SIM_SNAPSHOT_MAX_CYCLES) {
+            fprintf(stderr, "SNAPSHOT: bootloader never got ready, stopped at cycle %lu\n",
+                    sim.avr->cycle);
+            sim_harness_cleanup(&sim);
+            return -1;
+        }
+    }
+    int res = sim_snapshot_take(snap, &sim);
+    // match against what was asked for, the harness may switch the mcu
+    strncpy(snap->mmcu, config->mmcu, sizeof(snap->mmcu) - 1);
+    snap->freq = config->freq;
+    sim_harness_cleanup(&sim);
+    return res;
+}
+
+/*-----------------------------------------------------------------------*/
+
+// copy the state of the avr, between two instructions
+int sim_snapshot_take(sim_snapshot_t * snap, sim_harness_t * sim)
+{
+    avr_t * avr = sim->avr;
+
+    // pending interrupts live in simavr's own tables, not in data space
+    if (avr_has_pending_interrupt(avr)) {
+        fprintf(stderr, "SNAPSHOT: interrupt pending, can't take a snapshot\n");
+        return -1;
+    }
+    sim_snapshot_free(snap);
+    strncpy(snap->boot_path, sim->config.boot_path, sizeof(snap->boot_path) - 1);
+    strncpy(snap->mmcu, sim->config.mmcu, sizeof(snap->mmcu) - 1);
+    snap->freq = avr->frequency;
+    snap->cycle = avr->cycle;
+    snap->pc = avr->pc;
+    memcpy(snap->sreg, avr->sreg, sizeof(snap->sreg));
+    snap->interrupt_state = avr->interrupt_state;
+    snap->state = avr->state;
+
+    // TCNT1 in data space is only brought up to date by a read
+    sim_snapshot_io_read(avr, SIM_TCNT1L);
+    snap->data_size = avr->ramend + 1;
+    snap->data = malloc(snap->data_size);
+    memcpy(snap->data, avr->data, snap->data_size);
+    snap->flash_size = avr->flashend + 1;
+    snap->flash = malloc(snap->flash_size);
+    memcpy(snap->flash, avr->flash, snap->flash_size);
+    if (avr->e2end) {
+        snap->eeprom_size = avr->e2end + 1;
+        snap->eeprom = malloc(snap->eeprom_size);
+        avr_eeprom_desc_t ee = { .ee = snap->eeprom, .offset = 0, .size = snap->eeprom_size };
+        if (avr_ioctl(avr, AVR_IOCTL_EEPROM_GET, &ee) != 0) {
+            free(snap->eeprom);
+            snap->eeprom = NULL;
+            snap->eeprom_size = 0;
+        }
+    }
+
+    snap->button = sim->spi.button;
+    snap->ready_cycle = sim->spi.ready_cycle;
+    return 0;
+}
+
+/*-----------------------------------------------------------------------*/
+
+// put a snapshot into a freshly initialized harness, before any
+// transactions are scheduled
+int sim_snapshot_restore(sim_harness_t * sim, const sim_snapshot_t * snap)
+{
+    avr_t * avr = sim->avr;
+
+    if (snap->data == NULL || snap->data_size != avr->ramend + 1u ||
+        snap->flash_size != avr->flashend + 1u)
+        return -1;
+    // the bootloader loaded into this harness has to be the one booted
+    if (memcmp(avr->flash + sim->boot_base, snap->flash + sim->boot_base,
+               sim->boot_size) != 0)
+        return -1;
+
+    // the boot itself doesn't write the flash, keep the one mapped from
+    // the flash file if there is one
+    if (sim->flash.map == NULL)
+        memcpy(avr->flash, snap->flash, snap->flash_size);
+    memcpy(avr->data, snap->data, snap->data_size);
+    if (snap->eeprom != NULL) {
+        avr_eeprom_desc_t ee = { .ee = snap->eeprom, .offset = 0, .size = snap->eeprom_size };
+        avr_ioctl(avr, AVR_IOCTL_EEPROM_SET, &ee);
+    }
+    // drop anything scheduled for the old timeline before moving the clock
+    avr_cycle_timer_reset(avr);
+    avr->cycle = snap->cycle;
+
+    // Timer1 runs the transaction timeout. Its clock select and compare
+    // timers only get set up by register writes, so write them again from
+    // the reset values, the count last as the timer starts from it. The
+    // 16 bit registers take the high byte from data space
+    static const avr_io_addr_t timer1[] = {
+        SIM_TCCR1A, SIM_TCCR1B, SIM_OCR1AL, SIM_TCNT1L, SIM_TIMSK1,
+    };
+    for (int i=0; i<(int)(sizeof(timer1) / sizeof(timer1[0])); i++)
+        avr->data[timer1[i]] = 0;
+    for (int i=0; i<(int)(sizeof(timer1) / sizeof(timer1[0])); i++)
+        sim_snapshot_io_write(avr, timer1[i], snap->data[timer1[i]]);
+
+    avr->pc = snap->pc;
+    memcpy(avr->sreg, snap->sreg, sizeof(avr->sreg));
+    avr->interrupt_state = snap->interrupt_state;
+    avr->state = snap->state;
+
+    // the port irqs catch up with the data space on the next port write
+    sim->spi.button = snap->button;
+    sim->spi.ready_cycle = snap->ready_cycle;
+    return 0;
+}
+
+/*-----------------------------------------------------------------------*/
+
+// can a simulation with this configuration start from the snapshot,
+// the spi timing doesn't matter as the bus is idle during boot
+int sim_snapshot_matches(const sim_snapshot_t * snap, const sim_config_t * config)
+{
+    return snap->data != NULL &&
+        !strcmp(snap->boot_path, config->boot_path) &&
+        !strcmp(snap->mmcu, config->mmcu) &&
+        snap->freq == config->freq;
+}
+
+/*-----------------------------------------------------------------------*/
+
+void sim_snapshot_free(sim_snapshot_t * snap)
+{
+    free(snap->data);
+    free(snap->flash);
+    free(snap->eeprom);
+    snap->data = NULL;
+    snap->flash = NULL;
+    snap->eeprom = NULL;
+}
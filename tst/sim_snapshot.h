@@ -0,0 +1,67 @@
+/*
+	sim_snapshot.h
+    Copyright 2021 Greg Green <ggreen@bit-builder.com>
+
+ 	This file is part of avr_bootloaders.
+    Saves the simulated avr once the bootloader is up and waiting for the
+    first spi transaction, so later simulations can skip the boot
+ */
+
+#ifndef SIM_SNAPSHOT_H_
+#define SIM_SNAPSHOT_H_
+
+#include <stdint.h>
+#include "sim_avr.h"
+
+struct sim_harness;
+struct sim_config;
+
+/*-----------------------------------------------------------------------*/
+
+// give up on the boot after this many cycles
+#define SIM_SNAPSHOT_MAX_CYCLES 50000000UL
+// cycles from the restore to the first transaction
+#define SIM_SNAPSHOT_TXN_DELAY 100
+
+/*-----------------------------------------------------------------------*/
+
+typedef struct sim_snapshot
+{
+    // what the snapshot was booted from
+    char boot_path[1024];
+    char mmcu[32];
+    uint32_t freq;
+    // cpu
+    avr_cycle_count_t cycle;
+    avr_flashaddr_t pc;
+    uint8_t sreg[8];
+    int8_t interrupt_state;
+    int state;
+    // registers, i/o and sram
+    uint8_t * data;
+    uint32_t data_size;
+    uint8_t * flash;
+    uint32_t flash_size;
+    uint8_t * eeprom;
+    uint32_t eeprom_size;
+    // spi controller
+    uint8_t button;
+    avr_cycle_count_t ready_cycle;
+} sim_snapshot_t;
+
+/*-----------------------------------------------------------------------*/
+
+extern int sim_snapshot_boot(sim_snapshot_t * snap, const struct sim_config * config);
+
+extern int sim_snapshot_take(sim_snapshot_t * snap, struct sim_harness * sim);
+
+extern int sim_snapshot_restore(struct sim_harness * sim, const sim_snapshot_t * snap);
+
+extern int sim_snapshot_matches(const sim_snapshot_t * snap,
+                                const struct sim_config * config);
+
+extern void sim_snapshot_free(sim_snapshot_t * snap);
+
+/*-----------------------------------------------------------------------*/
+
+#endif // SIM_SNAPSHOT_H_
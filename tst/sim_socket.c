@@ -0,0 +1,154 @@
+/*
+	sim_socket.c
+
+    Copyright 2021 Greg Green <ggreen@bit-builder.com>
+
+ 	This file is part of avr_bootloaders.
+ */
+
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+
+#include "sim_avr.h"
+#include "spi_virt.h"
+#include "sim_socket.h"
+
+/*-----------------------------------------------------------------------*/
+
+static int
+sim_socket_write(int fd, const uint8_t * buf, int len)
+{
+    while (len > 0) {
+        // no SIGPIPE if the uploader went away
+        ssize_t n = send(fd, buf, len, MSG_NOSIGNAL);
+        if (n <= 0)
+            return -1;
+        buf += n;
+        len -= n;
+    }
+    return 0;
+}
+
+/*-----------------------------------------------------------------------*/
+
+static int
+sim_socket_read(int fd, uint8_t * buf, int len)
+{
+    while (len > 0) {
+        ssize_t n = read(fd, buf, len);
+        if (n <= 0)
+            return -1;
+        buf += n;
+        len -= n;
+    }
+    return 0;
+}
+
+/*-----------------------------------------------------------------------*/
+
+static void
+sim_socket_hangup(sim_socket_t * sock)
+{
+    if (sock->fd < 0)
+        return;
+    printf("SOCKET: uploader left after %lu transactions\n", sock->txns);
+    close(sock->fd);
+    sock->fd = -1;
+}
+
+/*-----------------------------------------------------------------------*/
+
+// the bootloader is ready, tell the uploader and wait for its next
+// transaction, the simulation stands still meanwhile
+static void
+sim_socket_feed(spi_virt_t * part, void * param)
+{
+    sim_socket_t * sock = (sim_socket_t *)param;
+    uint8_t ready = SIM_SOCKET_READY;
+    uint8_t bytes[4];
+
+    if (sock->fd < 0 && sock->txns == 0) {
+        printf("SOCKET: waiting for the uploader on %s\n", sock->path);
+        sock->fd = accept(sock->listen_fd, NULL, NULL);
+        if (sock->fd < 0) {
+            perror(sock->path);
+            return;
+        }
+    }
+    if (sock->fd < 0)
+        return;
+    if (sim_socket_write(sock->fd, &ready, 1) != 0 ||
+        sim_socket_read(sock->fd, bytes, sizeof(bytes)) != 0) {
+        // nothing queued ends the script and releases MCU_RUNNING
+        sim_socket_hangup(sock);
+        return;
+    }
+    if (sock->verbose)
+        printf("SOCKET: %02x %02x %02x %02x at cycle %lu\n",
+               bytes[0], bytes[1], bytes[2], bytes[3], part->avr->cycle);
+    spi_txn_input_append(part, bytes, 1);
+}
+
+/*-----------------------------------------------------------------------*/
+
+// send back what the bootloader clocked out
+static void
+sim_socket_reply(spi_virt_t * part, spi_txn_t * txn, void * param)
+{
+    sim_socket_t * sock = (sim_socket_t *)param;
+
+    if (sock->fd < 0)
+        return;
+    sock->txns++;
+    if (sim_socket_write(sock->fd, txn->buf, txn->length) != 0)
+        sim_socket_hangup(sock);
+}
+
+/*-----------------------------------------------------------------------*/
+
+// listen on a unix socket and drive the spi bus from the first
+// uploader that connects
+int sim_socket_open(sim_socket_t * sock, spi_virt_t * part, const char * path)
+{
+    struct sockaddr_un addr;
+
+    memset(sock, 0, sizeof(sim_socket_t));
+    sock->fd = -1;
+    sock->verbose = part->verbose;
+    strncpy(sock->path, path, sizeof(sock->path) - 1);
+
+    sock->listen_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (sock->listen_fd < 0) {
+        perror("socket");
+        return -1;
+    }
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, sock->path, sizeof(addr.sun_path) - 1);
+    unlink(sock->path);
+    if (bind(sock->listen_fd, (struct sockaddr *)&addr, sizeof(addr)) != 0 ||
+        listen(sock->listen_fd, 1) != 0) {
+        perror(sock->path);
+        close(sock->listen_fd);
+        sock->listen_fd = -1;
+        return -1;
+    }
+    spi_virt_set_live(part, sim_socket_feed, sim_socket_reply, sock);
+    return 0;
+}
+
+/*-----------------------------------------------------------------------*/
+
+void sim_socket_close(sim_socket_t * sock)
+{
+    sim_socket_hangup(sock);
+    if (sock->listen_fd >= 0) {
+        close(sock->listen_fd);
+        unlink(sock->path);
+    }
+    sock->listen_fd = -1;
+}
@@ -0,0 +1,42 @@
+/*
+	sim_socket.h
+    Copyright 2021 Greg Green <ggreen@bit-builder.com>
+
+ 	This file is part of avr_bootloaders.
+    Serves the spi bus of the simulated avr on a unix socket, so a host
+    uploader can talk to the bootloader without hardware
+ */
+
+#ifndef SIM_SOCKET_H_
+#define SIM_SOCKET_H_
+
+#include <stdint.h>
+#include "spi_virt.h"
+
+/*-----------------------------------------------------------------------*/
+
+// sent to the uploader when the bootloader pulls BUTTON low, the
+// uploader then sends 4 bytes and gets the 4 clocked back
+#define SIM_SOCKET_READY 'R'
+
+/*-----------------------------------------------------------------------*/
+
+typedef struct sim_socket
+{
+    char path[108];
+    int listen_fd;
+    int fd;
+    int verbose;
+    // transactions clocked for the uploader
+    unsigned long txns;
+} sim_socket_t;
+
+/*-----------------------------------------------------------------------*/
+
+extern int sim_socket_open(sim_socket_t * sock, spi_virt_t * part, const char * path);
+
+extern void sim_socket_close(sim_socket_t * sock);
+
+/*-----------------------------------------------------------------------*/
+
+#endif // SIM_SOCKET_H_
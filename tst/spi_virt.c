@@ -3,12 +3,18 @@
 #include <stdio.h>
 
 #include "sim_avr.h"
+#include "sim_io.h"
 #include "avr_spi.h"
 #include "avr_ioport.h"
 #include "spi_virt.h"
 
 /*-----------------------------------------------------------------------*/
 
+// only chatter on stdout when the part is verbose
+#define SPIVIRT_LOG(part, ...) do { if ((part)->verbose) printf(__VA_ARGS__); } while (0)
+
+/*-----------------------------------------------------------------------*/
+
 static const char * _spi_virt_irq_names[SPI_VIRT_COUNT] = {
 	[SPI_VIRT_CS] = "<spivirt.cs",
 	[SPI_VIRT_SDI] = "<spivirt.sdi",
@@ -19,6 +25,7 @@ static const char * _spi_virt_irq_names[SPI_VIRT_COUNT] = {
     [SPI_VIRT_BYTE_TXN_END] = "=spivirt.u8txnend",
     [SPI_VIRT_TXN_END] = "=spivirt.txnend",
     [SPI_VIRT_NEW_TXN_SIGNAL] = ">spivirt.newtxn",
+    [SPI_VIRT_SCK] = ">spivirt.sck",
 };
 
 /*-----------------------------------------------------------------------*/
@@ -28,7 +35,7 @@ static void
 spi_virt_mcu_running_hook(struct avr_irq_t * irq, uint32_t value, void * param)
 {
     spi_virt_t * part = (spi_virt_t*)param;
-    printf("SPIVIRT: MCU_RUNNING=0x%02x\n", value & 0xFF);
+    SPIVIRT_LOG(part, "SPIVIRT: MCU_RUNNING=0x%02x\n", value & 0xFF);
 }
 
 /*-----------------------------------------------------------------------*/
@@ -39,12 +46,13 @@ spi_virt_button_hook(struct avr_irq_t * irq, uint32_t value, void * param)
 {
     spi_virt_t * part = (spi_virt_t*)param;
     part->button = value & 0xFF;
-    printf("SPIVIRT: BUTTON=0x%02x\n", part->button);
+    SPIVIRT_LOG(part, "SPIVIRT: BUTTON=0x%02x\n", part->button);
     // make sure we are well into startup phase before we trigger
     // a new spi transaction, as we get a low signal on button
     // right after bootup
     if (part->button == 0 && part->avr->cycle > 2000) {
-        printf("SPIVIRT: BUTTON DOWN, new spi txn can start\n");
+        SPIVIRT_LOG(part, "SPIVIRT: BUTTON DOWN, new spi txn can start\n");
+        part->ready_cycle = part->avr->cycle;
         avr_raise_irq(part->irq + SPI_VIRT_NEW_TXN_SIGNAL, (uint32_t)part);
     }
 }
@@ -57,7 +65,7 @@ spi_virt_sdo_hook(struct avr_irq_t * irq, uint32_t value, void * param)
 {
     spi_virt_t * part = (spi_virt_t*)param;
     part->sdo_val = value & 0xFF;
-    printf("SPIVIRT: SDO=0x%02x\n", part->sdo_val);
+    SPIVIRT_LOG(part, "SPIVIRT: SDO=0x%02x\n", part->sdo_val);
 }
 
 /*-----------------------------------------------------------------------*/
@@ -66,19 +74,178 @@ spi_virt_sdo_hook(struct avr_irq_t * irq, uint32_t value, void * param)
 static void
 spi_virt_sdi_hook(struct avr_irq_t * irq, uint32_t value, void * param)
 {
-    printf("SPIVIRT: SDI=0x%02x\n", (uint8_t)(value & 0xFF));
+    spi_virt_t * part = (spi_virt_t*)param;
+    SPIVIRT_LOG(part, "SPIVIRT: SDI=0x%02x\n", (uint8_t)(value & 0xFF));
+}
+
+/*-----------------------------------------------------------------------*/
+
+// drive CS, only when it changes
+static void
+spi_virt_set_cs(spi_virt_t * part, uint8_t cs)
+{
+    if (part->cs == cs)
+        return;
+    part->cs = cs;
+    avr_raise_irq(part->irq + SPI_VIRT_CS, cs);
+}
+
+/*-----------------------------------------------------------------------*/
+
+// pick the next byte to send and wait for the first SCK edge
+static void
+spi_virt_byte_start(spi_virt_t * part)
+{
+    SPIVIRT_LOG(part, "SPIVIRT: TXN START CS DN\nSPIVIRT: BYTE [%d] START\n", part->txn_idx);
+    part->state = ByteTxn;
+    part->sdi_val = part->cur_txn->buf[part->txn_idx];
+    if (part->txn_number == part->fault_txn && part->txn_idx == part->fault_byte) {
+        SPIVIRT_LOG(part, "SPIVIRT: FAULT, flipping 0x%02x of byte [%d]\n",
+                    part->fault_xor, part->txn_idx);
+        part->sdi_val ^= part->fault_xor;
+    }
+    part->sdo_val = 0;
+    spi_virt_set_cs(part, 0);
+}
+
+/*-----------------------------------------------------------------------*/
+
+// first SCK edge, the shift register is loaded from SPDR
+static void
+spi_virt_first_edge(spi_virt_t * part)
+{
+    if (part->spdr && !part->armed) {
+        part->stale++;
+        SPIVIRT_LOG(part, "SPIVIRT: BYTE [%d] STALE, SPDR not loaded\n",
+                    part->txn_idx);
+    }
+    part->state = Shifting;
+    avr_raise_irq(part->irq + SPI_VIRT_SCK, 1);
+}
+
+/*-----------------------------------------------------------------------*/
+
+// last SCK edge, hand the byte to the avr and get its reply
+static void
+spi_virt_last_edge(spi_virt_t * part)
+{
+    // SPIF still set means the last byte was never read
+    if (part->spsr && (part->avr->data[part->spsr] & 0x80)) {
+        part->overruns++;
+        SPIVIRT_LOG(part, "SPIVIRT: BYTE [%d] OVERRUN, SPDR not read\n",
+                    part->txn_idx);
+    }
+    part->state = Idle;
+    part->armed = 0;
+    avr_raise_irq(part->irq + SPI_VIRT_SCK, 0);
+    avr_raise_irq(part->irq + SPI_VIRT_SDI, part->sdi_val);
+    part->byte_cycle = part->avr->cycle;
+    part->reload_pending = part->txn_idx + 1 < part->cur_txn->length;
+}
+
+/*-----------------------------------------------------------------------*/
+
+// store the reply, returns non zero if the transaction has more bytes
+static int
+spi_virt_byte_end(spi_virt_t * part)
+{
+    SPIVIRT_LOG(part, "SPIVIRT: BYTE [%d] END\n", part->txn_idx);
+    part->cur_txn->buf[part->txn_idx++] = part->sdo_val;
+    SPIVIRT_LOG(part, "AVR CYCLE: %lu\n", part->avr->cycle);
+    return part->txn_idx != part->cur_txn->length;
 }
 
 /*-----------------------------------------------------------------------*/
 
-// timer callback at end of SPI byte transmission
+static void
+spi_virt_txn_end(spi_virt_t * part)
+{
+    SPIVIRT_LOG(part, "SPIVIRT: --> TXN END <--\n");
+    if (part->current_txn != NULL)
+        part->current_txn->end_cycle = part->avr->cycle;
+    if (part->reply != NULL)
+        part->reply(part, part->cur_txn, part->live_param);
+    if (part->cur_txn->raise_cs) {
+        SPIVIRT_LOG(part, "SPIVIRT: CS UP\n");
+        spi_virt_set_cs(part, 1);
+    }
+    part->cur_txn = NULL;
+}
+
+/*-----------------------------------------------------------------------*/
+
+// timer callback at first SCK edge and at end of SPI byte transmission
 static avr_cycle_count_t
 spi_virt_cycle_proc(struct avr_t * avr, avr_cycle_count_t when, void * param)
 {
     spi_virt_t * part = (spi_virt_t*)param;
-    part->state = Idle;
-    avr_raise_irq(part->irq + SPI_VIRT_SDI, part->sdi_val);
+    if (part->state == ByteTxn) {
+        spi_virt_first_edge(part);
+        return when + part->sck_cycles * 8 + part->cs_delay;
+    }
+    spi_virt_last_edge(part);
     avr_raise_irq(part->irq + SPI_VIRT_BYTE_TXN_END, (uint32_t)part);
+    return 0;
+}
+
+/*-----------------------------------------------------------------------*/
+
+// fast transport, one timer walks the whole transaction and only stops
+// at the SCK edges where the avr sees something, with the same timing
+// as the irq chain of spi_virt_cycle_proc and the hooks below
+static avr_cycle_count_t
+spi_virt_fast_proc(struct avr_t * avr, avr_cycle_count_t when, void * param)
+{
+    spi_virt_t * part = (spi_virt_t*)param;
+    if (part->state == ByteTxn) {
+        spi_virt_first_edge(part);
+        return when + part->sck_cycles * 8 + part->cs_delay;
+    }
+    spi_virt_last_edge(part);
+    if (spi_virt_byte_end(part)) {
+        spi_virt_byte_start(part);
+        return when + part->byte_gap + part->cs_delay;
+    }
+    spi_virt_txn_end(part);
+    return 0;
+}
+
+/*-----------------------------------------------------------------------*/
+
+// timer callback at end of the gap between bytes
+static avr_cycle_count_t
+spi_virt_gap_proc(struct avr_t * avr, avr_cycle_count_t when, void * param)
+{
+    spi_virt_t * part = (spi_virt_t*)param;
+    avr_raise_irq(part->irq + SPI_VIRT_BYTE_TXN_START, (uint32_t)part);
+    return 0;
+}
+
+/*-----------------------------------------------------------------------*/
+
+// watch the firmware writing SPDR
+static void
+spi_virt_spdr_write_hook(struct avr_t * avr, avr_io_addr_t addr, uint8_t v,
+                         void * param)
+{
+    spi_virt_t * part = (spi_virt_t*)param;
+    if (part->state == Shifting) {
+        part->collisions++;
+        SPIVIRT_LOG(part, "SPIVIRT: BYTE [%d] WCOL, SPDR=0x%02x\n",
+                    part->txn_idx, v);
+        return;
+    }
+    part->armed = 1;
+    if (part->reload_pending) {
+        avr_cycle_count_t cycles = avr->cycle - part->byte_cycle;
+        part->reload_pending = 0;
+        part->reloads++;
+        part->reload_total += cycles;
+        if (part->reload_min == 0 || cycles < part->reload_min)
+            part->reload_min = cycles;
+        if (cycles > part->reload_max)
+            part->reload_max = cycles;
+    }
 }
 
 /*-----------------------------------------------------------------------*/
@@ -90,13 +257,8 @@ spi_virt_byte_txn_start_hook(struct avr_irq_t * irq,
                              void * param)
 {
     spi_virt_t * part = (spi_virt_t*)param;
-    printf("SPIVIRT: TXN START CS DN\nSPIVIRT: BYTE [%d] START\n", part->txn_idx);
-    part->state = ByteTxn;
-    part->sdi_val = part->cur_txn->buf[part->txn_idx];
-    part->sdo_val = 0;
-    avr_raise_irq(part->irq + SPI_VIRT_CS, 0);
-    avr_cycle_timer_register(part->avr,
-                             CS_DELAY_CYCLES * 2 + SCK_DELAY_CYCLES*16,
+    spi_virt_byte_start(part);
+    avr_cycle_timer_register(part->avr, part->cs_delay,
                              spi_virt_cycle_proc, part);
 }
 
@@ -109,14 +271,14 @@ spi_virt_byte_txn_end_hook(struct avr_irq_t * irq,
                            void * param)
 {
     spi_virt_t * part = (spi_virt_t*)param;
-    printf("SPIVIRT: BYTE [%d] END\n", part->txn_idx);
-    part->cur_txn->buf[part->txn_idx++] = part->sdo_val;
-    if (part->txn_idx == part->cur_txn->length) {
+    if (!spi_virt_byte_end(part)) {
         avr_raise_irq(part->irq + SPI_VIRT_TXN_END, (uint32_t)part);
+    } else if (part->byte_gap > 0) {
+        avr_cycle_timer_register(part->avr, part->byte_gap,
+                                 spi_virt_gap_proc, part);
     } else {
         avr_raise_irq(part->irq + SPI_VIRT_BYTE_TXN_START, (uint32_t)part);
     }
-    printf("AVR CYCLE: %lu\n", part->avr->cycle);
 }
 
 /*-----------------------------------------------------------------------*/
@@ -127,13 +289,37 @@ spi_virt_txn_end_hook(struct avr_irq_t * irq,
                       uint32_t value,
                       void * param)
 {
-    printf("SPIVIRT: --> TXN END <--\n");
     spi_virt_t * part = (spi_virt_t*)param;
-    if (part->cur_txn->raise_cs) {
-        printf("SPIVIRT: CS UP\n");
-        avr_raise_irq(part->irq + SPI_VIRT_CS, 1);
-    }
-    part->cur_txn = NULL;
+    spi_virt_txn_end(part);
+}
+
+/*-----------------------------------------------------------------------*/
+
+// compare the reply of a finished transaction with the one the script
+// expects, returns non zero if it differs
+static int
+spi_virt_check_reply(spi_virt_t * part, spi_test_txn_t * txn)
+{
+    uint8_t * got = txn->transaction.buf;
+    int i;
+
+    if (!txn->check)
+        return 0;
+    part->checked++;
+    for (i=0; i<4; i++)
+        if ((got[i] ^ txn->expect[i]) & txn->mask[i])
+            break;
+    if (i == 4)
+        return 0;
+    part->mismatches++;
+    fprintf(stderr, "SPIVIRT: txn %d (line %d) replied %02x %02x %02x %02x, "
+            "expected %02x %02x %02x %02x mask %02x %02x %02x %02x\n",
+            part->txn_number, txn->line, got[0], got[1], got[2], got[3],
+            txn->expect[0], txn->expect[1], txn->expect[2], txn->expect[3],
+            txn->mask[0], txn->mask[1], txn->mask[2], txn->mask[3]);
+    fprintf(stderr, "SPIVIRT: clocked from cycle %lu to %lu, ready again at %lu\n",
+            txn->start_cycle, txn->end_cycle, txn->cycle);
+    return 1;
 }
 
 /*-----------------------------------------------------------------------*/
@@ -142,20 +328,38 @@ static void
 spi_virt_txn_advance_hook(struct avr_irq_t * irq, uint32_t value, void * param)
 {
     spi_virt_t * part = (spi_virt_t*)param;
-    part->current_txn->cycle = part->avr->cycle;
-    if (part->output_file != NULL) {
-        fprintf(part->output_file, "%lu ", part->avr->cycle);
-        for (int i=0; i<part->current_txn->transaction.length; i++)
-            fprintf(part->output_file, "%02x ", part->current_txn->transaction.buf[i]);
-        fprintf(part->output_file, "\n");
-        fflush(part->output_file);
+    spi_test_txn_t * last = part->current_txn;
+    // nothing scheduled, the bootloader is just signalling it's ready
+    if (last == NULL && (part->feed == NULL || part->done))
+        return;
+    if (last != NULL) {
+        last->cycle = part->avr->cycle;
+        // the file is fully buffered, it's written out when closed
+        if (part->output_file != NULL) {
+            fprintf(part->output_file, "%lu ", part->avr->cycle);
+            for (int i=0; i<last->transaction.length; i++)
+                fprintf(part->output_file, "%02x ", last->transaction.buf[i]);
+            fprintf(part->output_file, "\n");
+        }
+        // stop at the first wrong reply, the avr is left as it was
+        if (spi_virt_check_reply(part, last)) {
+            part->current_txn = NULL;
+            part->done = 1;
+            return;
+        }
     }
-    part->current_txn = part->current_txn->next;
+    // a live controller queues the next transaction as it goes
+    if (part->feed != NULL && (last == NULL || last->next == NULL))
+        part->feed(part, part->live_param);
+    part->current_txn = last != NULL ? last->next : part->input.first;
     if (part->current_txn != NULL) {
+        part->current_txn->start_cycle = part->avr->cycle;
+        part->phase = part->current_txn->phase;
         spi_virt_start_txn(part, &part->current_txn->transaction);
     } else {
         // set MCU_RUNNING low for reboot into app code
-        printf("SPIVIRT: releasing MCU_RUNNING for app start\n");
+        SPIVIRT_LOG(part, "SPIVIRT: releasing MCU_RUNNING for app start\n");
+        part->done = 1;
         avr_raise_irq(part->irq + SPI_VIRT_MCU_RUNNING, 0);
     }
 }
@@ -169,6 +373,13 @@ void spi_virt_init(struct avr_t * avr, spi_virt_t * part,
     memset(part, 0, sizeof(spi_virt_t));
     part->avr = avr;
     part->state = Idle;
+    part->verbose = 1;
+    part->cs_delay = CS_DELAY_CYCLES;
+    part->sck_cycles = SCK_DELAY_CYCLES * 2;
+    part->byte_gap = BYTE_GAP_CYCLES;
+    part->spsr = wiring->spsr;
+    part->spdr = wiring->spdr;
+    part->fault_txn = -1;
     
     part->irq = avr_alloc_irq(&avr->irq_pool, 0, SPI_VIRT_COUNT, _spi_virt_irq_names);
     avr_irq_register_notify(part->irq + SPI_VIRT_SDO, spi_virt_sdo_hook, part);
@@ -203,8 +414,12 @@ void spi_virt_init(struct avr_t * avr, spi_virt_t * part,
         avr_io_getirq(avr, AVR_IOCTL_IOPORT_GETIRQ(wiring->mcu_running.port),
                       wiring->mcu_running.pin));
 
+    if (part->spdr)
+        avr_register_io_write(avr, part->spdr, spi_virt_spdr_write_hook, part);
+
     // make sure the CS pin is high
-    avr_raise_irq(part->irq + SPI_VIRT_CS, 1);
+    part->cs = 0xff;
+    spi_virt_set_cs(part, 1);
     // button should be high
     avr_raise_irq(
         avr_io_getirq(avr, AVR_IOCTL_IOPORT_GETIRQ(wiring->button.port),
@@ -215,6 +430,39 @@ void spi_virt_init(struct avr_t * avr, spi_virt_t * part,
 
 /*-----------------------------------------------------------------------*/
 
+// set the SCK period and the gap between bytes, in cycles
+void spi_virt_set_timing(spi_virt_t * part, int sck_cycles, int byte_gap)
+{
+    part->sck_cycles = sck_cycles;
+    part->byte_gap = byte_gap;
+}
+
+/*-----------------------------------------------------------------------*/
+
+// number of lost, stale and collided bytes and wrong replies so far
+int spi_virt_error_count(spi_virt_t * part)
+{
+    return part->overruns + part->stale + part->collisions + part->mismatches;
+}
+
+/*-----------------------------------------------------------------------*/
+
+void spi_virt_report(spi_virt_t * part)
+{
+    printf("SPIVIRT: SCK %d cycles, byte gap %d cycles\n",
+           part->sck_cycles, part->byte_gap);
+    printf("SPIVIRT: overruns %d, stale SPDR %d, WCOL %d\n",
+           part->overruns, part->stale, part->collisions);
+    printf("SPIVIRT: %d replies checked, %d mismatches\n",
+           part->checked, part->mismatches);
+    if (part->reloads)
+        printf("SPIVIRT: SPDR reloaded %lu/%.1f/%lu cycles min/avg/max after a byte\n",
+               part->reload_min, (double)part->reload_total / part->reloads,
+               part->reload_max);
+}
+
+/*-----------------------------------------------------------------------*/
+
 // method to call when a SPI transaction is to start
 void spi_virt_start_txn(spi_virt_t * part, spi_txn_t * txn)
 {
@@ -222,23 +470,36 @@ void spi_virt_start_txn(spi_virt_t * part, spi_txn_t * txn)
         return;
     part->cur_txn = txn;
     part->txn_idx = 0;
+    part->txn_number++;
+    if (part->fast) {
+        spi_virt_byte_start(part);
+        avr_cycle_timer_register(part->avr, part->cs_delay,
+                                 spi_virt_fast_proc, part);
+        return;
+    }
     avr_raise_irq(part->irq + SPI_VIRT_BYTE_TXN_START, (uint32_t)part);
 }
 
+// attach a live controller, see spi_virt_feed_t
+void spi_virt_set_live(spi_virt_t * part, spi_virt_feed_t feed,
+                       spi_virt_reply_t reply, void * param)
+{
+    part->feed = feed;
+    part->reply = reply;
+    part->live_param = param;
+}
+
 /*-----------------------------------------------------------------------*/
 /* Following is to handle a text file of transactions                    */
 /*-----------------------------------------------------------------------*/
 
-// global variable to hold spi transactions
-spi_txn_input_t test_input;
-
-/*-----------------------------------------------------------------------*/
-
 static avr_cycle_count_t
 spi_txn_start(struct avr_t * avr, avr_cycle_count_t when, void * param)
 {
     spi_virt_t * part = (spi_virt_t*)param;
     if (part->current_txn != NULL) {
+        part->current_txn->start_cycle = part->avr->cycle;
+        part->phase = part->current_txn->phase;
         spi_virt_start_txn(part, &part->current_txn->transaction);
     }
     return 0;
@@ -246,15 +507,83 @@ spi_txn_start(struct avr_t * avr, avr_cycle_count_t when, void * param)
 
 /*-----------------------------------------------------------------------*/
 
-static void
-initiate_spi_txn(spi_virt_t* mcu)
+// schedule the first transaction of the input at its start cycle
+void spi_txn_input_start(spi_virt_t* mcu)
 {
-    mcu->current_txn = test_input.first;
+    mcu->current_txn = mcu->input.first;
+    mcu->done = 0;
     if (mcu->current_txn == NULL)
         return;
-    printf("SPIVIRT: first spi transaction scheduled at [%lu]\n",
-           test_input.start_cycle);
-    avr_cycle_timer_register(mcu->avr, test_input.start_cycle, spi_txn_start, mcu);
+    SPIVIRT_LOG(mcu, "SPIVIRT: first spi transaction scheduled at [%lu]\n",
+                mcu->input.start_cycle);
+    // the start cycle is absolute, the avr may not start at cycle 0
+    avr_cycle_count_t when = 1;
+    if (mcu->input.start_cycle > mcu->avr->cycle)
+        when = mcu->input.start_cycle - mcu->avr->cycle;
+    avr_cycle_timer_register(mcu->avr, when, spi_txn_start, mcu);
+}
+
+/*-----------------------------------------------------------------------*/
+
+// only the boot and one phase for transactions without a name
+static void
+spi_txn_input_phase_reset(spi_txn_input_t * input)
+{
+    memset(input->phase_names, 0, sizeof(input->phase_names));
+    strcpy(input->phase_names[0], "boot");
+    strcpy(input->phase_names[1], "spi");
+    input->phase_count = 2;
+    input->phase_used = 0;
+}
+
+/*-----------------------------------------------------------------------*/
+
+// transactions appended from now on are in a phase of this name, the
+// last phase is renamed if it has none yet. Returns 0 if ok
+int spi_txn_input_phase(spi_virt_t * part, const char * name)
+{
+    spi_txn_input_t * input = &part->input;
+    if (input->phase_count == 0)
+        spi_txn_input_phase_reset(input);
+    if (input->phase_used) {
+        if (input->phase_count == SPI_VIRT_MAX_PHASES)
+            return -1;
+        input->phase_count++;
+        input->phase_used = 0;
+    }
+    char * dst = input->phase_names[input->phase_count - 1];
+    strncpy(dst, name, SPI_VIRT_PHASE_NAME - 1);
+    dst[SPI_VIRT_PHASE_NAME - 1] = 0;
+    return 0;
+}
+
+/*-----------------------------------------------------------------------*/
+
+// add a transaction to the end of the input, its reply isn't checked
+spi_test_txn_t * spi_txn_input_append(spi_virt_t * part, uint8_t* bytes, int raise_cs)
+{
+    spi_test_txn_t * txn = malloc(sizeof(struct spi_test_txn));
+    txn->cycle = 0;
+    txn->start_cycle = 0;
+    txn->end_cycle = 0;
+    txn->check = 0;
+    txn->line = 0;
+    txn->transaction.length = 4;
+    uint8_t* buf = malloc(4);
+    memcpy(buf, bytes, 4);
+    txn->transaction.buf = buf;
+    txn->transaction.raise_cs = raise_cs;
+    txn->next = NULL;
+    spi_txn_input_t * input = &part->input;
+    if (input->phase_count == 0)
+        spi_txn_input_phase_reset(input);
+    txn->phase = input->phase_count - 1;
+    input->phase_used = 1;
+    if (input->last == NULL)
+        input->last = &input->first;
+    *input->last = txn;
+    input->last = &txn->next;
+    return txn;
 }
 
 /*-----------------------------------------------------------------------*/
@@ -265,109 +594,158 @@ initiate_spi_txn(spi_virt_t* mcu)
  * # first row is cycle to start this file of transactions
  * # each row is one transaction of 4 bytes
  * # next four columns are spi byte in hex
- * # final column is 0 if CS not raised, 1 if CS raised after transaction complete
+ * # next column is 0 if CS not raised, 1 if CS raised after transaction complete
+ * # after = the reply the bootloader should send, xx for any byte, and
+ * # after / a mask of the bits to compare
+ * # @ starts a named phase for the timing report
+ * @ hello
  * 30 00 00 00 0    # hello, anyone there?
- * 00 00 00 00 1
+ * 00 00 00 00 1 = 14 30 10 00
  * 75 00 00 00 0    # device signature bytes
- * 00 00 00 00 1
+ * 00 00 00 00 1 = 75 xx xx xx
  * 55 00 00 00 0    # set address 0x0000
- * 00 00 00 00 1
+ * 00 00 00 00 1 = 00 00 00 00 / 00 ff ff 00
  */
 
-// read an input file and get all the spi transactions
-void spi_txn_input_init(char* path, spi_virt_t* mcu)
+// read 4 hex bytes from the tokens, xx clears the byte in mask if there
+// is one, returns 0 if ok
+static int
+spi_txn_parse_bytes(char ** tok, uint8_t * bytes, uint8_t * mask)
+{
+    for (int i=0; i<4; i++) {
+        char * end;
+        if (tok[i] == NULL)
+            return -1;
+        if (mask != NULL && !strcmp(tok[i], "xx")) {
+            bytes[i] = 0;
+            mask[i] = 0;
+            continue;
+        }
+        unsigned long v = strtoul(tok[i], &end, 16);
+        if (*end != 0 || end == tok[i] || v > 0xff)
+            return -1;
+        bytes[i] = v;
+    }
+    return 0;
+}
+
+/*-----------------------------------------------------------------------*/
+
+// read an input file and get all the spi transactions, returns 0 if ok,
+// -1 if the file can't be read or a line doesn't parse and the input is
+// left empty
+int spi_txn_input_init(const char* path, spi_virt_t* mcu)
 {
-    int cnt;
+    int line = 0;
     int txn_count = 0;
-    char input_line[80];
-    test_input.first = NULL;
-    strncpy(test_input.input_path, path, sizeof(test_input.input_path));
+    int check_count = 0;
+    char input_line[256];
+    spi_txn_input_t * input = &mcu->input;
+    input->first = NULL;
+    input->last = &input->first;
+    spi_txn_input_phase_reset(input);
+    strncpy(input->input_path, path, sizeof(input->input_path) - 1);
 
     if (strlen(path) == 0)
-        return;
+        return 0;
     
-    FILE* f = fopen(test_input.input_path, "r");
-    if (f == NULL)
-        return;
-    spi_test_txn_t ** last = &test_input.first;
-    while (1) {
-        if (fgets(input_line, 80, f) != input_line) {
-            if (feof(f))
-                break;
-            goto error_exit;
-        }
-        // make sure line is null terminated
-        if (input_line[79] != 0)
-            input_line[79] = 0;
-        // empty lines is end of file
-        if (strlen(input_line) == 0)
-            break;
-        // skip comment lines
-        if (input_line[0] == '#' || input_line[0] == '\n')
+    FILE* f = fopen(input->input_path, "r");
+    if (f == NULL) {
+        perror(input->input_path);
+        return -1;
+    }
+    while (fgets(input_line, sizeof(input_line), f) == input_line) {
+        line++;
+        // drop the comment, then split the rest into tokens
+        char * comment = strchr(input_line, '#');
+        if (comment != NULL)
+            *comment = 0;
+        char * tok[16];
+        int n = 0;
+        for (char * t = strtok(input_line, " \t\r\n"); t != NULL && n < 16;
+             t = strtok(NULL, " \t\r\n"))
+            tok[n++] = t;
+        if (n == 0)
             continue;
-        char* start = input_line;
-        if (test_input.start_cycle == 0) {
-            // get the cycle
-            cnt = sscanf(start, "%lu", &test_input.start_cycle);
-            if (cnt != 1) {
+        for (int i=n; i<16; i++)
+            tok[i] = NULL;
+        // a phase of the script
+        if (!strcmp(tok[0], "@")) {
+            if (n != 2 || spi_txn_input_phase(mcu, tok[1]) != 0)
                 goto error_exit;
-            }
             continue;
         }
-        // get the 4 hex bytes
-        uint8_t hexnum[4];
-        for (int i=0; i<4; i++) {
-            cnt = sscanf(start, "%hhx", &hexnum[i]);
-            if (cnt != 1)
+        if (input->start_cycle == 0) {
+            // get the cycle
+            if (n != 1 || sscanf(tok[0], "%lu", &input->start_cycle) != 1)
                 goto error_exit;
-            start = strchr(start + 1, ' ');
+            continue;
         }
-        // get the cs raise flag
-        int cs;
-        cnt = sscanf(start + 1, "%d", &cs);
-        if (cnt != 1)
+        // the 4 bytes to send and the cs raise flag
+        uint8_t bytes[4];
+        if (n < 5 || spi_txn_parse_bytes(tok, bytes, NULL) != 0 ||
+            (strcmp(tok[4], "0") && strcmp(tok[4], "1")))
             goto error_exit;
-        start += 2;
-        // make the transaction
-        spi_test_txn_t * txn = malloc(sizeof(struct spi_test_txn));
-        txn->cycle = 0;
-        txn->transaction.length = 4;
-        uint8_t* buf = malloc(4);
-        memcpy(buf, hexnum, 4);
-        txn->transaction.buf = buf;
-        txn->transaction.raise_cs = cs;
-        txn->next = NULL;
-        *last = txn;
-        last = &txn->next;
+        spi_test_txn_t * txn = spi_txn_input_append(mcu, bytes, tok[4][0] == '1');
+        txn->line = line;
         txn_count++;
+        if (n == 5)
+            continue;
+        // the expected reply, and its mask
+        memset(txn->mask, 0xff, 4);
+        if (strcmp(tok[5], "=") || spi_txn_parse_bytes(tok + 6, txn->expect, txn->mask) != 0)
+            goto error_exit;
+        if (n > 10) {
+            uint8_t mask[4];
+            if (n != 15 || strcmp(tok[10], "/") ||
+                spi_txn_parse_bytes(tok + 11, mask, NULL) != 0)
+                goto error_exit;
+            for (int i=0; i<4; i++)
+                txn->mask[i] &= mask[i];
+        }
+        txn->check = 1;
+        check_count++;
+    }
+    if (ferror(f)) {
+        perror(input->input_path);
+        fclose(f);
+        spi_txn_input_cleanup(mcu);
+        return -1;
     }
     fclose(f);
-    printf("SPIVIRT: file '%s' parsed\n", test_input.input_path);
-    printf("SPIVIRT: %d transactions created.\n", txn_count);
-    initiate_spi_txn(mcu);
-    return;
+    SPIVIRT_LOG(mcu, "SPIVIRT: file '%s' parsed\n", input->input_path);
+    SPIVIRT_LOG(mcu, "SPIVIRT: %d transactions created, %d replies to check.\n",
+                txn_count, check_count);
+    return 0;
 error_exit:
-    perror("Error: ");
+    fprintf(stderr, "SPIVIRT: %s:%d: can't parse the transaction\n",
+            input->input_path, line);
     fclose(f);
-    test_input.first = NULL;
+    spi_txn_input_cleanup(mcu);
+    return -1;
 }
             
 /*-----------------------------------------------------------------------*/
 
-void spi_txn_input_cleanup(void)
+void spi_txn_input_cleanup(spi_virt_t * part)
 {
-    spi_test_txn_t *txn = test_input.first;
+    spi_txn_input_t * input = &part->input;
+    spi_test_txn_t *txn = input->first;
     while (txn != NULL) {
         free(txn->transaction.buf);
         spi_test_txn_t *delete_me = txn;
         txn = txn->next;
         free(delete_me);
     }
+    input->first = NULL;
+    input->last = &input->first;
+    input->start_cycle = 0;
+    spi_txn_input_phase_reset(input);
 }
 
 /*-----------------------------------------------------------------------*/
 
-void spi_virt_save_to_file(spi_virt_t * part, char * path)
+void spi_virt_save_to_file(spi_virt_t * part, const char * path)
 {
     if (strlen(path) == 0)
         return;
@@ -376,7 +754,8 @@ void spi_virt_save_to_file(spi_virt_t * part, char * path)
         printf("SPIVIRT: unable to open file '%s' for writing\n", path);
         return;
     }
-    
+    // one write per transaction adds up on long scripts
+    setvbuf(part->output_file, NULL, _IOFBF, SPI_VIRT_OUTPUT_BUFFER);
 }
 
 
@@ -14,10 +14,20 @@
 
 /*-----------------------------------------------------------------------*/
 
+// default bus timing, SCK_DELAY_CYCLES is half an SCK period
 #define CS_DELAY_CYCLES 4
 #define SCK_DELAY_CYCLES 6
+#define BYTE_GAP_CYCLES 0
 #define TXN_REPEAT_CYCLES 5000
 
+// stdio buffer of the transaction log
+#define SPI_VIRT_OUTPUT_BUFFER (64 * 1024)
+
+// named phases of a script, started by @ lines. Phase 0 is the boot up
+// to the first transaction
+#define SPI_VIRT_MAX_PHASES 8
+#define SPI_VIRT_PHASE_NAME 32
+
 /*-----------------------------------------------------------------------*/
 
 enum {
@@ -30,6 +40,7 @@ enum {
     SPI_VIRT_BYTE_TXN_END,
     SPI_VIRT_TXN_END,
     SPI_VIRT_NEW_TXN_SIGNAL,
+    SPI_VIRT_SCK,           // high while SCK is clocking a byte
 	SPI_VIRT_COUNT
 };
 
@@ -37,7 +48,8 @@ enum {
 
 typedef enum {
     Idle,
-    ByteTxn,
+    ByteTxn,        // CS low, waiting for first SCK edge
+    Shifting,       // clocking the 8 bits
 } spi_virt_state_t;
 
 /*-----------------------------------------------------------------------*/
@@ -53,8 +65,18 @@ typedef struct spi_txn
 
 typedef struct spi_test_txn 
 {
-    avr_cycle_count_t cycle;
+    avr_cycle_count_t cycle;        // bootloader signalled ready after txn
+    avr_cycle_count_t start_cycle;  // controller started clocking the txn
+    avr_cycle_count_t end_cycle;    // last byte of txn clocked
+
     spi_txn_t transaction;
+    // the reply the bootloader should clock out, bits outside the mask
+    // are not checked, nothing is checked if check is 0
+    int check;
+    uint8_t expect[4];
+    uint8_t mask[4];
+    int line;                       // line of the script, 0 if not from one
+    int phase;                      // index in the input's phase names
     struct spi_test_txn *next;
 } spi_test_txn_t;
 
@@ -65,10 +87,26 @@ typedef struct spi_txn_input
     char input_path[2048];
     avr_cycle_count_t start_cycle;
     struct spi_test_txn * first;
+    struct spi_test_txn ** last;
+    // transactions appended go in the last phase, phase_used once one has
+    char phase_names[SPI_VIRT_MAX_PHASES][SPI_VIRT_PHASE_NAME];
+    int phase_count;
+    int phase_used;
 } spi_txn_input_t ;
 
 /*-----------------------------------------------------------------------*/
 
+struct spi_virt;
+
+// a live controller instead of a script: feed is called when the
+// bootloader signals ready and nothing is queued, and can append the
+// next transaction, reply is called when a transaction has been clocked
+// with the bytes the bootloader sent back
+typedef void (*spi_virt_feed_t)(struct spi_virt * part, void * param);
+typedef void (*spi_virt_reply_t)(struct spi_virt * part, spi_txn_t * txn, void * param);
+
+/*-----------------------------------------------------------------------*/
+
 typedef struct spi_virt 
 {
     struct avr_t * avr;
@@ -77,15 +115,58 @@ typedef struct spi_virt
     uint8_t sdo_val;
     uint8_t sdi_val;
     uint8_t button;
+    uint8_t cs;
+    // last cycle the bootloader signalled ready on BUTTON
+    avr_cycle_count_t ready_cycle;
     spi_txn_t* cur_txn;
     int txn_idx;
     spi_test_txn_t * current_txn;
     FILE* output_file;
+    int verbose;
+    int done;
+    // one timer per transaction instead of the irq chain per byte
+    int fast;
+    // bus timing in cycles
+    int cs_delay;
+    int sck_cycles;
+    int byte_gap;
+    // SPI registers of the avr, in data space
+    avr_io_addr_t spsr;
+    avr_io_addr_t spdr;
+    // SPDR written since the last byte was clocked
+    int armed;
+    // byte clocked before the previous one was read from SPDR
+    int overruns;
+    // byte clocked before the firmware loaded SPDR
+    int stale;
+    // SPDR written while a byte was being clocked (WCOL)
+    int collisions;
+    // replies compared against the script, and the ones that differed
+    int checked;
+    int mismatches;
+    // cycles from a byte landing in SPDR to the firmware loading the
+    // next byte of the transaction, the wake up when it sleeps
+    avr_cycle_count_t byte_cycle;
+    int reload_pending;
+    int reloads;
+    avr_cycle_count_t reload_total;
+    avr_cycle_count_t reload_min;
+    avr_cycle_count_t reload_max;
+    // transactions started so far, and the phase of the last one
+    int txn_number;
+    int phase;
+    // flip bits of one byte sent by the controller, off if fault_txn < 0
+    int fault_txn;
+    int fault_byte;
+    uint8_t fault_xor;
+    // the transactions to send
+    spi_txn_input_t input;
+    // live controller, off if feed is NULL
+    spi_virt_feed_t feed;
+    spi_virt_reply_t reply;
+    void * live_param;
 } spi_virt_t;
 
-/*-----------------------------------------------------------------------*/
-
-extern spi_txn_input_t test_input;
 
 /*-----------------------------------------------------------------------*/
 
@@ -101,6 +182,9 @@ typedef struct spi_virt_wiring_t
     spi_virt_pin_t chip_select;
     spi_virt_pin_t mcu_running;
     spi_virt_pin_t button;
+    // SPSR and SPDR data addresses, overrun detection is off if 0
+    avr_io_addr_t spsr;
+    avr_io_addr_t spdr;
 } spi_virt_wiring_t;
 
 /*-----------------------------------------------------------------------*/
@@ -108,13 +192,28 @@ typedef struct spi_virt_wiring_t
 extern void spi_virt_init(struct avr_t * avr, spi_virt_t * part,
                           spi_virt_wiring_t * wiring);
 
-extern void spi_virt_save_to_file(spi_virt_t * part, char * path);
+extern void spi_virt_set_timing(spi_virt_t * part, int sck_cycles, int byte_gap);
+
+extern int spi_virt_error_count(spi_virt_t * part);
+
+extern void spi_virt_report(spi_virt_t * part);
+
+extern void spi_virt_save_to_file(spi_virt_t * part, const char * path);
 
 extern void spi_virt_start_txn(spi_virt_t * part, spi_txn_t* txn);
 
-extern void spi_txn_input_init(char* path, spi_virt_t * part);
+extern void spi_virt_set_live(spi_virt_t * part, spi_virt_feed_t feed,
+                              spi_virt_reply_t reply, void * param);
+
+extern int spi_txn_input_init(const char* path, spi_virt_t * part);
+
+extern spi_test_txn_t * spi_txn_input_append(spi_virt_t * part, uint8_t* bytes, int raise_cs);
+
+extern int spi_txn_input_phase(spi_virt_t * part, const char * name);
+
+extern void spi_txn_input_start(spi_virt_t * part);
 
-extern void spi_txn_input_cleanup(void);
+extern void spi_txn_input_cleanup(spi_virt_t * part);
 
 /*-----------------------------------------------------------------------*/
 
@@ -26,70 +26,25 @@
 #include "parts/uart_pty.h"
 #include "sim_vcd_file.h"
 #include "spi_virt.h"
+#include "sim_profile.h"
+#include "sim_harness.h"
 
-avr_t * avr = NULL;
-avr_vcd_t vcd_file;
-spi_virt_t mcu;
-
-struct avr_flash {
-	char avr_flash_path[1024];
-	int avr_flash_fd;
-};
-
-// avr special flash initalization
-// here: open and map a file to enable a persistent storage for the flash memory
-void avr_special_init( avr_t * avr, void * data)
-{
-	struct avr_flash *flash_data = (struct avr_flash *)data;
-
-	printf("%s\n", __func__);
-	// open the file
-	flash_data->avr_flash_fd = open(flash_data->avr_flash_path,
-									O_RDWR|O_CREAT, 0644);
-	if (flash_data->avr_flash_fd < 0) {
-		perror(flash_data->avr_flash_path);
-		exit(1);
-	}
-	// resize and map the file the file
-	(void)ftruncate(flash_data->avr_flash_fd, avr->flashend + 1);
-	ssize_t r = read(flash_data->avr_flash_fd, avr->flash, avr->flashend + 1);
-	if (r != avr->flashend + 1) {
-		fprintf(stderr, "unable to load flash memory\n");
-		perror(flash_data->avr_flash_path);
-		exit(1);
-	}
-}
-
-// avr special flash deinitalization
-// here: cleanup the persistent storage
-void avr_special_deinit( avr_t* avr, void * data)
-{
-	struct avr_flash *flash_data = (struct avr_flash *)data;
-
-	printf("%s\n", __func__);
-	lseek(flash_data->avr_flash_fd, SEEK_SET, 0);
-	ssize_t r = write(flash_data->avr_flash_fd, avr->flash, avr->flashend + 1);
-	if (r != avr->flashend + 1) {
-		fprintf(stderr, "unable to load flash memory\n");
-		perror(flash_data->avr_flash_path);
-	}
-	close(flash_data->avr_flash_fd);
-
-    // clean up spi input
-    spi_txn_input_cleanup();
-}
 
 int main(int argc, char *argv[])
 {
-	struct avr_flash flash_data;
+	sim_harness_t sim;
+	sim_config_t config;
 	char boot_path[1024] = "../build-power-monitor-bootloader-avr/power-monitor-bootloader-atmega328p.hex";
     char spi_input_file[2048] = "";
-	uint32_t boot_base, boot_size;
-	char * mmcu = "atmega328p";
-	uint32_t freq = 8000000;
+	char flash_path[1024];
 	int debug = 0;
 	int verbose = 0;
+    char elf_path[1024] = "";
+    char vcd_path[1024] = "";
+    char * profile_prefix = NULL;
+    sim_profile_t profile;
 
+	sim_config_defaults(&config);
 	for (int i = 1; i < argc; i++) {
 		if (!strcmp(argv[i] + strlen(argv[i]) - 4, ".hex"))
 			strncpy(boot_path, argv[i], sizeof(boot_path));
@@ -97,6 +52,39 @@ int main(int argc, char *argv[])
 			debug++;
 		else if (!strcmp(argv[i], "-v"))
 			verbose++;
+        else if (!strcmp(argv[i], "-m") && i + 1 < argc)
+            config.mmcu = argv[++i];
+        else if (!strcmp(argv[i], "-f") && i + 1 < argc)
+            config.freq = strtoul(argv[++i], NULL, 0);
+        else if (!strcmp(argv[i], "-k") && i + 1 < argc)
+            config.sck_cycles = atoi(argv[++i]);
+        else if (!strcmp(argv[i], "-g") && i + 1 < argc)
+            config.byte_gap = atoi(argv[++i]);
+        else if (!strcmp(argv[i] + strlen(argv[i]) - 4, ".elf"))
+            strncpy(elf_path, argv[i], sizeof(elf_path));
+        else if (!strcmp(argv[i], "-p") && i + 1 < argc)
+            profile_prefix = argv[++i];
+        else if (!strcmp(argv[i], "-b") && i + 1 < argc)
+            config.flash_base = argv[++i];
+        else if (!strcmp(argv[i], "-I"))
+            config.fast = 0;
+        else if (!strcmp(argv[i] + strlen(argv[i]) - 4, ".vcd"))
+            strncpy(vcd_path, argv[i], sizeof(vcd_path));
+        else if (!strcmp(argv[i], "-w") && i + 1 < argc) {
+            // start[:length] in cycles
+            char * end;
+            config.vcd_start = strtoull(argv[++i], &end, 0);
+            if (*end == ':')
+                config.vcd_length = strtoull(end + 1, NULL, 0);
+        }
+        else if (!strcmp(argv[i], "-T") && i + 1 < argc)
+            config.vcd_trigger_txn = atoi(argv[++i]);
+        else if (!strcmp(argv[i], "-M"))
+            config.track_stack = 1;
+        else if (!strcmp(argv[i], "-l") && i + 1 < argc)
+            config.max_cycles = strtoull(argv[++i], NULL, 0);
+        else if (!strcmp(argv[i], "-S") && i + 1 < argc)
+            config.socket_path = argv[++i];
         else if (!strcmp(argv[i] + strlen(argv[i]) - 4, ".txt"))
             strncpy(spi_input_file, argv[i], sizeof(spi_input_file));
 		else {
@@ -105,39 +93,23 @@ int main(int argc, char *argv[])
 		}
 	}
 
-	avr = avr_make_mcu_by_name(mmcu);
-	if (!avr) {
-		fprintf(stderr, "%s: Error creating the AVR core\n", argv[0]);
-		exit(1);
+	snprintf(flash_path, sizeof(flash_path),
+			"tst_atmega_spi_bootloader_%s_flash.bin", config.mmcu);
+	config.boot_path = boot_path;
+	config.spi_input = spi_input_file;
+	config.flash_path = flash_path;
+	config.output_path = "bootloader_tst_output.txt";
+	config.vcd_path = vcd_path;
+	config.log = 1 + verbose;
+	// an uploader on the socket replaces the script
+	if (strlen(config.socket_path) != 0) {
+		config.spi_input = "";
+		config.stop_when_done = 1;
 	}
 
-	uint8_t * boot = read_ihex_file(boot_path, &boot_size, &boot_base);
-	if (!boot) {
-		fprintf(stderr, "%s: Unable to load %s\n", argv[0], boot_path);
+	if (sim_harness_init(&sim, &config) != 0)
 		exit(1);
-	}
-	if (boot_base > 32*1024*1024) {
-		mmcu = "atmega2560";
-		freq = 20000000;
-	}
-	printf("%s bootloader 0x%05x: %d bytes\n", mmcu, boot_base, boot_size);
-
-	snprintf(flash_data.avr_flash_path, sizeof(flash_data.avr_flash_path),
-			"tst_atmega_spi_bootloader_%s_flash.bin", mmcu);
-	flash_data.avr_flash_fd = 0;
-	// register our own functions
-	avr->custom.init = avr_special_init;
-	avr->custom.deinit = avr_special_deinit;
-	avr->custom.data = &flash_data;
-	avr_init(avr);
-	avr->frequency = freq;
-
-	memcpy(avr->flash + boot_base, boot, boot_size);
-	free(boot);
-	avr->pc = boot_base;
-	/* end of flash, remember we are writing /code/ */
-	avr->codeend = avr->flashend;
-	avr->log = 1 + verbose;
+	avr_t * avr = sim.avr;
 
 	// even if not setup at startup, activate gdb if crashing
 	avr->gdb_port = 1234;
@@ -146,23 +118,30 @@ int main(int argc, char *argv[])
 		avr_gdb_init(avr);
 	}
 
-    spi_virt_wiring_t wiring = {
-        .chip_select = { .port = 'B', .pin = 2 },
-        .mcu_running = { .port = 'B', .pin = 1 },
-        .button = { .port = 'D', .pin = 2 },
-    };
-    
-    spi_virt_init(avr, &mcu, &wiring);
-    spi_txn_input_init(spi_input_file, &mcu);
-    spi_virt_save_to_file(&mcu, "bootloader_tst_output.txt");
-    
-	while (1) {
-		int state = avr_run(avr);
-		if ( state == cpu_Done || state == cpu_Crashed)
-			break;
+	if (profile_prefix != NULL) {
+		if (sim_profile_init(&profile, avr, elf_path) != 0)
+			exit(1);
+		sim.profile = &profile;
 	}
-    if (mcu.output_file != NULL)
-        fclose(mcu.output_file);
-    mcu.output_file = NULL;
 
+	sim_harness_run(&sim);
+    spi_virt_report(&sim.spi);
+    sim_harness_time_report(&sim);
+    if (config.track_stack) {
+        // _end from the elf, if there is one
+        uint32_t ram_end = 0;
+        if (strlen(elf_path) != 0 &&
+            sim_profile_elf_symbol(elf_path, "_end", &ram_end) == 0)
+            ram_end -= SIM_PROFILE_DATA_OFFSET;
+        sim_harness_memory_report(&sim, ram_end);
+    }
+
+    if (profile_prefix != NULL) {
+        sim_profile_write(&profile, profile_prefix);
+        sim_profile_cleanup(&profile);
+    }
+    // the application running on after the script isn't a failure
+    int failed = sim.spi.mismatches || (sim.budget_exceeded && !sim.spi.done);
+	sim_harness_cleanup(&sim);
+	return failed ? 1 : 0;
 }
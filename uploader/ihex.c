@@ -0,0 +1,232 @@
+/*
+	ihex.c
+
+    Copyright 2021 Greg Green <ggreen@bit-builder.com>
+
+ 	This file is part of avr_bootloaders.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+
+#include "ihex.h"
+
+/*-----------------------------------------------------------------------*/
+
+static int
+ihex_hex_byte(const char * s)
+{
+    int v = 0;
+    for (int i=0; i<2; i++) {
+        char c = s[i];
+        v <<= 4;
+        if (c >= '0' && c <= '9')
+            v |= c - '0';
+        else if (c >= 'a' && c <= 'f')
+            v |= c - 'a' + 10;
+        else if (c >= 'A' && c <= 'F')
+            v |= c - 'A' + 10;
+        else
+            return -1;
+    }
+    return v;
+}
+
+/*-----------------------------------------------------------------------*/
+
+// add bytes to the image, extending the last segment when they follow on
+static int
+ihex_add(ihex_image_t * image, uint32_t addr, const uint8_t * data, int len)
+{
+    ihex_segment_t * seg = image->count ? &image->segments[image->count - 1] : NULL;
+
+    if (seg == NULL || seg->addr + seg->length != addr) {
+        ihex_segment_t * segments = realloc(image->segments,
+                                            (image->count + 1) * sizeof(ihex_segment_t));
+        if (segments == NULL)
+            return -1;
+        image->segments = segments;
+        seg = &image->segments[image->count++];
+        seg->addr = addr;
+        seg->length = 0;
+        seg->data = NULL;
+    }
+    uint8_t * buf = realloc(seg->data, seg->length + len);
+    if (buf == NULL)
+        return -1;
+    memcpy(buf + seg->length, data, len);
+    seg->data = buf;
+    seg->length += len;
+    return 0;
+}
+
+/*-----------------------------------------------------------------------*/
+
+static int
+ihex_compare(const void * a, const void * b)
+{
+    const ihex_segment_t * sa = a;
+    const ihex_segment_t * sb = b;
+    return sa->addr < sb->addr ? -1 : sa->addr > sb->addr;
+}
+
+/*-----------------------------------------------------------------------*/
+
+// sort the segments and join the ones that touch, records don't have to
+// come in address order
+static int
+ihex_sort(ihex_image_t * image)
+{
+    qsort(image->segments, image->count, sizeof(ihex_segment_t), ihex_compare);
+    int out = 0;
+    for (int i=0; i<image->count; i++) {
+        ihex_segment_t * seg = &image->segments[i];
+        ihex_segment_t * prev = out ? &image->segments[out - 1] : NULL;
+        if (prev != NULL && seg->addr < prev->addr + prev->length) {
+            fprintf(stderr, "ihex: overlapping data at 0x%05x\n", seg->addr);
+            return -1;
+        }
+        if (prev != NULL && seg->addr == prev->addr + prev->length) {
+            uint8_t * buf = realloc(prev->data, prev->length + seg->length);
+            if (buf == NULL)
+                return -1;
+            memcpy(buf + prev->length, seg->data, seg->length);
+            prev->data = buf;
+            prev->length += seg->length;
+            free(seg->data);
+            continue;
+        }
+        image->segments[out++] = *seg;
+    }
+    image->count = out;
+    return 0;
+}
+
+/*-----------------------------------------------------------------------*/
+
+// read a hex file, data records with extended segment and linear
+// address records, returns 0 on success
+int ihex_read(const char * path, ihex_image_t * image)
+{
+    char line[600];
+    uint8_t rec[256 + 5];
+    uint32_t base = 0;
+    int lineno = 0;
+    int eof = 0;
+
+    memset(image, 0, sizeof(ihex_image_t));
+    FILE * f = fopen(path, "r");
+    if (f == NULL) {
+        perror(path);
+        return -1;
+    }
+    while (!eof && fgets(line, sizeof(line), f) == line) {
+        lineno++;
+        // a line longer than the buffer is no record
+        if (strchr(line, '\n') == NULL && !feof(f))
+            goto bad_record;
+        size_t n = strcspn(line, "\r\n");
+        line[n] = 0;
+        if (n == 0)
+            continue;
+        if (line[0] != ':' || n < 11 || (n - 1) % 2 != 0)
+            goto bad_record;
+        int count = (n - 1) / 2;
+        if (count > (int)sizeof(rec))
+            goto bad_record;
+        uint8_t sum = 0;
+        for (int i=0; i<count; i++) {
+            int v = ihex_hex_byte(line + 1 + i * 2);
+            if (v < 0)
+                goto bad_record;
+            rec[i] = v;
+            sum += v;
+        }
+        // length, address, type, data, checksum
+        if (rec[0] + 5 != count || sum != 0)
+            goto bad_record;
+        uint32_t addr = (rec[1] << 8) | rec[2];
+        switch (rec[3]) {
+        case 0x00:
+            if (ihex_add(image, base + addr, rec + 4, rec[0]) != 0)
+                goto no_memory;
+            break;
+        case 0x01:
+            eof = 1;
+            break;
+        case 0x02:
+            base = ((rec[4] << 8) | rec[5]) << 4;
+            break;
+        case 0x04:
+            base = ((rec[4] << 8) | rec[5]) << 16;
+            break;
+        case 0x03:
+        case 0x05:
+            // start address, nothing to load
+            break;
+        default:
+            goto bad_record;
+        }
+    }
+    fclose(f);
+    if (ihex_sort(image) != 0) {
+        ihex_free(image);
+        return -1;
+    }
+    return 0;
+
+bad_record:
+    fprintf(stderr, "%s:%d: bad hex record\n", path, lineno);
+    fclose(f);
+    ihex_free(image);
+    return -1;
+no_memory:
+    fprintf(stderr, "%s: out of memory\n", path);
+    fclose(f);
+    ihex_free(image);
+    return -1;
+}
+
+/*-----------------------------------------------------------------------*/
+
+// number of data bytes in the image
+uint32_t ihex_size(const ihex_image_t * image)
+{
+    uint32_t size = 0;
+    for (int i=0; i<image->count; i++)
+        size += image->segments[i].length;
+    return size;
+}
+
+/*-----------------------------------------------------------------------*/
+
+// copy the image's bytes in [addr, addr+len) over buf, leaving the gaps
+// alone, returns how many bytes the image has in the range
+int ihex_fill(const ihex_image_t * image, uint32_t addr, uint8_t * buf, uint32_t len)
+{
+    int found = 0;
+    for (int i=0; i<image->count; i++) {
+        const ihex_segment_t * seg = &image->segments[i];
+        uint32_t start = seg->addr > addr ? seg->addr : addr;
+        uint32_t end = seg->addr + seg->length;
+        if (end > addr + len)
+            end = addr + len;
+        if (start >= end)
+            continue;
+        memcpy(buf + (start - addr), seg->data + (start - seg->addr), end - start);
+        found += end - start;
+    }
+    return found;
+}
+
+/*-----------------------------------------------------------------------*/
+
+void ihex_free(ihex_image_t * image)
+{
+    for (int i=0; i<image->count; i++)
+        free(image->segments[i].data);
+    free(image->segments);
+    image->segments = NULL;
+    image->count = 0;
+}
@@ -0,0 +1,44 @@
+/*
+	ihex.h
+    Copyright 2021 Greg Green <ggreen@bit-builder.com>
+
+ 	This file is part of avr_bootloaders.
+    Intel hex file reader, gives the contiguous runs of data in the file
+ */
+
+#ifndef IHEX_H_
+#define IHEX_H_
+
+#include <stdint.h>
+
+/*-----------------------------------------------------------------------*/
+
+typedef struct ihex_segment
+{
+    uint32_t addr;
+    uint32_t length;
+    uint8_t * data;
+} ihex_segment_t;
+
+/*-----------------------------------------------------------------------*/
+
+// segments are sorted by address and don't overlap
+typedef struct ihex_image
+{
+    int count;
+    ihex_segment_t * segments;
+} ihex_image_t;
+
+/*-----------------------------------------------------------------------*/
+
+extern int ihex_read(const char * path, ihex_image_t * image);
+
+extern uint32_t ihex_size(const ihex_image_t * image);
+
+extern int ihex_fill(const ihex_image_t * image, uint32_t addr, uint8_t * buf, uint32_t len);
+
+extern void ihex_free(ihex_image_t * image);
+
+/*-----------------------------------------------------------------------*/
+
+#endif // IHEX_H_
@@ -0,0 +1,304 @@
+/*
+	page_plan.c
+
+    Copyright 2021 Greg Green <ggreen@bit-builder.com>
+
+ 	This file is part of avr_bootloaders.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+
+#include "spi_boot.h"
+#include "page_plan.h"
+
+/*-----------------------------------------------------------------------*/
+
+// atmega_spi_bootloader as it is, a 'U' before every write
+void boot_caps_defaults(boot_caps_t * caps)
+{
+    caps->page_size = SPI_BOOT_PAGE_SIZE;
+    caps->partial_page = 1;
+    caps->keeps_address = 0;
+}
+
+/*-----------------------------------------------------------------------*/
+
+// call fn for every page holding image data, in address order, touching
+// segments were already joined by the hex reader
+static int
+page_plan_pages(const ihex_image_t * image, uint32_t size,
+                int (*fn)(uint32_t page, void * param), void * param)
+{
+    uint32_t next = 0;
+    for (int i=0; i<image->count; i++) {
+        const ihex_segment_t * seg = &image->segments[i];
+        uint32_t page = seg->addr - seg->addr % size;
+        // the last segment may have ended in this page
+        if (i > 0 && page < next)
+            page = next;
+        for (; page < seg->addr + seg->length; page += size) {
+            if (fn(page, param) != 0)
+                return -1;
+            next = page + size;
+        }
+    }
+    return 0;
+}
+
+/*-----------------------------------------------------------------------*/
+
+typedef struct page_plan_ctx
+{
+    page_plan_t * plan;
+    const ihex_image_t * image;
+    const boot_caps_t * caps;
+    const uint8_t * flash;
+    uint32_t flash_size;
+    // flash only holds the pages the image partly covers
+    int partial_only;
+    // end of the last write, where the address is left if it moves on
+    uint32_t address;
+} page_plan_ctx_t;
+
+/*-----------------------------------------------------------------------*/
+
+static int
+page_plan_add(uint32_t page, void * param)
+{
+    page_plan_ctx_t * ctx = param;
+    page_plan_t * plan = ctx->plan;
+    uint32_t size = ctx->caps->page_size;
+    uint8_t * data = malloc(size);
+
+    if (data == NULL)
+        return -1;
+    plan->pages++;
+    // what is in the flash now, or erased when not known
+    int unchanged = ctx->flash != NULL && page + size <= ctx->flash_size;
+    if (unchanged)
+        memcpy(data, ctx->flash + page, size);
+    else
+        memset(data, 0xff, size);
+    uint32_t filled = ihex_fill(ctx->image, page, data, size);
+    // a page the image covers wasn't read back, it may hold anything and
+    // has to be erased even if the image only has 0xff for it
+    int unknown = ctx->partial_only && filled == size;
+    if (unknown)
+        unchanged = 0;
+    if (unchanged && memcmp(data, ctx->flash + page, size) == 0) {
+        plan->unchanged++;
+        free(data);
+        return 0;
+    }
+
+    // only erased words at the ends can be left out, the write is in
+    // words and the bootloader erases the whole page first
+    uint32_t first = 0;
+    uint32_t last = size;
+    if (ctx->caps->partial_page) {
+        while (first < size && data[first] == 0xff && data[first + 1] == 0xff)
+            first += 2;
+        while (last > first && data[last - 1] == 0xff && data[last - 2] == 0xff)
+            last -= 2;
+    } else {
+        uint32_t i = 0;
+        while (i < size && data[i] == 0xff)
+            i++;
+        if (i == size)
+            first = last = size;
+    }
+    if (first == last) {
+        // erased already, or left as it is when the flash isn't known
+        if (!unknown && (!unchanged || memcmp(data, ctx->flash + page, size) == 0)) {
+            plan->erased++;
+            free(data);
+            return 0;
+        }
+        // the flash has something to erase, a word of 0xff does it
+        first = 0;
+        last = ctx->caps->partial_page ? 2 : size;
+    }
+
+    page_write_t * writes = realloc(plan->writes, (plan->count + 1) * sizeof(page_write_t));
+    if (writes == NULL) {
+        free(data);
+        return -1;
+    }
+    plan->writes = writes;
+    page_write_t * w = &plan->writes[plan->count++];
+    w->page = page;
+    w->addr = page + first;
+    w->length = last - first;
+    memmove(data, data + first, w->length);
+    w->data = data;
+    w->set_address = !ctx->caps->keeps_address || plan->count == 1 ||
+        ctx->address != w->addr;
+    ctx->address = w->addr + w->length;
+
+    plan->bytes += w->length;
+    plan->txns += w->set_address + 1 + (w->length + 3) / 4;
+    return 0;
+}
+
+/*-----------------------------------------------------------------------*/
+
+static int
+page_plan_run(page_plan_t * plan, const ihex_image_t * image,
+              const boot_caps_t * caps, const uint8_t * flash,
+              uint32_t flash_size, int partial_only)
+{
+    page_plan_ctx_t ctx = {
+        .plan = plan,
+        .image = image,
+        .caps = caps,
+        .flash = flash,
+        .flash_size = flash_size,
+        .partial_only = partial_only,
+    };
+
+    memset(plan, 0, sizeof(page_plan_t));
+    if (caps->page_size <= 0 || caps->page_size > SPI_BOOT_MAX_WRITE ||
+        caps->page_size % 2) {
+        fprintf(stderr, "bad page size %d\n", caps->page_size);
+        return -1;
+    }
+    if (page_plan_pages(image, caps->page_size, page_plan_add, &ctx) != 0) {
+        page_plan_free(plan);
+        return -1;
+    }
+    return 0;
+}
+
+/*-----------------------------------------------------------------------*/
+
+// plan the flash writes of an image, flash is the current contents of
+// the flash if known, to pad partial pages and skip unchanged ones,
+// otherwise NULL and partial pages are padded with 0xff
+int page_plan_build(page_plan_t * plan, const ihex_image_t * image,
+                    const boot_caps_t * caps,
+                    const uint8_t * flash, uint32_t flash_size)
+{
+    return page_plan_run(plan, image, caps, flash, flash_size, 0);
+}
+
+/*-----------------------------------------------------------------------*/
+
+// as page_plan_build with only the pages of page_plan_partial read into
+// flash, the pages the image covers are written as if the flash wasn't
+// known
+int page_plan_build_partial(page_plan_t * plan, const ihex_image_t * image,
+                            const boot_caps_t * caps,
+                            const uint8_t * flash, uint32_t flash_size)
+{
+    return page_plan_run(plan, image, caps, flash, flash_size, 1);
+}
+
+/*-----------------------------------------------------------------------*/
+
+typedef struct page_plan_list
+{
+    const ihex_image_t * image;
+    uint32_t size;
+    uint32_t * pages;
+    int max;
+    int count;
+} page_plan_list_t;
+
+/*-----------------------------------------------------------------------*/
+
+static int
+page_plan_add_partial(uint32_t page, void * param)
+{
+    page_plan_list_t * list = param;
+    uint8_t buf[SPI_BOOT_MAX_WRITE];
+
+    if ((uint32_t)ihex_fill(list->image, page, buf, list->size) == list->size)
+        return 0;
+    if (list->count < list->max)
+        list->pages[list->count] = page;
+    list->count++;
+    return 0;
+}
+
+/*-----------------------------------------------------------------------*/
+
+// the pages the image only partly covers, whose current contents are
+// needed to pad them, returns how many, pages holds the first max
+int page_plan_partial(const ihex_image_t * image, const boot_caps_t * caps,
+                      uint32_t * pages, int max)
+{
+    page_plan_list_t list = {
+        .image = image,
+        .size = caps->page_size,
+        .pages = pages,
+        .max = max,
+    };
+    page_plan_pages(image, caps->page_size, page_plan_add_partial, &list);
+    return list.count;
+}
+
+/*-----------------------------------------------------------------------*/
+
+// a transaction script for tst_atmega_spi_bootloader, see spi_virt.c,
+// with a read back of every write if verify, each reply checked against
+// the bytes written
+void page_plan_script(const page_plan_t * plan, FILE * out,
+                      unsigned long start_cycle, int verify)
+{
+    fprintf(out, "# %d page writes, %u bytes, %u transactions\n",
+            plan->count, plan->bytes, plan->txns);
+    fprintf(out, "%lu\n", start_cycle);
+    fprintf(out, "30 00 00 00 1    # hello, anyone there?\n");
+    fprintf(out, "00 00 00 00 1\n");
+    fprintf(out, "75 00 00 00 1    # device signature bytes\n");
+    fprintf(out, "00 00 00 00 1\n");
+    for (int pass=0; pass<1+verify; pass++) {
+        for (int i=0; i<plan->count; i++) {
+            const page_write_t * w = &plan->writes[i];
+            uint16_t word = w->addr >> 1;
+            if (w->set_address || pass)
+                fprintf(out, "55 %02x %02x 00 1    # 0x%05x\n",
+                        word & 0xff, word >> 8, w->addr);
+            fprintf(out, "%02x %02x %02x 00 1\n", pass ? 't' : 'd',
+                    w->length >> 8, w->length & 0xff);
+            for (int j=0; j<w->length; j+=4) {
+                for (int k=j; k<j+4; k++)
+                    fprintf(out, "%02x ", pass || k >= w->length ? 0 : w->data[k]);
+                fprintf(out, "1");
+                // the read back is checked against what was written
+                if (pass) {
+                    fprintf(out, " =");
+                    for (int k=j; k<j+4; k++)
+                        if (k < w->length)
+                            fprintf(out, " %02x", w->data[k]);
+                        else
+                            fprintf(out, " xx");
+                }
+                fprintf(out, "\n");
+            }
+        }
+    }
+}
+
+/*-----------------------------------------------------------------------*/
+
+void page_plan_report(const page_plan_t * plan, FILE * out)
+{
+    fprintf(out, "%d pages with data: %d to write, %d erased, %d unchanged, "
+            "%u bytes in %u transactions\n",
+            plan->pages, plan->count, plan->erased, plan->unchanged,
+            plan->bytes, plan->txns);
+}
+
+/*-----------------------------------------------------------------------*/
+
+void page_plan_free(page_plan_t * plan)
+{
+    for (int i=0; i<plan->count; i++)
+        free(plan->writes[i].data);
+    free(plan->writes);
+    plan->writes = NULL;
+    plan->count = 0;
+}
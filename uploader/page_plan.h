@@ -0,0 +1,82 @@
+/*
+	page_plan.h
+    Copyright 2021 Greg Green <ggreen@bit-builder.com>
+
+ 	This file is part of avr_bootloaders.
+    Turns a hex image into the page writes the bootloader needs, with as
+    few pages and bytes on the bus as the bootloader allows
+ */
+
+#ifndef PAGE_PLAN_H_
+#define PAGE_PLAN_H_
+
+#include <stdint.h>
+#include <stdio.h>
+#include "ihex.h"
+
+/*-----------------------------------------------------------------------*/
+
+// what the bootloader can do, decides which commands can be left out
+typedef struct boot_caps
+{
+    int page_size;          // flash page in bytes
+    // the bootloader only fills the bytes it is sent and the rest of the
+    // page is left erased, so leading and trailing 0xff are not sent
+    int partial_page;
+    // the address moves past a write, the next page needs no 'U'. Not
+    // atmega_spi_bootloader, it leaves the address where the 'd' started
+    int keeps_address;
+} boot_caps_t;
+
+/*-----------------------------------------------------------------------*/
+
+typedef struct page_write
+{
+    uint32_t page;          // byte address of the page
+    uint32_t addr;          // byte address of the first byte sent
+    uint16_t length;
+    int set_address;        // needs a 'U' first
+    uint8_t * data;
+} page_write_t;
+
+/*-----------------------------------------------------------------------*/
+
+typedef struct page_plan
+{
+    int count;
+    page_write_t * writes;
+    // pages with image data, and the ones left out because they are
+    // erased or the flash already holds them
+    int pages;
+    int erased;
+    int unchanged;
+    // data bytes and transactions of the writes
+    uint32_t bytes;
+    uint32_t txns;
+} page_plan_t;
+
+/*-----------------------------------------------------------------------*/
+
+extern void boot_caps_defaults(boot_caps_t * caps);
+
+extern int page_plan_build(page_plan_t * plan, const ihex_image_t * image,
+                           const boot_caps_t * caps,
+                           const uint8_t * flash, uint32_t flash_size);
+
+extern int page_plan_build_partial(page_plan_t * plan, const ihex_image_t * image,
+                                   const boot_caps_t * caps,
+                                   const uint8_t * flash, uint32_t flash_size);
+
+extern int page_plan_partial(const ihex_image_t * image, const boot_caps_t * caps,
+                             uint32_t * pages, int max);
+
+extern void page_plan_script(const page_plan_t * plan, FILE * out,
+                             unsigned long start_cycle, int verify);
+
+extern void page_plan_report(const page_plan_t * plan, FILE * out);
+
+extern void page_plan_free(page_plan_t * plan);
+
+/*-----------------------------------------------------------------------*/
+
+#endif // PAGE_PLAN_H_
@@ -0,0 +1,610 @@
+/*
+	spi_boot.c
+
+    Copyright 2021 Greg Green <ggreen@bit-builder.com>
+
+ 	This file is part of avr_bootloaders.
+ */
+
+#include <time.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+
+#include "spi_boot.h"
+
+/*-----------------------------------------------------------------------*/
+
+// transactions of one command, header, address and data frames
+#define SPI_BOOT_MAX_FRAMES (2 + SPI_BOOT_MAX_WRITE / 4)
+
+typedef struct spi_boot_frames
+{
+    int count;
+    uint8_t tx[SPI_BOOT_MAX_FRAMES][4];
+    uint8_t rx[SPI_BOOT_MAX_FRAMES][4];
+} spi_boot_frames_t;
+
+/*-----------------------------------------------------------------------*/
+
+double spi_boot_now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+/*-----------------------------------------------------------------------*/
+
+void spi_boot_init(spi_boot_t * boot, spi_transport_t * transport)
+{
+    memset(boot, 0, sizeof(spi_boot_t));
+    boot->transport = transport;
+    boot->ready_timeout_ms = SPI_BOOT_READY_TIMEOUT_MS;
+    boot->page_size = SPI_BOOT_PAGE_SIZE;
+}
+
+/*-----------------------------------------------------------------------*/
+
+// wait for the bootloader to be ready and clock one transaction, the
+// bootloader loads its reply before signalling, so the transfer starts
+// as soon as the ready edge is seen
+int spi_boot_txn(spi_boot_t * boot, const uint8_t * tx, uint8_t * rx)
+{
+    spi_transport_t * t = boot->transport;
+    uint8_t dummy[4];
+    double start = spi_boot_now();
+
+    int r = t->wait_ready(t, boot->ready_timeout_ms);
+    if (r == SPI_TRANSPORT_TIMEOUT) {
+        fprintf(stderr, "no ready signal from the bootloader in %d ms, txn %lu\n",
+                boot->ready_timeout_ms, boot->stats.txns);
+        return -1;
+    }
+    if (r != SPI_TRANSPORT_READY)
+        return -1;
+    double ready = spi_boot_now();
+    if (t->transfer(t, tx, rx != NULL ? rx : dummy, 4) != 0)
+        return -1;
+    double done = spi_boot_now();
+
+    boot->stats.txns++;
+    boot->stats.ready_wait += ready - start;
+    boot->stats.bus += done - ready;
+    if (ready - start > boot->stats.max_ready_wait)
+        boot->stats.max_ready_wait = ready - start;
+    if (boot->verbose > 1) {
+        printf("%02x %02x %02x %02x", tx[0], tx[1], tx[2], tx[3]);
+        if (rx != NULL)
+            printf(" -> %02x %02x %02x %02x", rx[0], rx[1], rx[2], rx[3]);
+        printf("\n");
+    }
+    return 0;
+}
+
+/*-----------------------------------------------------------------------*/
+
+static void
+spi_boot_frame(spi_boot_frames_t * frames, uint8_t b0, uint8_t b1, uint8_t b2, uint8_t b3)
+{
+    uint8_t * tx = frames->tx[frames->count++];
+    tx[0] = b0;
+    tx[1] = b1;
+    tx[2] = b2;
+    tx[3] = b3;
+}
+
+/*-----------------------------------------------------------------------*/
+
+// the transactions of a command are all built before the first is sent,
+// so nothing but the wait for BUTTON sits between them
+static int
+spi_boot_send(spi_boot_t * boot, spi_boot_frames_t * frames)
+{
+    for (int i=0; i<frames->count; i++)
+        if (spi_boot_txn(boot, frames->tx[i], frames->rx[i]) != 0)
+            return -1;
+    return 0;
+}
+
+/*-----------------------------------------------------------------------*/
+
+// keep the page write state from the reply to a command
+static void
+spi_boot_spm(spi_boot_t * boot, const uint8_t * rx)
+{
+    boot->spm.state = rx[0];
+    boot->spm.queued = rx[1];
+    boot->spm.done = rx[2];
+    if (boot->verbose > 1)
+        printf("pages %u queued, %u done%s\n", rx[1], rx[2], rx[0] ? ", busy" : "");
+}
+
+/*-----------------------------------------------------------------------*/
+
+// addresses are in words, for the eeprom too as the bootloader doubles
+// them, so an eeprom access has to start on an even byte
+static int
+spi_boot_address_frame(spi_boot_frames_t * frames, uint32_t addr, int eeprom)
+{
+    uint16_t word = addr >> 1;
+    if ((addr & 1) || (addr >> 1) > 0xffff) {
+        fprintf(stderr, "%s address 0x%05x can't be reached\n",
+                eeprom ? "eeprom" : "flash", addr);
+        return -1;
+    }
+    spi_boot_frame(frames, 'U', word & 0xff, word >> 8, 0);
+    return 0;
+}
+
+/*-----------------------------------------------------------------------*/
+
+int spi_boot_hello(spi_boot_t * boot)
+{
+    spi_boot_frames_t frames = { 0 };
+
+    spi_boot_frame(&frames, '0', 0, 0, 0);
+    spi_boot_frame(&frames, 0, 0, 0, 0);
+    if (spi_boot_send(boot, &frames) != 0)
+        return -1;
+    uint8_t * rx = frames.rx[1];
+    if (rx[0] != 0x14 || rx[1] != '0' || rx[2] != 0x10 || rx[3] != 0) {
+        fprintf(stderr, "bad hello reply %02x %02x %02x %02x\n",
+                rx[0], rx[1], rx[2], rx[3]);
+        return -1;
+    }
+    return 0;
+}
+
+/*-----------------------------------------------------------------------*/
+
+int spi_boot_signature(spi_boot_t * boot, uint8_t * sig)
+{
+    spi_boot_frames_t frames = { 0 };
+
+    spi_boot_frame(&frames, 'u', 0, 0, 0);
+    spi_boot_frame(&frames, 0, 0, 0, 0);
+    if (spi_boot_send(boot, &frames) != 0)
+        return -1;
+    uint8_t * rx = frames.rx[1];
+    if (rx[0] != 'u') {
+        fprintf(stderr, "bad signature reply %02x %02x %02x %02x\n",
+                rx[0], rx[1], rx[2], rx[3]);
+        return -1;
+    }
+    memcpy(sig, rx + 1, 3);
+    return 0;
+}
+
+/*-----------------------------------------------------------------------*/
+
+int spi_boot_set_address(spi_boot_t * boot, uint16_t word)
+{
+    uint8_t tx[4] = { 'U', word & 0xff, word >> 8, 0 };
+    return spi_boot_txn(boot, tx, NULL);
+}
+
+/*-----------------------------------------------------------------------*/
+
+// a flash write erases the page holding addr and fills it from addr,
+// so it has to stay inside that page, set_address 0 leaves out the 'U'
+static int
+spi_boot_write_at(spi_boot_t * boot, uint32_t addr, const uint8_t * data,
+                  int len, int eeprom, int set_address)
+{
+    spi_boot_frames_t frames = { 0 };
+    uint32_t page = boot->page_size;
+
+    if (len <= 0 || len > SPI_BOOT_MAX_WRITE ||
+        (!eeprom && addr % page + len > page)) {
+        fprintf(stderr, "bad %s write of %d bytes at 0x%05x\n",
+                eeprom ? "eeprom" : "flash", len, addr);
+        return -1;
+    }
+    if (set_address && spi_boot_address_frame(&frames, addr, eeprom) != 0)
+        return -1;
+    spi_boot_frame(&frames, 'd', len >> 8, len & 0xff, eeprom ? 'E' : 0);
+    // the bootloader checks the padding of the last frame is zero
+    for (int i=0; i<len; i+=4) {
+        uint8_t b[4] = { 0, 0, 0, 0 };
+        memcpy(b, data + i, len - i < 4 ? len - i : 4);
+        spi_boot_frame(&frames, b[0], b[1], b[2], b[3]);
+    }
+    if (spi_boot_send(boot, &frames) != 0)
+        return -1;
+    // the reply to the header says how far the earlier pages have got
+    spi_boot_spm(boot, frames.rx[0]);
+    boot->stats.bytes_written += len;
+    boot->stats.writes++;
+    return 0;
+}
+
+/*-----------------------------------------------------------------------*/
+
+// write len bytes at byte address addr
+int spi_boot_write(spi_boot_t * boot, uint32_t addr, const uint8_t * data,
+                   int len, int eeprom)
+{
+    return spi_boot_write_at(boot, addr, data, len, eeprom, 1);
+}
+
+/*-----------------------------------------------------------------------*/
+
+// the reply to each data frame is the next 4 bytes, the bootloader
+// reads them while the previous frame is on the bus
+int spi_boot_read(spi_boot_t * boot, uint32_t addr, uint8_t * data,
+                  int len, int eeprom)
+{
+    spi_boot_frames_t frames = { 0 };
+
+    if (len <= 0 || len > SPI_BOOT_MAX_WRITE)
+        return -1;
+    if (spi_boot_address_frame(&frames, addr, eeprom) != 0)
+        return -1;
+    spi_boot_frame(&frames, 't', len >> 8, len & 0xff, eeprom ? 'E' : 0);
+    for (int i=0; i<len; i+=4)
+        spi_boot_frame(&frames, 0, 0, 0, 0);
+    if (spi_boot_send(boot, &frames) != 0)
+        return -1;
+    for (int i=0; i<len; i+=4)
+        memcpy(data + i, frames.rx[2 + i / 4], len - i < 4 ? len - i : 4);
+    boot->stats.bytes_read += len;
+    return 0;
+}
+
+/*-----------------------------------------------------------------------*/
+
+// the bootloader resets through the watchdog, no ready signal follows
+int spi_boot_quit(spi_boot_t * boot)
+{
+    uint8_t tx[4] = { 'Q', 0, 0, 0 };
+    uint8_t rx[4];
+    if (spi_boot_txn(boot, tx, rx) != 0)
+        return -1;
+    // the bootloader finishes the last page before it resets
+    spi_boot_spm(boot, rx);
+    return 0;
+}
+
+/*-----------------------------------------------------------------------*/
+
+static uint32_t
+spi_boot_le(const uint8_t * b, int len)
+{
+    uint32_t v = 0;
+    while (len--)
+        v = (v << 8) | b[len];
+    return v;
+}
+
+/*-----------------------------------------------------------------------*/
+
+// the reply to the transaction after 's' says how many bytes of counters
+// follow, a bootloader built without them doesn't answer
+int spi_boot_device_stats(spi_boot_t * boot, spi_boot_device_stats_t * stats,
+                          int clear)
+{
+    uint8_t tx[4] = { 's', clear ? 'C' : 0, 0, 0 };
+    uint8_t zero[4] = { 0, 0, 0, 0 };
+    uint8_t rx[4];
+    uint8_t buf[64];
+
+    if (spi_boot_txn(boot, tx, NULL) != 0 || spi_boot_txn(boot, zero, rx) != 0)
+        return -1;
+    if (rx[0] != 's') {
+        fprintf(stderr, "no counters, the bootloader was built without BOOTLOADER_STATS\n");
+        return -1;
+    }
+    int len = rx[2];
+    if (rx[1] != SPI_BOOT_STATS_VERSION || len < 28 || len > (int)sizeof(buf)) {
+        fprintf(stderr, "unknown counters version %d, %d bytes\n", rx[1], len);
+        // still clock them out, the bootloader is waiting to send them
+        for (int i=0; i<len; i+=4)
+            spi_boot_txn(boot, zero, NULL);
+        return -1;
+    }
+    for (int i=0; i<len; i+=4)
+        if (spi_boot_txn(boot, zero, buf + i) != 0)
+            return -1;
+    stats->txns = spi_boot_le(buf, 4);
+    stats->wcol = spi_boot_le(buf + 4, 2);
+    stats->timeouts = spi_boot_le(buf + 6, 2);
+    stats->pages_written = spi_boot_le(buf + 8, 2);
+    stats->pages_skipped = spi_boot_le(buf + 10, 2);
+    stats->sessions = spi_boot_le(buf + 12, 2);
+    stats->erase_ticks = spi_boot_le(buf + 16, 4);
+    stats->write_ticks = spi_boot_le(buf + 20, 4);
+    stats->wait_ticks = spi_boot_le(buf + 24, 4);
+    return 0;
+}
+
+/*-----------------------------------------------------------------------*/
+
+int spi_boot_memory(spi_boot_t * boot, spi_boot_memory_t * mem)
+{
+    spi_boot_frames_t frames = { 0 };
+
+    spi_boot_frame(&frames, 'm', 0, 0, 0);
+    spi_boot_frame(&frames, 0, 0, 0, 0);
+    if (spi_boot_send(boot, &frames) != 0)
+        return -1;
+    uint8_t * rx = frames.rx[1];
+    if (rx[0] != 'm') {
+        fprintf(stderr, "no sram report, the bootloader was built without BOOTLOADER_SRAM_PAINT\n");
+        return -1;
+    }
+    mem->unused = spi_boot_le(rx + 1, 2);
+    // only a bootloader that answered gets the second transaction
+    frames.count = 0;
+    spi_boot_frame(&frames, 0, 0, 0, 0);
+    if (spi_boot_send(boot, &frames) != 0)
+        return -1;
+    mem->stack = spi_boot_le(frames.rx[0], 2);
+    mem->ram_end = spi_boot_le(frames.rx[0] + 2, 2);
+    return 0;
+}
+
+/*-----------------------------------------------------------------------*/
+
+// avr-libc's _crc16_update, polynomial 0xa001, the bootloader starts
+// from 0xffff
+uint16_t spi_boot_crc16(uint16_t crc, const uint8_t * data, int len)
+{
+    for (int i=0; i<len; i++) {
+        crc ^= data[i];
+        for (int b=0; b<8; b++)
+            crc = crc & 1 ? (crc >> 1) ^ 0xa001 : crc >> 1;
+    }
+    return crc;
+}
+
+/*-----------------------------------------------------------------------*/
+
+int spi_boot_ab_status(spi_boot_t * boot, spi_boot_ab_t * ab)
+{
+    spi_boot_frames_t frames = { 0 };
+
+    spi_boot_frame(&frames, 'a', 0, 0, 0);
+    spi_boot_frame(&frames, 0, 0, 0, 0);
+    if (spi_boot_send(boot, &frames) != 0)
+        return -1;
+    uint8_t * rx = frames.rx[1];
+    if (rx[0] != 'a') {
+        fprintf(stderr, "no A/B state, the bootloader was built without BOOTLOADER_AB\n");
+        return -1;
+    }
+    ab->state = rx[1];
+    ab->attempts = rx[2];
+    frames.count = 0;
+    spi_boot_frame(&frames, 0, 0, 0, 0);
+    if (spi_boot_send(boot, &frames) != 0)
+        return -1;
+    ab->slot_b = spi_boot_le(frames.rx[0], 2);
+    ab->pages = spi_boot_le(frames.rx[0] + 2, 2);
+    return 0;
+}
+
+/*-----------------------------------------------------------------------*/
+
+const char * spi_boot_ab_state(uint8_t state)
+{
+    switch (state) {
+    case SPI_BOOT_AB_IDLE: return "idle";
+    case SPI_BOOT_AB_PENDING: return "pending";
+    case SPI_BOOT_AB_SWAPPING: return "swapping";
+    case SPI_BOOT_AB_TRIAL: return "trial";
+    case SPI_BOOT_AB_CONFIRMED: return "confirmed";
+    case SPI_BOOT_AB_ROLLBACK: return "rollback";
+    case SPI_BOOT_AB_ROLLED_BACK: return "rolled back";
+    }
+    return "unknown";
+}
+
+/*-----------------------------------------------------------------------*/
+
+// crc of the first pages of slot A or B
+int spi_boot_crc(spi_boot_t * boot, int slot_b, uint16_t pages, uint16_t * crc)
+{
+    spi_boot_frames_t frames = { 0 };
+
+    spi_boot_frame(&frames, 'c', pages & 0xff, pages >> 8, slot_b ? 'B' : 'A');
+    spi_boot_frame(&frames, 0, 0, 0, 0);
+    if (spi_boot_send(boot, &frames) != 0)
+        return -1;
+    if (frames.rx[1][0] != 'c') {
+        fprintf(stderr, "no crc, the bootloader was built without BOOTLOADER_AB\n");
+        return -1;
+    }
+    if (frames.rx[1][3] == 'N') {
+        fprintf(stderr, "no crc, %u pages is more than the slot holds\n", pages);
+        return -1;
+    }
+    *crc = spi_boot_le(frames.rx[1] + 1, 2);
+    return 0;
+}
+
+/*-----------------------------------------------------------------------*/
+
+// swap the image in slot B in at the next reset, the bootloader checks
+// the crc first, returns 1 if it doesn't match
+int spi_boot_ab_commit(spi_boot_t * boot, uint16_t pages, uint16_t crc,
+                       uint8_t attempts)
+{
+    spi_boot_frames_t frames = { 0 };
+
+    spi_boot_frame(&frames, 'k', pages & 0xff, pages >> 8, attempts);
+    spi_boot_frame(&frames, crc & 0xff, crc >> 8, 0, 0);
+    spi_boot_frame(&frames, 0, 0, 0, 0);
+    if (spi_boot_send(boot, &frames) != 0)
+        return -1;
+    uint8_t * rx = frames.rx[2];
+    if (rx[0] != 'k') {
+        fprintf(stderr, "no commit, the bootloader was built without BOOTLOADER_AB\n");
+        return -1;
+    }
+    if (rx[1] != 'Y') {
+        fprintf(stderr, "slot B crc is %04x, expected %04x\n",
+                (unsigned)spi_boot_le(rx + 2, 2), crc);
+        return 1;
+    }
+    return 0;
+}
+
+/*-----------------------------------------------------------------------*/
+
+// copy slot B back over slot A at the next reset, returns 1 if there is
+// no old image to go back to
+int spi_boot_ab_rollback(spi_boot_t * boot)
+{
+    spi_boot_frames_t frames = { 0 };
+
+    spi_boot_frame(&frames, 'r', 0, 0, 0);
+    spi_boot_frame(&frames, 0, 0, 0, 0);
+    if (spi_boot_send(boot, &frames) != 0)
+        return -1;
+    uint8_t * rx = frames.rx[1];
+    if (rx[0] != 'r') {
+        fprintf(stderr, "no rollback, the bootloader was built without BOOTLOADER_AB\n");
+        return -1;
+    }
+    return rx[1] == 'Y' ? 0 : 1;
+}
+
+/*-----------------------------------------------------------------------*/
+
+// where the time went on the device: waiting on the host and the bus,
+// or programming the flash
+void spi_boot_device_report(const spi_boot_device_stats_t * stats, FILE * out,
+                            uint32_t freq)
+{
+    double ms = 1e3 * SPI_BOOT_STATS_TICK / freq;
+
+    fprintf(out, "device: %u transactions, %u WCOL, %u timeouts, %u sessions\n",
+            stats->txns, stats->wcol, stats->timeouts, stats->sessions);
+    fprintf(out, "device: %u pages written, %u unchanged and skipped\n",
+            stats->pages_written, stats->pages_skipped);
+    fprintf(out, "device: %.1f ms erasing, %.1f ms writing, %.1f ms waiting for the host\n",
+            stats->erase_ticks * ms, stats->write_ticks * ms, stats->wait_ticks * ms);
+    if (stats->pages_written)
+        fprintf(out, "device: %.2f ms erase and %.2f ms write per page\n",
+                stats->erase_ticks * ms / stats->pages_written,
+                stats->write_ticks * ms / stats->pages_written);
+}
+
+/*-----------------------------------------------------------------------*/
+
+// the planned page writes, the next page is built while the bootloader
+// programs the last one
+int spi_boot_write_plan(spi_boot_t * boot, const page_plan_t * plan)
+{
+    for (int i=0; i<plan->count; i++) {
+        const page_write_t * w = &plan->writes[i];
+        if (boot->verbose)
+            printf("flash page 0x%05x, %u bytes from 0x%05x\n",
+                   w->page, w->length, w->addr);
+        if (spi_boot_write_at(boot, w->addr, w->data, w->length, 0,
+                              w->set_address) != 0)
+            return -1;
+    }
+    return 0;
+}
+
+/*-----------------------------------------------------------------------*/
+
+// eeprom is written byte by byte, in chunks from even addresses, a
+// chunk with an odd start or end reads the byte it doesn't have
+static int
+spi_boot_write_eeprom(spi_boot_t * boot, const ihex_image_t * image)
+{
+    uint8_t buf[SPI_BOOT_MAX_WRITE];
+    uint32_t size = SPI_BOOT_MAX_WRITE;
+
+    for (int i=0; i<image->count; i++) {
+        const ihex_segment_t * seg = &image->segments[i];
+        uint32_t start = seg->addr & ~1u;
+        uint32_t end = (seg->addr + seg->length + 1) & ~1u;
+        for (uint32_t addr = start; addr < end; addr += size) {
+            uint32_t len = end - addr < size ? end - addr : size;
+            if ((uint32_t)ihex_fill(image, addr, buf, len) != len &&
+                spi_boot_read(boot, addr, buf, len, 1) != 0)
+                return -1;
+            ihex_fill(image, addr, buf, len);
+            if (boot->verbose)
+                printf("eeprom 0x%04x, %u bytes\n", addr, len);
+            if (spi_boot_write(boot, addr, buf, len, 1) != 0)
+                return -1;
+        }
+    }
+    return 0;
+}
+
+/*-----------------------------------------------------------------------*/
+
+int spi_boot_write_image(spi_boot_t * boot, const ihex_image_t * image, int eeprom)
+{
+    page_plan_t plan;
+    boot_caps_t caps;
+
+    if (eeprom)
+        return spi_boot_write_eeprom(boot, image);
+    // nothing known about the flash, partial pages are padded with 0xff
+    boot_caps_defaults(&caps);
+    caps.page_size = boot->page_size;
+    if (page_plan_build(&plan, image, &caps, NULL, 0) != 0)
+        return -1;
+    int res = spi_boot_write_plan(boot, &plan);
+    page_plan_free(&plan);
+    return res;
+}
+
+/*-----------------------------------------------------------------------*/
+
+// read back the bytes of the image, after all the writes so verifying
+// doesn't hold up the programming
+int spi_boot_verify_image(spi_boot_t * boot, const ihex_image_t * image, int eeprom)
+{
+    uint8_t buf[SPI_BOOT_MAX_WRITE];
+    int errors = 0;
+
+    for (int i=0; i<image->count; i++) {
+        const ihex_segment_t * seg = &image->segments[i];
+        uint32_t start = seg->addr & ~1u;
+        uint32_t end = seg->addr + seg->length;
+        for (uint32_t addr = start; addr < end; addr += sizeof(buf)) {
+            uint32_t len = end - addr < sizeof(buf) ? end - addr : sizeof(buf);
+            if (spi_boot_read(boot, addr, buf, len, eeprom) != 0)
+                return -1;
+            for (uint32_t j=0; j<len; j++) {
+                uint32_t a = addr + j;
+                if (a < seg->addr || buf[j] == seg->data[a - seg->addr])
+                    continue;
+                if (errors++ < 10)
+                    fprintf(stderr, "verify: 0x%05x is 0x%02x, expected 0x%02x\n",
+                            a, buf[j], seg->data[a - seg->addr]);
+            }
+        }
+    }
+    if (errors)
+        fprintf(stderr, "verify: %d bytes differ\n", errors);
+    return errors ? -1 : 0;
+}
+
+/*-----------------------------------------------------------------------*/
+
+void spi_boot_report(spi_boot_t * boot, FILE * out, double elapsed)
+{
+    spi_boot_stats_t * s = &boot->stats;
+
+    fprintf(out, "%lu transactions, %lu writes, %lu bytes written, %lu bytes read in %.3f s\n",
+            s->txns, s->writes, s->bytes_written, s->bytes_read, elapsed);
+    if (elapsed > 0)
+        fprintf(out, "throughput %.0f bytes/s written, %.0f transactions/s\n",
+                s->bytes_written / elapsed, s->txns / elapsed);
+    if (s->txns)
+        fprintf(out, "per transaction %.1f us waiting for ready (max %.1f us), %.1f us on the bus\n",
+                s->ready_wait / s->txns * 1e6, s->max_ready_wait * 1e6,
+                s->bus / s->txns * 1e6);
+    if (boot->spm.queued)
+        fprintf(out, "bootloader had written %u of %u pages at the last command\n",
+                boot->spm.done, boot->spm.queued);
+}
@@ -0,0 +1,162 @@
+/*
+	spi_boot.h
+    Copyright 2021 Greg Green <ggreen@bit-builder.com>
+
+ 	This file is part of avr_bootloaders.
+    Host side of the atmega_spi_bootloader protocol, see README.md
+ */
+
+#ifndef SPI_BOOT_H_
+#define SPI_BOOT_H_
+
+#include <stdint.h>
+#include <stdio.h>
+#include "spi_transport.h"
+#include "ihex.h"
+#include "page_plan.h"
+
+/*-----------------------------------------------------------------------*/
+
+// flash page of the atmega328p in bytes, PAGE_SIZE words in the bootloader
+#define SPI_BOOT_PAGE_SIZE 128
+// most the bootloader buffers for one write
+#define SPI_BOOT_MAX_WRITE 256
+// covers the LED flashes after a reset and a page erase and write
+#define SPI_BOOT_READY_TIMEOUT_MS 2000
+
+/*-----------------------------------------------------------------------*/
+
+typedef struct spi_boot_stats
+{
+    unsigned long txns;
+    unsigned long bytes_written;
+    unsigned long bytes_read;
+    unsigned long writes;
+    // seconds waiting for BUTTON and clocking the bus
+    double ready_wait;
+    double bus;
+    // longest wait for BUTTON, a page erase and write
+    double max_ready_wait;
+} spi_boot_stats_t;
+
+/*-----------------------------------------------------------------------*/
+
+// the bootloader's own counters, 's' command of a BOOTLOADER_STATS
+// build, times are in Timer1 ticks of SPI_BOOT_STATS_TICK cycles
+#define SPI_BOOT_STATS_VERSION 1
+#define SPI_BOOT_STATS_TICK 256
+
+typedef struct spi_boot_device_stats
+{
+    uint32_t txns;
+    uint16_t wcol;
+    uint16_t timeouts;
+    uint16_t pages_written;
+    uint16_t pages_skipped;
+    uint16_t sessions;
+    uint32_t erase_ticks;
+    uint32_t write_ticks;
+    uint32_t wait_ticks;
+} spi_boot_device_stats_t;
+
+// SRAM use of an SRAM_PAINT build, 'm' command
+typedef struct spi_boot_memory
+{
+    uint16_t unused;        // bytes above the globals never touched
+    uint16_t stack;         // deepest the stack has been
+    uint16_t ram_end;       // end of the globals, _end
+} spi_boot_memory_t;
+
+// A/B slots of a BOOTLOADER_AB build, 'a' command, the states are the
+// BOOT_AB_ ones of bootloaders/boot_api.h
+#define SPI_BOOT_AB_IDLE 0xff
+#define SPI_BOOT_AB_PENDING 1
+#define SPI_BOOT_AB_SWAPPING 2
+#define SPI_BOOT_AB_TRIAL 3
+#define SPI_BOOT_AB_CONFIRMED 4
+#define SPI_BOOT_AB_ROLLBACK 5
+#define SPI_BOOT_AB_ROLLED_BACK 6
+
+typedef struct spi_boot_ab
+{
+    uint8_t state;
+    uint8_t attempts;       // unconfirmed starts left before a rollback
+    uint16_t slot_b;        // byte address of slot B, also the slot size
+    uint16_t pages;         // pages of the last committed image
+} spi_boot_ab_t;
+
+/*-----------------------------------------------------------------------*/
+
+// the reply to the first transaction of every command, the bootloader
+// writes flash pages in the background and counts them
+typedef struct spi_boot_spm
+{
+    uint8_t state;          // 0 idle, 1 erasing, 2 writing
+    uint8_t queued;         // pages started, mod 256
+    uint8_t done;           // pages written
+} spi_boot_spm_t;
+
+typedef struct spi_boot
+{
+    spi_transport_t * transport;
+    int ready_timeout_ms;
+    int page_size;
+    int verbose;
+    spi_boot_stats_t stats;
+    spi_boot_spm_t spm;
+} spi_boot_t;
+
+/*-----------------------------------------------------------------------*/
+
+extern void spi_boot_init(spi_boot_t * boot, spi_transport_t * transport);
+
+extern double spi_boot_now(void);
+
+extern int spi_boot_txn(spi_boot_t * boot, const uint8_t * tx, uint8_t * rx);
+
+extern int spi_boot_hello(spi_boot_t * boot);
+
+extern int spi_boot_signature(spi_boot_t * boot, uint8_t * sig);
+
+extern int spi_boot_set_address(spi_boot_t * boot, uint16_t word);
+
+extern int spi_boot_write(spi_boot_t * boot, uint32_t addr, const uint8_t * data,
+                          int len, int eeprom);
+
+extern int spi_boot_read(spi_boot_t * boot, uint32_t addr, uint8_t * data,
+                         int len, int eeprom);
+
+extern int spi_boot_quit(spi_boot_t * boot);
+
+extern int spi_boot_device_stats(spi_boot_t * boot, spi_boot_device_stats_t * stats,
+                                 int clear);
+
+extern int spi_boot_memory(spi_boot_t * boot, spi_boot_memory_t * mem);
+
+extern void spi_boot_device_report(const spi_boot_device_stats_t * stats, FILE * out,
+                                   uint32_t freq);
+
+extern uint16_t spi_boot_crc16(uint16_t crc, const uint8_t * data, int len);
+
+extern int spi_boot_ab_status(spi_boot_t * boot, spi_boot_ab_t * ab);
+
+extern const char * spi_boot_ab_state(uint8_t state);
+
+extern int spi_boot_crc(spi_boot_t * boot, int slot_b, uint16_t pages, uint16_t * crc);
+
+extern int spi_boot_ab_commit(spi_boot_t * boot, uint16_t pages, uint16_t crc,
+                              uint8_t attempts);
+
+extern int spi_boot_ab_rollback(spi_boot_t * boot);
+
+extern int spi_boot_write_plan(spi_boot_t * boot, const page_plan_t * plan);
+
+extern int spi_boot_write_image(spi_boot_t * boot, const ihex_image_t * image, int eeprom);
+
+extern int spi_boot_verify_image(spi_boot_t * boot, const ihex_image_t * image, int eeprom);
+
+extern void spi_boot_report(spi_boot_t * boot, FILE * out, double elapsed);
+
+/*-----------------------------------------------------------------------*/
+
+#endif // SPI_BOOT_H_
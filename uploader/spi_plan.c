@@ -0,0 +1,109 @@
+/*
+	spi_plan.c
+
+    Copyright 2021 Greg Green <ggreen@bit-builder.com>
+
+ 	This file is part of avr_bootloaders.
+    Plans the page writes of a hex file and prints them as a transaction
+    script for tst_atmega_spi_bootloader
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+
+#include "ihex.h"
+#include "page_plan.h"
+
+/*-----------------------------------------------------------------------*/
+
+static void
+usage(const char * name)
+{
+    fprintf(stderr,
+            "usage: %s [-V] [-w] [-p page_size] [-F flash.bin] [-c start_cycle]\n"
+            "       [-o script.txt] file.hex\n", name);
+    exit(1);
+}
+
+/*-----------------------------------------------------------------------*/
+
+int main(int argc, char *argv[])
+{
+    const char * hex_path = NULL;
+    const char * flash_path = NULL;
+    const char * out_path = NULL;
+    unsigned long start_cycle = 3000000;
+    int verify = 0;
+    boot_caps_t caps;
+
+    boot_caps_defaults(&caps);
+    for (int i = 1; i < argc; i++) {
+        if (!strcmp(argv[i], "-V"))
+            verify = 1;
+        else if (!strcmp(argv[i], "-w"))
+            caps.partial_page = 0;
+        else if (!strcmp(argv[i], "-a")) {
+            // a plan without the 'U' before each page would write the
+            // pages after the first over it
+            fprintf(stderr, "-a: atmega_spi_bootloader doesn't move the address on after a write\n");
+            exit(1);
+        }
+        else if (!strcmp(argv[i], "-p") && i + 1 < argc)
+            caps.page_size = atoi(argv[++i]);
+        else if (!strcmp(argv[i], "-F") && i + 1 < argc)
+            flash_path = argv[++i];
+        else if (!strcmp(argv[i], "-c") && i + 1 < argc)
+            start_cycle = strtoul(argv[++i], NULL, 0);
+        else if (!strcmp(argv[i], "-o") && i + 1 < argc)
+            out_path = argv[++i];
+        else if (strlen(argv[i]) > 4 && !strcmp(argv[i] + strlen(argv[i]) - 4, ".hex"))
+            hex_path = argv[i];
+        else
+            usage(argv[0]);
+    }
+    if (hex_path == NULL)
+        usage(argv[0]);
+
+    ihex_image_t image;
+    if (ihex_read(hex_path, &image) != 0)
+        exit(1);
+
+    uint8_t * flash = NULL;
+    long flash_size = 0;
+    if (flash_path != NULL) {
+        FILE * f = fopen(flash_path, "rb");
+        if (f == NULL) {
+            perror(flash_path);
+            exit(1);
+        }
+        fseek(f, 0, SEEK_END);
+        flash_size = ftell(f);
+        fseek(f, 0, SEEK_SET);
+        flash = malloc(flash_size > 0 ? flash_size : 1);
+        if (flash_size <= 0 || fread(flash, 1, flash_size, f) != (size_t)flash_size) {
+            fprintf(stderr, "%s: unable to read\n", flash_path);
+            exit(1);
+        }
+        fclose(f);
+    }
+
+    page_plan_t plan;
+    if (page_plan_build(&plan, &image, &caps, flash, flash_size) != 0)
+        exit(1);
+    page_plan_report(&plan, stderr);
+
+    FILE * out = stdout;
+    if (out_path != NULL && (out = fopen(out_path, "w")) == NULL) {
+        perror(out_path);
+        exit(1);
+    }
+    page_plan_script(&plan, out, start_cycle, verify);
+    if (out != stdout)
+        fclose(out);
+
+    page_plan_free(&plan);
+    free(flash);
+    ihex_free(&image);
+    return 0;
+}
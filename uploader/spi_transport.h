@@ -0,0 +1,58 @@
+/*
+	spi_transport.h
+    Copyright 2021 Greg Green <ggreen@bit-builder.com>
+
+ 	This file is part of avr_bootloaders.
+    How the uploader reaches the bootloader: clocking bytes over spi and
+    waiting for the ready signal on BUTTON
+ */
+
+#ifndef SPI_TRANSPORT_H_
+#define SPI_TRANSPORT_H_
+
+#include <stdint.h>
+
+/*-----------------------------------------------------------------------*/
+
+#define SPI_TRANSPORT_READY 0
+#define SPI_TRANSPORT_TIMEOUT 1
+#define SPI_TRANSPORT_ERROR -1
+
+/*-----------------------------------------------------------------------*/
+
+typedef struct spi_transport
+{
+    const char * name;
+    // block until the bootloader signals ready, SPI_TRANSPORT_READY, SPI_TRANSPORT_TIMEOUT
+    // or SPI_TRANSPORT_ERROR
+    int (*wait_ready)(struct spi_transport * t, int timeout_ms);
+    // clock len bytes out of tx, the bootloader's bytes into rx
+    int (*transfer)(struct spi_transport * t, const uint8_t * tx, uint8_t * rx, int len);
+    // drive MCU_RUNNING, if the transport has it
+    int (*set_running)(struct spi_transport * t, int value);
+    void (*close)(struct spi_transport * t);
+    void * priv;
+} spi_transport_t;
+
+/*-----------------------------------------------------------------------*/
+
+typedef struct spi_spidev_config
+{
+    const char * device;        // /dev/spidevB.C
+    uint32_t speed_hz;
+    // delay between the bytes of a transaction
+    uint16_t byte_delay_us;
+    const char * gpiochip;      // /dev/gpiochipN
+    int button_line;            // BUTTON, falling edge is ready
+    int running_line;           // MCU_RUNNING, not driven if < 0
+} spi_spidev_config_t;
+
+/*-----------------------------------------------------------------------*/
+
+extern spi_transport_t * spi_transport_spidev_open(const spi_spidev_config_t * config);
+
+extern spi_transport_t * spi_transport_sim_open(const char * path);
+
+/*-----------------------------------------------------------------------*/
+
+#endif // SPI_TRANSPORT_H_
@@ -0,0 +1,341 @@
+/*
+	spi_upload.c
+
+    Copyright 2021 Greg Green <ggreen@bit-builder.com>
+
+ 	This file is part of avr_bootloaders.
+    Loads a hex file through atmega_spi_bootloader, from a Raspberry Pi
+    spidev or into the simulator
+ */
+
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+
+#include "ihex.h"
+#include "spi_transport.h"
+#include "spi_boot.h"
+#include "page_plan.h"
+
+/*-----------------------------------------------------------------------*/
+
+static void
+usage(const char * name)
+{
+    fprintf(stderr,
+            "usage: %s [-v] [-e] [-V] [-n] [-i] [-m] [-f freq] [-t ms] [-D /dev/spidevB.C] [-s hz] [-g us]\n"
+            "       [-c /dev/gpiochipN] -b button_line [-r running_line]\n"
+            "       [-p page_size] [-F flash.bin | -P] [-a] [-B attempts] file.hex\n"
+            "       %s [-v] [-e] [-V] [-n] [-i] [-m] [-f freq] [-t ms] [-p page_size] [-F flash.bin | -P]\n"
+            "       [-a] [-B attempts] -S socket file.hex\n"
+            "       add -R instead of the hex file to roll back to the image in slot B\n",
+            name, name);
+    exit(1);
+}
+
+/*-----------------------------------------------------------------------*/
+
+// the flash contents from a file, like a simulator flash file
+static int
+read_flash(const char * path, uint8_t ** flash, uint32_t * size)
+{
+    FILE * f = fopen(path, "rb");
+    if (f == NULL) {
+        perror(path);
+        return -1;
+    }
+    fseek(f, 0, SEEK_END);
+    long len = ftell(f);
+    fseek(f, 0, SEEK_SET);
+    *flash = malloc(len > 0 ? len : 1);
+    *size = len > 0 && fread(*flash, 1, len, f) == (size_t)len ? len : 0;
+    fclose(f);
+    if (*size == 0) {
+        fprintf(stderr, "%s: unable to read\n", path);
+        free(*flash);
+        *flash = NULL;
+        return -1;
+    }
+    return 0;
+}
+
+/*-----------------------------------------------------------------------*/
+
+// read the pages the image only partly covers from the bootloader, for
+// page_plan_build_partial, the rest of the flash isn't known
+static int
+read_partial(spi_boot_t * boot, const ihex_image_t * image, const boot_caps_t * caps,
+             uint8_t ** flash, uint32_t * size)
+{
+    if (image->count == 0)
+        return 0;
+    const ihex_segment_t * last = &image->segments[image->count - 1];
+    uint32_t end = last->addr + last->length;
+
+    *size = end + caps->page_size - end % caps->page_size;
+    *flash = malloc(*size);
+    memset(*flash, 0xff, *size);
+    int count = page_plan_partial(image, caps, NULL, 0);
+    uint32_t * pages = malloc(count * sizeof(uint32_t));
+    page_plan_partial(image, caps, pages, count);
+    for (int i=0; i<count; i++) {
+        if (spi_boot_read(boot, pages[i], *flash + pages[i], caps->page_size, 0) != 0) {
+            free(pages);
+            return -1;
+        }
+    }
+    free(pages);
+    if (boot->verbose)
+        printf("read %d partly covered pages\n", count);
+    return 0;
+}
+
+/*-----------------------------------------------------------------------*/
+
+// write the image into slot B, every page up to the end of the image,
+// and commit it with its crc to be swapped in at the next reset
+static int
+write_slot(spi_boot_t * boot, const ihex_image_t * image, const boot_caps_t * caps,
+           uint8_t attempts)
+{
+    spi_boot_ab_t ab;
+    if (image->count == 0 || spi_boot_ab_status(boot, &ab) != 0)
+        return -1;
+    const ihex_segment_t * last = &image->segments[image->count - 1];
+    uint32_t end = last->addr + last->length;
+    uint16_t pages = (end + caps->page_size - 1) / caps->page_size;
+    uint32_t len = pages * caps->page_size;
+    if (len > ab.slot_b) {
+        fprintf(stderr, "%u bytes don't fit in the %u byte slot\n", len, ab.slot_b);
+        return -1;
+    }
+
+    // the whole slot with the gaps erased, to write and for the crc
+    uint8_t * data = malloc(len);
+    memset(data, 0xff, len);
+    ihex_fill(image, 0, data, len);
+    uint16_t crc = spi_boot_crc16(0xffff, data, len);
+    // what slot B holds isn't known, planned against the complement every
+    // page is written, the erased ones included
+    uint8_t * flash = malloc(ab.slot_b + len);
+    for (uint32_t i=0; i<len; i++)
+        flash[ab.slot_b + i] = ~data[i];
+    ihex_segment_t seg = { .addr = ab.slot_b, .length = len, .data = data };
+    ihex_image_t slot = { .count = 1, .segments = &seg };
+
+    page_plan_t plan;
+    int r = page_plan_build(&plan, &slot, caps, flash, ab.slot_b + len);
+    if (r == 0) {
+        page_plan_report(&plan, stdout);
+        r = spi_boot_write_plan(boot, &plan);
+        page_plan_free(&plan);
+    }
+    if (r == 0)
+        r = spi_boot_ab_commit(boot, pages, crc, attempts);
+    if (r == 0)
+        printf("slot B at 0x%04x: %u pages, crc %04x, swapped in at reset with %u attempts\n",
+               ab.slot_b, pages, crc, attempts);
+    free(flash);
+    free(data);
+    return r != 0 ? -1 : 0;
+}
+
+/*-----------------------------------------------------------------------*/
+
+int main(int argc, char *argv[])
+{
+    spi_spidev_config_t spidev = {
+        .device = "/dev/spidev0.0",
+        .speed_hz = 500000,
+        .byte_delay_us = 0,
+        .gpiochip = "/dev/gpiochip0",
+        .button_line = -1,
+        .running_line = -1,
+    };
+    const char * socket_path = NULL;
+    const char * hex_path = NULL;
+    int verbose = 0;
+    int eeprom = 0;
+    int verify = 0;
+    int quit = 1;
+    int timeout_ms = SPI_BOOT_READY_TIMEOUT_MS;
+    const char * flash_path = NULL;
+    int pad = 0;
+    int device_stats = 0;
+    int memory = 0;
+    int ab_status = 0;
+    int slot_attempts = -1;
+    int rollback = 0;
+    uint32_t freq = 8000000;
+    boot_caps_t caps;
+
+    boot_caps_defaults(&caps);
+
+    for (int i = 1; i < argc; i++) {
+        if (!strcmp(argv[i], "-v"))
+            verbose++;
+        else if (!strcmp(argv[i], "-e"))
+            eeprom = 1;
+        else if (!strcmp(argv[i], "-V"))
+            verify = 1;
+        else if (!strcmp(argv[i], "-n"))
+            quit = 0;
+        else if (!strcmp(argv[i], "-t") && i + 1 < argc)
+            timeout_ms = atoi(argv[++i]);
+        else if (!strcmp(argv[i], "-D") && i + 1 < argc)
+            spidev.device = argv[++i];
+        else if (!strcmp(argv[i], "-s") && i + 1 < argc)
+            spidev.speed_hz = strtoul(argv[++i], NULL, 0);
+        else if (!strcmp(argv[i], "-g") && i + 1 < argc)
+            spidev.byte_delay_us = atoi(argv[++i]);
+        else if (!strcmp(argv[i], "-c") && i + 1 < argc)
+            spidev.gpiochip = argv[++i];
+        else if (!strcmp(argv[i], "-b") && i + 1 < argc)
+            spidev.button_line = atoi(argv[++i]);
+        else if (!strcmp(argv[i], "-r") && i + 1 < argc)
+            spidev.running_line = atoi(argv[++i]);
+        else if (!strcmp(argv[i], "-i"))
+            device_stats = 1;
+        else if (!strcmp(argv[i], "-m"))
+            memory = 1;
+        else if (!strcmp(argv[i], "-f") && i + 1 < argc)
+            freq = strtoul(argv[++i], NULL, 0);
+        else if (!strcmp(argv[i], "-p") && i + 1 < argc)
+            caps.page_size = atoi(argv[++i]);
+        else if (!strcmp(argv[i], "-F") && i + 1 < argc)
+            flash_path = argv[++i];
+        else if (!strcmp(argv[i], "-P"))
+            pad = 1;
+        else if (!strcmp(argv[i], "-a"))
+            ab_status = 1;
+        else if (!strcmp(argv[i], "-B") && i + 1 < argc)
+            slot_attempts = atoi(argv[++i]);
+        else if (!strcmp(argv[i], "-R"))
+            rollback = 1;
+        else if (!strcmp(argv[i], "-S") && i + 1 < argc)
+            socket_path = argv[++i];
+        else if (strlen(argv[i]) > 4 && !strcmp(argv[i] + strlen(argv[i]) - 4, ".hex"))
+            hex_path = argv[i];
+        else
+            usage(argv[0]);
+    }
+    if ((hex_path == NULL) == !rollback || (socket_path == NULL && spidev.button_line < 0) ||
+        slot_attempts > 255 || (slot_attempts >= 0 && eeprom))
+        usage(argv[0]);
+
+    ihex_image_t image = { 0 };
+    if (hex_path != NULL) {
+        if (ihex_read(hex_path, &image) != 0)
+            exit(1);
+        printf("%s: %u bytes in %d segments\n", hex_path, ihex_size(&image), image.count);
+    }
+
+    // what the flash holds now, to pad partial pages and skip the ones
+    // that don't change
+    uint8_t * flash = NULL;
+    uint32_t flash_size = 0;
+    if (!eeprom && flash_path != NULL &&
+        read_flash(flash_path, &flash, &flash_size) != 0) {
+        ihex_free(&image);
+        exit(1);
+    }
+
+    spi_transport_t * t;
+    if (socket_path != NULL)
+        t = spi_transport_sim_open(socket_path);
+    else
+        t = spi_transport_spidev_open(&spidev);
+    if (t == NULL) {
+        ihex_free(&image);
+        exit(1);
+    }
+
+    spi_boot_t boot;
+    spi_boot_init(&boot, t);
+    boot.verbose = verbose;
+    boot.ready_timeout_ms = timeout_ms;
+
+    int res = 1;
+    uint8_t sig[3];
+    // MCU_RUNNING high keeps the avr in the bootloader after its reset
+    if (t->set_running(t, 1) != 0)
+        goto done;
+    double start = spi_boot_now();
+    if (spi_boot_hello(&boot) != 0 || spi_boot_signature(&boot, sig) != 0)
+        goto done;
+    printf("bootloader ready, signature %02x %02x %02x\n", sig[0], sig[1], sig[2]);
+
+    boot.page_size = caps.page_size;
+    spi_boot_ab_t ab;
+    if (ab_status) {
+        if (spi_boot_ab_status(&boot, &ab) != 0)
+            goto done;
+        printf("A/B: %s, %u attempts left, %u pages, slot B at 0x%04x\n",
+               spi_boot_ab_state(ab.state), ab.attempts, ab.pages, ab.slot_b);
+    }
+    double write_start = spi_boot_now();
+    if (rollback) {
+        int r = spi_boot_ab_rollback(&boot);
+        if (r != 0) {
+            if (r > 0)
+                fprintf(stderr, "no image in slot B to roll back to\n");
+            goto done;
+        }
+        printf("rolling back to slot B at reset\n");
+    } else if (slot_attempts >= 0) {
+        if (write_slot(&boot, &image, &caps, slot_attempts) != 0)
+            goto done;
+    } else if (eeprom) {
+        if (spi_boot_write_image(&boot, &image, 1) != 0)
+            goto done;
+    } else {
+        page_plan_t plan;
+        int r;
+        if (pad && flash == NULL) {
+            if (read_partial(&boot, &image, &caps, &flash, &flash_size) != 0)
+                goto done;
+            r = page_plan_build_partial(&plan, &image, &caps, flash, flash_size);
+        } else
+            r = page_plan_build(&plan, &image, &caps, flash, flash_size);
+        if (r != 0)
+            goto done;
+        page_plan_report(&plan, stdout);
+        r = spi_boot_write_plan(&boot, &plan);
+        page_plan_free(&plan);
+        if (r != 0)
+            goto done;
+    }
+    double write_end = spi_boot_now();
+    printf("wrote %lu bytes in %.3f s, %.0f bytes/s\n", boot.stats.bytes_written,
+           write_end - write_start,
+           boot.stats.bytes_written / (write_end - write_start));
+    // a slot write is checked by the bootloader's crc
+    if (verify && hex_path != NULL && slot_attempts < 0) {
+        if (spi_boot_verify_image(&boot, &image, eeprom) != 0)
+            goto done;
+        printf("verified %u bytes in %.3f s\n", ihex_size(&image),
+               spi_boot_now() - write_end);
+    }
+    // counters since power on, cleared for the next session
+    spi_boot_device_stats_t stats;
+    if (device_stats && spi_boot_device_stats(&boot, &stats, 1) == 0)
+        spi_boot_device_report(&stats, stdout, freq);
+    spi_boot_memory_t mem;
+    if (memory && spi_boot_memory(&boot, &mem) == 0)
+        printf("device: globals end at 0x%04x, deepest stack %u bytes, %u bytes never used\n",
+               mem.ram_end, mem.stack, mem.unused);
+    if (quit && spi_boot_quit(&boot) != 0)
+        goto done;
+    res = 0;
+    spi_boot_report(&boot, stdout, spi_boot_now() - start);
+
+done:
+    // back to the application, the bootloader waits 100ms after 'Q'
+    if (quit)
+        t->set_running(t, 0);
+    t->close(t);
+    free(flash);
+    ihex_free(&image);
+    return res;
+}
@@ -0,0 +1,132 @@
+/*
+	transport_sim.c
+
+    Copyright 2021 Greg Green <ggreen@bit-builder.com>
+
+ 	This file is part of avr_bootloaders.
+    The simulated bootloader served by tst_atmega_spi_bootloader -S, the
+    simulator sends SIM_READY when BUTTON goes low, and answers 4 bytes
+    with the 4 bytes the bootloader clocked out
+ */
+
+#include <unistd.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+
+#include "spi_transport.h"
+
+/*-----------------------------------------------------------------------*/
+
+// same as SIM_SOCKET_READY in tst/sim_socket.h
+#define SIM_READY 'R'
+
+/*-----------------------------------------------------------------------*/
+
+typedef struct sim_priv
+{
+    int fd;
+} sim_priv_t;
+
+/*-----------------------------------------------------------------------*/
+
+static int
+sim_read(int fd, uint8_t * buf, int len)
+{
+    while (len > 0) {
+        ssize_t n = read(fd, buf, len);
+        if (n <= 0)
+            return SPI_TRANSPORT_ERROR;
+        buf += n;
+        len -= n;
+    }
+    return 0;
+}
+
+/*-----------------------------------------------------------------------*/
+
+static int
+sim_wait_ready(spi_transport_t * t, int timeout_ms)
+{
+    sim_priv_t * priv = t->priv;
+    struct pollfd pfd = { .fd = priv->fd, .events = POLLIN };
+    uint8_t ready;
+
+    int r = poll(&pfd, 1, timeout_ms);
+    if (r < 0)
+        return SPI_TRANSPORT_ERROR;
+    if (r == 0)
+        return SPI_TRANSPORT_TIMEOUT;
+    if (sim_read(priv->fd, &ready, 1) != 0 || ready != SIM_READY) {
+        fprintf(stderr, "simulator closed the connection\n");
+        return SPI_TRANSPORT_ERROR;
+    }
+    return SPI_TRANSPORT_READY;
+}
+
+/*-----------------------------------------------------------------------*/
+
+static int
+sim_transfer(spi_transport_t * t, const uint8_t * tx, uint8_t * rx, int len)
+{
+    sim_priv_t * priv = t->priv;
+
+    if (send(priv->fd, tx, len, MSG_NOSIGNAL) != len)
+        return SPI_TRANSPORT_ERROR;
+    return sim_read(priv->fd, rx, len);
+}
+
+/*-----------------------------------------------------------------------*/
+
+// the simulator holds MCU_RUNNING high until the connection closes
+static int
+sim_set_running(spi_transport_t * t, int value)
+{
+    (void)t;
+    (void)value;
+    return 0;
+}
+
+/*-----------------------------------------------------------------------*/
+
+static void
+sim_close(spi_transport_t * t)
+{
+    sim_priv_t * priv = t->priv;
+
+    if (priv->fd >= 0)
+        close(priv->fd);
+    free(priv);
+    free(t);
+}
+
+/*-----------------------------------------------------------------------*/
+
+spi_transport_t * spi_transport_sim_open(const char * path)
+{
+    struct sockaddr_un addr;
+    spi_transport_t * t = calloc(1, sizeof(spi_transport_t));
+    sim_priv_t * priv = calloc(1, sizeof(sim_priv_t));
+
+    t->name = "sim";
+    t->wait_ready = sim_wait_ready;
+    t->transfer = sim_transfer;
+    t->set_running = sim_set_running;
+    t->close = sim_close;
+    t->priv = priv;
+
+    priv->fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, path, sizeof(addr.sun_path) - 1);
+    if (priv->fd < 0 ||
+        connect(priv->fd, (struct sockaddr *)&addr, sizeof(addr)) != 0) {
+        perror(path);
+        sim_close(t);
+        return NULL;
+    }
+    return t;
+}
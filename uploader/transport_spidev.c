@@ -0,0 +1,227 @@
+/*
+	transport_spidev.c
+
+    Copyright 2021 Greg Green <ggreen@bit-builder.com>
+
+ 	This file is part of avr_bootloaders.
+    Linux spidev for the bus and the gpio character device for BUTTON
+    and MCU_RUNNING
+ */
+
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <errno.h>
+#include <sys/ioctl.h>
+#include <linux/spi/spidev.h>
+#include <linux/gpio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+
+#include "spi_transport.h"
+
+/*-----------------------------------------------------------------------*/
+
+typedef struct spidev_priv
+{
+    spi_spidev_config_t config;
+    int spi_fd;
+    int button_fd;      // line event fd, falling edges of BUTTON
+    int running_fd;     // line handle fd, -1 if not driven
+} spidev_priv_t;
+
+/*-----------------------------------------------------------------------*/
+
+// the bootloader only holds BUTTON low until its poll loop comes round,
+// a few us, far too short to see by reading the level, so wait for the
+// kernel's falling edge event, which also catches an edge that came
+// before we started waiting
+static int
+spidev_wait_ready(spi_transport_t * t, int timeout_ms)
+{
+    spidev_priv_t * priv = t->priv;
+    struct pollfd pfd = { .fd = priv->button_fd, .events = POLLIN };
+    struct gpioevent_data event;
+
+    int r = poll(&pfd, 1, timeout_ms);
+    if (r < 0) {
+        perror("BUTTON");
+        return SPI_TRANSPORT_ERROR;
+    }
+    if (r == 0)
+        return SPI_TRANSPORT_TIMEOUT;
+    if (read(priv->button_fd, &event, sizeof(event)) != sizeof(event)) {
+        perror("BUTTON");
+        return SPI_TRANSPORT_ERROR;
+    }
+    return SPI_TRANSPORT_READY;
+}
+
+/*-----------------------------------------------------------------------*/
+
+// one ioctl per transaction, with CS held low across the bytes and the
+// byte delay between them
+static int
+spidev_transfer(spi_transport_t * t, const uint8_t * tx, uint8_t * rx, int len)
+{
+    spidev_priv_t * priv = t->priv;
+    struct spi_ioc_transfer xfer[8];
+    int n = 0;
+
+    if (priv->config.byte_delay_us == 0) {
+        memset(xfer, 0, sizeof(xfer[0]));
+        xfer[0].tx_buf = (unsigned long)tx;
+        xfer[0].rx_buf = (unsigned long)rx;
+        xfer[0].len = len;
+        xfer[0].speed_hz = priv->config.speed_hz;
+        xfer[0].bits_per_word = 8;
+        n = 1;
+    } else {
+        if (len > 8)
+            return SPI_TRANSPORT_ERROR;
+        memset(xfer, 0, len * sizeof(xfer[0]));
+        for (n=0; n<len; n++) {
+            xfer[n].tx_buf = (unsigned long)(tx + n);
+            xfer[n].rx_buf = (unsigned long)(rx + n);
+            xfer[n].len = 1;
+            xfer[n].speed_hz = priv->config.speed_hz;
+            xfer[n].bits_per_word = 8;
+            if (n + 1 < len)
+                xfer[n].delay_usecs = priv->config.byte_delay_us;
+        }
+    }
+    if (ioctl(priv->spi_fd, SPI_IOC_MESSAGE(n), xfer) < 0) {
+        perror(priv->config.device);
+        return SPI_TRANSPORT_ERROR;
+    }
+    return 0;
+}
+
+/*-----------------------------------------------------------------------*/
+
+static int
+spidev_set_running(spi_transport_t * t, int value)
+{
+    spidev_priv_t * priv = t->priv;
+    struct gpiohandle_data data;
+
+    if (priv->running_fd < 0)
+        return 0;
+    memset(&data, 0, sizeof(data));
+    data.values[0] = value;
+    if (ioctl(priv->running_fd, GPIOHANDLE_SET_LINE_VALUES_IOCTL, &data) < 0) {
+        perror("MCU_RUNNING");
+        return SPI_TRANSPORT_ERROR;
+    }
+    return 0;
+}
+
+/*-----------------------------------------------------------------------*/
+
+static void
+spidev_close(spi_transport_t * t)
+{
+    spidev_priv_t * priv = t->priv;
+
+    if (priv->running_fd >= 0)
+        close(priv->running_fd);
+    if (priv->button_fd >= 0)
+        close(priv->button_fd);
+    if (priv->spi_fd >= 0)
+        close(priv->spi_fd);
+    free(priv);
+    free(t);
+}
+
+/*-----------------------------------------------------------------------*/
+
+// request BUTTON for falling edge events and MCU_RUNNING as an output
+// driven low, the bootloader's default
+static int
+spidev_open_gpio(spidev_priv_t * priv)
+{
+    const spi_spidev_config_t * config = &priv->config;
+    int chip = open(config->gpiochip, O_RDWR);
+    if (chip < 0) {
+        perror(config->gpiochip);
+        return -1;
+    }
+
+    struct gpioevent_request event;
+    memset(&event, 0, sizeof(event));
+    event.lineoffset = config->button_line;
+    event.handleflags = GPIOHANDLE_REQUEST_INPUT;
+    event.eventflags = GPIOEVENT_REQUEST_FALLING_EDGE;
+    strncpy(event.consumer_label, "spi_upload BUTTON", sizeof(event.consumer_label) - 1);
+    if (ioctl(chip, GPIO_GET_LINEEVENT_IOCTL, &event) < 0) {
+        fprintf(stderr, "%s: BUTTON line %d: %s\n", config->gpiochip,
+                config->button_line, strerror(errno));
+        close(chip);
+        return -1;
+    }
+    priv->button_fd = event.fd;
+
+    if (config->running_line >= 0) {
+        struct gpiohandle_request handle;
+        memset(&handle, 0, sizeof(handle));
+        handle.lineoffsets[0] = config->running_line;
+        handle.lines = 1;
+        handle.flags = GPIOHANDLE_REQUEST_OUTPUT;
+        handle.default_values[0] = 0;
+        strncpy(handle.consumer_label, "spi_upload MCU_RUNNING",
+                sizeof(handle.consumer_label) - 1);
+        if (ioctl(chip, GPIO_GET_LINEHANDLE_IOCTL, &handle) < 0) {
+            fprintf(stderr, "%s: MCU_RUNNING line %d: %s\n", config->gpiochip,
+                    config->running_line, strerror(errno));
+            close(chip);
+            return -1;
+        }
+        priv->running_fd = handle.fd;
+    }
+    // the line fds stay valid without the chip
+    close(chip);
+    return 0;
+}
+
+/*-----------------------------------------------------------------------*/
+
+spi_transport_t * spi_transport_spidev_open(const spi_spidev_config_t * config)
+{
+    spi_transport_t * t = calloc(1, sizeof(spi_transport_t));
+    spidev_priv_t * priv = calloc(1, sizeof(spidev_priv_t));
+
+    priv->config = *config;
+    priv->spi_fd = -1;
+    priv->button_fd = -1;
+    priv->running_fd = -1;
+    t->name = "spidev";
+    t->wait_ready = spidev_wait_ready;
+    t->transfer = spidev_transfer;
+    t->set_running = spidev_set_running;
+    t->close = spidev_close;
+    t->priv = priv;
+
+    priv->spi_fd = open(config->device, O_RDWR);
+    if (priv->spi_fd < 0) {
+        perror(config->device);
+        spidev_close(t);
+        return NULL;
+    }
+    // the avr is a mode 0 peripheral, msb first
+    uint8_t mode = SPI_MODE_0;
+    uint8_t bits = 8;
+    uint32_t speed = config->speed_hz;
+    if (ioctl(priv->spi_fd, SPI_IOC_WR_MODE, &mode) < 0 ||
+        ioctl(priv->spi_fd, SPI_IOC_WR_BITS_PER_WORD, &bits) < 0 ||
+        ioctl(priv->spi_fd, SPI_IOC_WR_MAX_SPEED_HZ, &speed) < 0) {
+        perror(config->device);
+        spidev_close(t);
+        return NULL;
+    }
+    if (spidev_open_gpio(priv) != 0) {
+        spidev_close(t);
+        return NULL;
+    }
+    return t;
+}